@@ -1,7 +1,7 @@
 /*
  * actions.c
  * Includes the code for all the actions:
- *   add, remove, list, update, sync.
+ *   add, remove, list, query, rdeps, update, sync, gc, clean, rollback.
  *
  * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
  *
@@ -20,19 +20,46 @@
 
 #include "repo.h"
 #include "actions.h"
+#include "archive.h"
+#include "database.h"
+#include "depgraph.h"
+#include "fsutil.h"
+#include "hashmap.h"
+#include "history.h"
+#include "hooks.h"
+#include "httpd.h"
+#include "journal.h"
+#include "json.h"
+#include "manifest.h"
+#include "pkgindex.h"
+#include "pool.h"
+#include "process.h"
+#include "query.h"
+#include "scan.h"
+#include "sign.h"
+#include "split.h"
+#include "vercmp.h"
+#include "verify.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <libgen.h>
+#include <limits.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "libcassava/debug.h"
 #include "libcassava/list.h"
@@ -47,11 +74,153 @@
 #define DEBUG_FILENO_ __FILE__ " (" STRINGIFY_LEVEL0_(__LINE__) "): "
 #endif
 
+static volatile sig_atomic_t check_stopped = 0;
+
+/* Where the manifest gets the paths of package files from. */
+struct manifest_source {
+    Arguments *arg;
+    struct manifest *m;
+    HashMap *paths;         // file name to path, once it was needed
+    NodeStr *head;          // the paths in paths
+    bool scanned;
+};
+
+/* What snapshot has linked so far. */
+struct snapshot {
+    struct manifest_source src;     // to find the package files
+    const char *dir;                // where the snapshot is being taken
+    int count;
+    int retval;
+};
+
+/* The packages listed from a snapshot. */
+struct snapshot_names {
+    const char *prefix;
+    NodeStr *names;
+};
+
+/* The input of the hooks, for the journal entries up to last. */
+struct hook_input {
+    unsigned long last;
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* What replicate has done so far. */
+struct replication {
+    Arguments *arg;
+    const char *dest;
+    NodeStr *obsolete;      // paths in dest to delete once the database is published
+    int copied;
+    int retval;
+};
+
+/* A check of the files of the repository, which may be resumed. */
+struct check_state {
+    Arguments *arg;
+    struct verifier *v;
+    HashMap *paths;         // file name to path, for packages in subdirectories
+    const char *progress;   // where to save how far the check got
+    struct stat db_st;
+    unsigned long skip;     // packages of the database checked before
+    unsigned long count;    // packages of the database seen so far
+    unsigned long failed[verify_unreadable + 1];    // by the checks before
+    struct check_failure *failures;                 // found by this one
+    size_t nfailures;
+    size_t failures_size;
+    pthread_mutex_t lock;   // for failures
+    time_t saved;
+    bool stopped;           // before the end of the database
+};
+
+struct check_failure {
+    unsigned long n;        // position in the database
+    VerifyResult result;
+};
+
+/* Package names and glob patterns given to remove. */
+struct name_matcher {
+    HashMap *names;
+    char **patterns;
+    size_t npatterns;
+    regex_t regex;          // all patterns in one, if npatterns > 0
+};
+
+/* The packages to remove, as found for the patterns. */
+struct pattern_names {
+    const struct name_matcher *m;
+    HashMap *matched;       // names already in names; the value is set if it must be freed
+    NodeStr **names;
+};
+
 static int remove_files(NodeStr *head, bool noconfirm);
-static int add_package(const char *pkg_name, Arguments *arg);
-static int exec_system(const char *command, bool verbose);
+static int archive_files(NodeStr *head, const char *dir, int keep);
+static int delete_files(NodeStr *head);
+static int add_packages(char **names, int count, Arguments *arg);
+static int exec_system(char **argv, bool verbose);
+static int exec_batch(const char *tool, const char *db, char **args, size_t count, bool verbose);
+static int db_transaction(Arguments *arg, const char *tool, char **args, size_t count);
+static void clear_stage(void);
+static int lock_transaction(Arguments *arg);
+static int record_generation(Arguments *arg, unsigned long *since, unsigned long *last);
+static int sign_database(Arguments *arg, const char *path);
+static int link_database(const char *stem, const char *suffix, const char *name);
+static int run_hooks(Arguments *arg, unsigned long since, unsigned long last);
+static int hook_entry(const struct journal_entry *entry, void *data);
+static int sync_metadata(Arguments *arg, HashMap *db);
+static int sync_official(Arguments *arg, HashMap *db);
+static void print_sorted(NodeStr *head, const char *prefix);
+static void print_names(char **array, size_t len, ListFormat format);
+static char *db_stem(const char *db_name);
+static int update_aux_dbs(Arguments *arg);
+static int update_files_db(Arguments *arg, HashMap *scanned);
+static int update_links_db(Arguments *arg, HashMap *scanned);
+static char *links_path(Arguments *arg);
+static HashMap *package_paths(Arguments *arg, NodeStr **head);
+static bool check_needed(Arguments *arg, char **names, size_t count);
+static int find_packages(Arguments *arg, const char *regex, time_t newer, NodeStr **head);
+static struct pkgindex *open_index(Arguments *arg);
+static void update_index(Arguments *arg);
+static void refresh_index(Arguments *arg);
+static char *manifest_file(Arguments *arg);
+static struct manifest *load_manifest(Arguments *arg);
+static int update_manifest(Arguments *arg);
+static const char *source_path(struct manifest_source *src, const char *filename);
+static int manifest_package(Package *pkg, void *data);
+static int manifest_entry(const struct journal_entry *entry, void *data);
+static int replicate_package(const struct manifest_record *src, const struct manifest_record *dst, void *data);
+static int replicate_file(struct replication *r, const char *path);
+static char *snapshot_dir(const char *name);
+static int list_snapshots(void);
+static int list_snapshot(Arguments *arg, const char *prefix);
+static int take_snapshot(Arguments *arg, const char *dir);
+static int restore_snapshot(Arguments *arg, const char *dir);
+static int snapshot_package(Package *pkg, void *data);
+static int snapshot_name(Package *pkg, void *data);
+static void stop_check(int sig);
+static int check_package(Package *pkg, void *data);
+static void check_progress(struct check_state *state);
+static void check_report(unsigned long n, const char *path, VerifyResult result, int err, void *data);
+static void count_failures(struct check_state *state, unsigned long done, unsigned long *counts);
+static void load_progress(struct check_state *state);
+static void save_progress(struct check_state *state, unsigned long done);
+static bool is_pattern(const char *str);
+static bool is_regex(const char *str);
+static bool matcher_init(struct name_matcher *m, char **args, int count);
+static bool matcher_match(const struct name_matcher *m, const char *name);
+static bool matcher_filter(void *path, void *m);
+static void matcher_free(struct name_matcher *m);
+static void add_pattern_name(struct pattern_names *pn, char *name);
+static int pattern_package(Package *pkg, void *data);
+static const char *file_name(const char *path);
+static HashMap *read_database(const char *path);
+static int db_index_package(Package *pkg, void *data);
+static void free_package(void *pkg);
+static int compare_filenames(const void *a, const void *b);
+static int compare_basenames(const void *a, const void *b);
 static char *pkg_name(const char *input);
-static bool repo_check(Arguments *arg);
+static bool db_usable(Arguments *arg);
 static bool file_readable(const char *file);
 static bool confirm(const char *question, int def, bool noconfirm);
 
@@ -61,24 +230,59 @@ int repo_list(Arguments *arg)
 {
     debug_puts("repo_list()");
 
+    const char *prefix = arg->argc > 0 ? arg->argv[0] : "";
+
+    if (arg->snapshot != NULL)
+        return list_snapshot(arg, prefix);
+
     /* check prerequisites */
-    if (!repo_check(arg))
+    if (!db_usable(arg))
         return ERR_SYSTEM;
 
+    struct pkgindex *idx = open_index(arg);
+    if (idx != NULL) {
+        /* the index is sorted by name already, so the prefix is a range */
+        size_t count = pkgindex_count(idx);
+        size_t i = pkgindex_lower_bound(idx, prefix);
+        char **array = malloc((count - i + 1) * sizeof (char *));
+        struct pkgindex_entry entry;
+        size_t len = 0;
+
+        for (; i < count; i++) {
+            pkgindex_get(idx, i, &entry);
+            if (!cs_isprefix(prefix, entry.name))
+                break;
+            array[len++] = (char *)entry.name;
+        }
+        print_names(array, len, arg->format);
+        free(array);
+        pkgindex_close(idx);
+        return ERR_UNDEF;
+    }
+
     NodeStr *head;
     int retval = OK;
-    int count = get_filenames_filter_regex(arg->db_dir, &head, ".*" PKG_EXT);
+    int count = find_packages(arg, ".*" PKG_EXT, 0, &head);
     if (count < 0) {
         fprintf(stderr, "Error: failed to retrieve files.\n");
         retval |= ERR_SYSTEM;
     } else if (count > 0) {
         char **array;
         size_t len = list_to_array(head, (void ***)&array);
-        cs_qsort(array, len);
 
-        for (size_t i = 0; i < len; i++)
-            array[i] = pkg_name(array[i]);
-        print_columns(array, len);
+        /* files may be in subdirectories, so sort by name afterwards */
+        size_t n = 0;
+        for (size_t i = 0; i < len; i++) {
+            if ((array[n] = pkg_name(array[i])) == NULL)
+                continue;
+            if (cs_isprefix(prefix, array[n]))
+                n++;
+            else
+                free(array[n]);
+        }
+        len = n;
+        cs_qsort(array, len);
+        print_names(array, len, arg->format);
 
         // Cleanup:
         for (size_t i = 0; i < len; i++)
@@ -91,6 +295,34 @@ int repo_list(Arguments *arg)
 }
 
 
+int repo_query(Arguments *arg)
+{
+    debug_puts("repo_query()");
+
+    struct query_index *idx;
+    int count;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    idx = query_load(arg->db_path);
+    if (idx == NULL) {
+        char *errmsg = cs_strvcat("Error: read database '", arg->db_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    }
+
+    count = query_run(idx, arg->argv, arg->argc, arg->sort, stdout);
+    if (arg->verbose && count >= 0)
+        printf("%d packages matched.\n", count);
+
+    query_free(idx);
+    return count < 0 ? ERR_DEFAULT : count == 0 ? ERR_MINOR : OK;
+}
+
+
 int repo_add(Arguments *arg)
 {
     debug_puts("repo_add()");
@@ -98,13 +330,87 @@ int repo_add(Arguments *arg)
     int retval = OK;
 
     /* check prerequisites */
-    if (!repo_check(arg))
+    if (!db_usable(arg))
         return ERR_SYSTEM;
 
-    /* iterate through packages to add */
-    for (int i = 0; i < arg->argc; i++)
-        retval |= add_package(arg->argv[i], arg);
+    retval |= add_packages(arg->argv, arg->argc, arg);
+    return retval;
+}
 
+
+int repo_ingest(Arguments *arg)
+{
+    debug_puts("repo_ingest()");
+
+    const char *dir = arg->argv[0];
+    struct scan_options opt = { 0, 0, NULL, 1, NULL };
+    NodeStr *head, *names = NULL;
+    HashMap *seen;
+    char **array;
+    size_t len;
+    int retval = OK;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    if (scan_packages(dir, ".*" PKG_EXT, &opt, &head) < 0) {
+        char *errmsg = cs_strvcat("Error: read directory '", dir, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    }
+    if (head == NULL) {
+        printf("No packages found in %s; nothing to ingest.\n", dir);
+        return OK;
+    }
+
+    /* rename if possible, so that nothing is copied */
+    seen = hashmap_new(list_length(head));
+    for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        char *src = cs_strvcat(dir, "/", iter->data, NULL);
+        char *src_sig = cs_strcat(src, ".sig");
+        char *dst_sig = cs_strcat(iter->data, ".sig");
+        char *name, *version, *pkgarch;
+
+        printf("Ingesting: %s\n", iter->data);
+        if (fs_move(src, iter->data) != 0) {
+            char *errmsg = cs_strvcat("Error: move '", src, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_MINOR;
+        } else {
+            if (fs_move(src_sig, dst_sig) != 0 && errno != ENOENT) {
+                char *errmsg = cs_strvcat("Error: move '", src_sig, "'", NULL);
+                perror(errmsg);
+                free(errmsg);
+                retval |= ERR_MINOR;
+            }
+            if (package_parse_filename(iter->data, &name, &version, &pkgarch)) {
+                if (!hashmap_contains(seen, name)) {
+                    hashmap_put(seen, name, name);
+                    list_push(&names, name);
+                } else {
+                    free(name);
+                }
+                free(version);
+                free(pkgarch);
+            }
+        }
+        free(src);
+        free(src_sig);
+        free(dst_sig);
+    }
+
+    /* one transaction for everything */
+    len = list_to_array(names, (void ***)&array);
+    if (len > 0)
+        retval |= add_packages(array, len, arg);
+
+    free(array);
+    hashmap_free(seen, NULL);
+    list_free_all(&names);
+    list_free_all(&head);
     return retval;
 }
 
@@ -113,43 +419,117 @@ int repo_remove(Arguments *arg)
 {
     debug_puts("repo_remove()");
 
-    char *cmd, *argstr;
+    struct name_matcher m;
+    HashMap *matched;
+    NodeStr *head = NULL;  /* head of a linked list of filenames */
+    NodeStr *names = NULL; /* the packages to remove from the database */
+    char **array;
+    size_t len;
     int retval = OK;
 
     /* check prerequisites */
-    if (!repo_check(arg))
+    if (!db_usable(arg))
         return ERR_SYSTEM;
 
-    /* if files should be removed, remove files */
-    if (!arg->soft) {
-        char *regex;
-        NodeStr *head;  /* head of a linked list of filenames */
-        int count;
+    /* remove used to take regular expressions; refuse them rather than
+     * quietly removing nothing */
+    for (int i = 0; i < arg->argc; i++) {
+        if (is_regex(arg->argv[i])) {
+            fprintf(stderr, "Error: '%s' is a regular expression; use a package name or "
+                            "a glob pattern with *, ? and [] instead.\n", arg->argv[i]);
+            return ERR_DEFAULT;
+        }
+    }
+
+    /* names are looked up in a hash set, only patterns need matching */
+    if (!matcher_init(&m, arg->argv, arg->argc)) {
+        matcher_free(&m);
+        return ERR_DEFAULT;
+    }
+    matched = hashmap_new(arg->argc);
+    for (int i = 0; i < arg->argc; i++) {
+        char *name = arg->argv[i];
+        if (!is_pattern(name) && !hashmap_contains(matched, name)) {
+            hashmap_put(matched, name, NULL);
+            list_push(&names, name);
+        }
+    }
 
-        argstr = cs_strjoin(arg->argv, arg->argc, "|", 0);
-        regex = cs_strvcat("^(", argstr, ")", PKG_EXT, NULL);
-        count = get_filenames_filter_regex(arg->db_dir, &head, regex);
-        free(argstr);
-        free(regex);
+    struct pkgindex *idx = open_index(arg);
+    if (idx != NULL) {
+        struct pkgindex_entry entry;
+        size_t count = pkgindex_count(idx);
 
-        if (count == 0) {
-            puts("No packages (files) found; nothing to remove.");
-            list_free_all(&head);
-            return retval;
+        if (m.npatterns > 0) {
+            for (size_t i = 0; i < count; i++) {
+                pkgindex_get(idx, i, &entry);
+                if (matcher_match(&m, entry.name))
+                    list_push(&head, cs_strclone(entry.path));
+            }
+        } else {
+            for (NodeStr *iter = names; iter != NULL; iter = iter->next) {
+                ssize_t j = pkgindex_find(idx, iter->data);
+                for (; j >= 0 && (size_t)j < count; j++) {
+                    pkgindex_get(idx, j, &entry);
+                    if (strcmp(entry.name, iter->data) != 0)
+                        break;
+                    list_push(&head, cs_strclone(entry.path));
+                }
+            }
+        }
+        pkgindex_close(idx);
+    } else if (find_packages(arg, ".*" PKG_EXT, 0, &head) < 0) {
+        fprintf(stderr, "Error: failed to retrieve files.\n");
+        retval |= ERR_SYSTEM;
+    } else {
+        /* a single pass over the files, parsing each name once */
+        list_filter(&head, matcher_filter, &m);
+    }
+
+    /* patterns stand for the packages in the database and the directory */
+    if (m.npatterns > 0) {
+        struct pattern_names pn = { &m, matched, &names };
+        db_read(arg->db_path, pattern_package, &pn);
+        for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+            char *name, *version, *pkgarch;
+            if (!package_parse_filename(file_name(iter->data), &name, &version, &pkgarch))
+                continue;
+            add_pattern_name(&pn, name);
+            free(version);
+            free(pkgarch);
         }
+    }
 
-        remove_files(head, arg->noconfirm);
-        list_free_all(&head);
+    len = list_to_array(names, (void ***)&array);
+    if (!check_needed(arg, array, len)) {
+        retval |= ERR_DEFAULT;
+        goto cleanup;
     }
 
-    /* remove entry from database */
-    argstr = cs_strjoin(arg->argv, arg->argc, " ", 0);
-    cmd = cs_strvcat(SYSTEM_REPO_REMOVE, " ", arg->db_path, " ", argstr, NULL);
-    retval |= exec_system(cmd, arg->verbose);
+    /* if files should be removed, remove files */
+    if (!arg->soft) {
+        if (head == NULL) {
+            puts("No packages (files) found; nothing to remove.");
+            goto cleanup;
+        }
+        remove_files(head, arg->noconfirm);
+    }
 
-    free(cmd);
-    free(argstr);
+    /* remove entries from database */
+    if (len > 0) {
+        retval |= db_transaction(arg, SYSTEM_REPO_REMOVE, array, len);
+    }
 
+cleanup:
+    free(array);
+    list_free_all(&head);
+    /* names from patterns were allocated, the others belong to argv */
+    for (NodeStr *iter = names; iter != NULL; iter = iter->next)
+        if (hashmap_get(matched, iter->data) != NULL)
+            free(iter->data);
+    list_free_nodes(&names);
+    hashmap_free(matched, NULL);
+    matcher_free(&m);
     return retval;
 }
 
@@ -164,7 +544,7 @@ int repo_update(Arguments *arg)
     NodeStr *head;
 
     /* check prerequisites */
-    if (!repo_check(arg))
+    if (!db_usable(arg))
         return ERR_SYSTEM;
 
     /* get age of database */
@@ -177,16 +557,8 @@ int repo_update(Arguments *arg)
     }
     db_time = statbuf.st_mtime;
 
-    /* get all files younger than db_time */
-    struct filter_time_args args = { db_time, 1 };
-    retval = get_filenames_filter(".", &head, filter_mtime, (void *)&args);
-    if (retval == -1)
-        goto error;
-
-    /* filter all files out that are not packages */
-    char *pkgregex = cs_strvcat("^", PKG_NAME PKG_EXT, NULL);
-    retval = list_filter_regex(&head, pkgregex);
-    free(pkgregex);
+    /* get all packages younger than db_time */
+    retval = find_packages(arg, "^" PKG_NAME PKG_EXT, db_time, &head);
     if (retval == -1) {
         goto error;
     } else if (retval == 0) {
@@ -198,29 +570,22 @@ int repo_update(Arguments *arg)
     list_println(head, "    ");
     printf("\n");
 
-    /* add packages */
+    /* add packages, add_packages ignores repeated names */
     NodeStr *short_head = NULL;
     for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
         char *name = pkg_name(iter->data);
-        if (name != NULL) {
-            /*
-             * If name is not in $short_head, then it is added, and will be freed
-             * later by list_free_all(&short_head). Otherwise it is not added, and
-             * we need to delete it ourselves.
-             */
-            if (list_search(short_head, name) == NULL) {
-                list_push(&short_head, name);
-                add_package(name, arg);
-            } else {
-                free(name);
-            }
-        }
+        if (name != NULL)
+            list_push(&short_head, name);
     }
+    char **names;
+    size_t len = list_to_array(short_head, (void ***)&names);
+    retval = add_packages(names, len, arg);
+    free(names);
 
     /* free list and return */
     list_free_all(&short_head);
     list_free_all(&head);
-    return OK;
+    return retval;
 
 error:
     fprintf(stderr, "Fatal Error: " DEBUG_FILENO_ "cannot continue, exiting.\n");
@@ -232,58 +597,2111 @@ int repo_sync(Arguments *arg)
 {
     debug_puts("repo_sync()");
 
-    /* check prerequisites */
-    if (!repo_check(arg))
-        return ERR_SYSTEM;
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    if (arg->metadata == NULL && arg->official == NULL) {
+        fprintf(stderr, "Error: sync requires an AUR metadata dump given with --metadata=FILE,\n"
+                        "       and/or --official to compare against the pacman sync databases.\n");
+        return ERR_DEFAULT;
+    }
+
+    int retval = OK;
+    HashMap *db = read_database(arg->db_path);
+    if (db == NULL)
+        return ERR_SYSTEM;
+
+    if (arg->metadata != NULL)
+        retval |= sync_metadata(arg, db);
+    if (arg->official != NULL)
+        retval |= sync_official(arg, db);
+
+    hashmap_free(db, free_package);
+    return retval;
+}
+
+int repo_serve(Arguments *arg)
+{
+    debug_puts("repo_serve()");
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    if (httpd_serve(arg->http, arg->verbose) != 0) {
+        char *errmsg = cs_strvcat("Error: listen on '", arg->http, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    }
+    return OK;
+}
+
+
+int repo_log(Arguments *arg)
+{
+    debug_printf("repo_log(%lu)\n", arg->since);
+
+    char *stem = db_stem(arg->db_name);
+    char *journal = cs_strcat(stem, ".journal");
+    int retval = OK;
+
+    if (journal_print(journal, arg->since, stdout) < 0) {
+        char *errmsg = cs_strvcat("Error: read journal '", arg->db_dir, journal, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_SYSTEM;
+    }
+    free(journal);
+    free(stem);
+    return retval;
+}
+
+
+int repo_manifest(Arguments *arg)
+{
+    debug_puts("repo_manifest()");
+
+    char hex[SHA256_HEX_LENGTH];
+    struct manifest *m;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    m = load_manifest(arg);
+    if (m == NULL)
+        return ERR_SYSTEM;
+    manifest_root(m, hex);
+    printf("%s  %zu packages\n", hex, manifest_count(m));
+    manifest_free(m);
+    return OK;
+}
+
+
+int repo_replicate(Arguments *arg)
+{
+    debug_printf("repo_replicate(%s)\n", arg->argv[0]);
+
+    const char *dest = arg->argv[0];
+    struct replication r = { arg, dest, NULL, 0, OK };
+    struct manifest *src, *dst;
+    char *stem = db_stem(arg->db_name);
+    const char *ext = strstr(arg->db_name, ".db") != NULL ? strstr(arg->db_name, ".db") + 3 : "";
+    char *files_name = cs_strvcat(stem, ".files", ext, NULL);
+    char *links_name = cs_strcat(stem, ".links");
+    char *journal_name = cs_strcat(stem, ".journal");
+    char *files_sig = cs_strcat(files_name, ".sig");
+    char *db_sig = cs_strcat(arg->db_name, ".sig");
+    char *metadata[] = { links_name, files_name, files_sig, journal_name, arg->db_name, db_sig };
+    char *state_dir = cs_strvcat(dest, "/" STATE_DIR, NULL);
+    char *dest_db = cs_strvcat(dest, "/", arg->db_name, NULL);
+    char *dest_manifest, *path;
+    int count, lock, deleted = 0;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    /* keep transactions from changing the repository while it is copied */
+    lock = open(STATE_DIR "/lock", O_RDONLY | O_CLOEXEC);
+    if (lock >= 0)
+        flock(lock, LOCK_SH);
+
+    src = load_manifest(arg);
+    if (src == NULL || (mkdir(dest, 0755) != 0 && errno != EEXIST)
+        || (mkdir(state_dir, 0755) != 0 && errno != EEXIST)) {
+        char *errmsg = cs_strvcat("Error: prepare '", dest, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        r.retval = ERR_SYSTEM;
+        goto cleanup;
+    }
+
+    /* without a manifest, dest is compared to an empty repository; files
+     * that are already there are not copied again */
+    path = manifest_file(arg);
+    dest_manifest = cs_strvcat(dest, "/", path, NULL);
+    free(path);
+    dst = manifest_open(dest_manifest, dest_db);
+    if (dst == NULL)
+        dst = manifest_new();
+
+    count = manifest_diff(src, dst, replicate_package, &r);
+    if (arg->verbose)
+        printf("%d packages differ from %s.\n", count, dest);
+
+    /* the packages are in place, so publish the database last */
+    for (size_t i = 0; i < sizeof metadata / sizeof metadata[0] && r.retval == OK; i++)
+        if (file_readable(metadata[i]))
+            r.retval |= replicate_file(&r, metadata[i]);
+    for (size_t i = 0; i < 4 && r.retval == OK && *ext != '\0'; i++) {
+        const char *suffixes[] = { ".db", ".files", ".db.sig", ".files.sig" };
+        char *link = cs_strcat(stem, suffixes[i]);
+        char target[PATH_MAX];
+        ssize_t len = readlink(link, target, sizeof target - 1);
+        if (len > 0) {
+            char *dest_link = cs_strvcat(dest, "/", link, NULL);
+            target[len] = '\0';
+            if (fs_symlink(target, dest_link) != 0) {
+                char *errmsg = cs_strvcat("Error: symlink '", dest_link, "'", NULL);
+                perror(errmsg);
+                free(errmsg);
+                r.retval |= ERR_MINOR;
+            }
+            free(dest_link);
+        }
+        free(link);
+    }
+
+    if (r.retval == OK && manifest_write(src, dest_manifest, dest_db) != 0) {
+        char *errmsg = cs_strvcat("Error: write manifest '", dest_manifest, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        r.retval |= ERR_MINOR;
+    }
+
+    /* only now is nothing in dest referring to the old files anymore */
+    if (r.retval == OK && !arg->soft) {
+        for (NodeStr *iter = r.obsolete; iter != NULL; iter = iter->next) {
+            char *sig = cs_strcat(iter->data, ".sig");
+            if (arg->verbose)
+                printf("Deleting: %s\n", iter->data);
+            if (unlink(iter->data) == 0)
+                deleted++;
+            else if (errno != ENOENT) {
+                char *errmsg = cs_strvcat("Error: delete '", iter->data, "'", NULL);
+                perror(errmsg);
+                free(errmsg);
+                r.retval |= ERR_MINOR;
+            }
+            unlink(sig);
+            free(sig);
+        }
+    }
+    printf("Replicated %d of %zu packages to %s, deleted %d files.\n",
+           r.copied, manifest_count(src), dest, deleted);
+
+    manifest_free(dst);
+    free(dest_manifest);
+cleanup:
+    manifest_free(src);
+    if (lock >= 0)
+        close(lock);
+    list_free_all(&r.obsolete);
+    free(dest_db);
+    free(state_dir);
+    free(db_sig);
+    free(files_sig);
+    free(journal_name);
+    free(links_name);
+    free(files_name);
+    free(stem);
+    return r.retval;
+}
+
+
+int repo_check(Arguments *arg)
+{
+    debug_puts("repo_check()");
+
+    struct check_state state;
+    struct sigaction sa, old_int, old_term;
+    char *stem = db_stem(arg->db_name);
+    char *progress = cs_strvcat(STATE_DIR "/", stem, ".check", NULL);
+    NodeStr *head = NULL;
+    unsigned long done, counts[verify_unreadable + 1], failures = 0;
+    int retval = OK, ret;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    memset(&state, 0, sizeof state);
+    state.arg = arg;
+    state.progress = progress;
+    pthread_mutex_init(&state.lock, NULL);
+    if (stat(arg->db_name, &state.db_st) != 0 || (mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST)) {
+        char *errmsg = cs_strvcat("Error: prepare '", arg->db_dir, STATE_DIR, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        pthread_mutex_destroy(&state.lock);
+        free(progress);
+        free(stem);
+        return ERR_SYSTEM;
+    }
+
+    /* a check of the same database that was interrupted goes on from there */
+    load_progress(&state);
+    if (state.skip > 0)
+        printf("Resuming the check after %lu packages.\n", state.skip);
+    state.paths = package_paths(arg, &head);
+    state.saved = time(NULL);
+
+    /* stop cleanly on ^C, so that the progress can be saved */
+    check_stopped = 0;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = stop_check;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    state.v = verifier_start(arg->jobs, check_report, &state);
+    ret = db_read(arg->db_name, check_package, &state);
+
+    /* the last files may take a while, so keep saving the progress */
+    while (ret >= 0 && !check_stopped && state.skip + verifier_done(state.v) < state.count) {
+        nanosleep(&(struct timespec){ 0, 100000000 }, NULL);
+        check_progress(&state);
+    }
+    done = state.skip + verifier_finish(state.v, check_stopped);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    count_failures(&state, done, counts);
+    for (int i = verify_ok + 1; i <= verify_unreadable; i++)
+        failures += counts[i];
+    if (ret < 0 && !state.stopped) {
+        char *errmsg = cs_strvcat("Error: read database '", arg->db_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_SYSTEM;
+    } else if (state.stopped || done < state.count) {
+        save_progress(&state, done);
+        printf("Interrupted after %lu packages; run check again to resume.\n", done);
+        retval |= ERR_MINOR;
+    } else {
+        unlink(progress);
+        printf("Checked %lu packages: %lu missing, %lu truncated, %lu mismatched, %lu unreadable.\n",
+               done, counts[verify_missing], counts[verify_truncated],
+               counts[verify_size] + counts[verify_checksum], counts[verify_unreadable]);
+    }
+    if (failures > 0)
+        retval |= ERR_MINOR;
+
+    hashmap_free(state.paths, NULL);
+    list_free_all(&head);
+    pthread_mutex_destroy(&state.lock);
+    free(state.failures);
+    free(progress);
+    free(stem);
+    return retval;
+}
+
+
+int repo_split(Arguments *arg)
+{
+    debug_puts("repo_split()");
+
+    struct scan_options opt = { arg->max_depth, 0, arg->pool_dir, arg->jobs, NULL };
+    char *stem = db_stem(arg->db_name);
+    const char *ext = strstr(arg->db_name, ".db") != NULL ? strstr(arg->db_name, ".db") + 3 : "";
+    NodeStr *files;
+    int lock = -1, count, retval = OK;
+
+    /* one scan for all the databases */
+    if (scan_packages(".", ".*" PKG_EXT, &opt, &files) < 0) {
+        char *errmsg = cs_strvcat("Error: read directory '", arg->db_dir, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        free(stem);
+        return ERR_SYSTEM;
+    }
+
+    /* not while a transaction is running */
+    if ((mkdir(STATE_DIR, 0755) == 0 || errno == EEXIST)
+        && (lock = open(STATE_DIR "/lock", O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) >= 0)
+        flock(lock, LOCK_EX);
+
+    count = split_databases(stem, ext, files, arg->jobs, arg->verbose);
+    if (count < 0)
+        retval = ERR_SYSTEM;
+    else if (count == 0)
+        printf("No packages for a specific architecture found; nothing to split.\n");
+
+    if (lock >= 0)
+        close(lock);
+    list_free_all(&files);
+    free(stem);
+    return retval;
+}
+
+
+int repo_snapshot(Arguments *arg)
+{
+    debug_puts("repo_snapshot()");
+
+    char *dir;
+    int retval;
+
+    if (arg->argc == 0)
+        return list_snapshots();
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+    dir = snapshot_dir(arg->argv[0]);
+    if (dir == NULL)
+        return ERR_DEFAULT;
+
+    if (arg->restore)
+        retval = restore_snapshot(arg, dir);
+    else
+        retval = take_snapshot(arg, dir);
+    free(dir);
+    return retval;
+}
+
+int repo_gc(Arguments *arg)
+{
+    debug_puts("repo_gc()");
+
+    NodeStr *head;
+    int count;
+
+    if (arg->pool_dir == NULL) {
+        fprintf(stderr, "Error: gc requires a package pool, given by pool_dir in the configuration file.\n");
+        return ERR_DEFAULT;
+    }
+
+    count = pool_unreferenced(arg->pool_dir, &head);
+    if (count < 0) {
+        char *errmsg = cs_strvcat("Error: read pool '", arg->pool_dir, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    } else if (count == 0) {
+        puts("No unreferenced objects in the pool; nothing to remove.");
+        return OK;
+    }
+
+    printf("Found %d unreferenced objects in the pool.\n", count);
+    if (arg->soft) {
+        list_println(head, "    ");
+        list_free_all(&head);
+        return OK;
+    }
+
+    int retval = remove_files(head, arg->noconfirm);
+    list_free_all(&head);
+    return retval;
+}
+
+int repo_rdeps(Arguments *arg)
+{
+    debug_puts("repo_rdeps()");
+
+    struct depgraph *g;
+    NodeStr *head;
+    char *path;
+    int retval = OK;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    path = links_path(arg);
+    g = depgraph_load(arg->db_path, path);
+    free(path);
+    if (g == NULL) {
+        char *errmsg = cs_strvcat("Error: read database '", arg->db_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    }
+
+    for (int i = 0; i < arg->argc; i++)
+        if (!depgraph_contains(g, arg->argv[i])) {
+            fprintf(stderr, "Error: package not in database: %s\n", arg->argv[i]);
+            retval |= ERR_DEFAULT;
+        }
+
+    if (depgraph_rdeps(g, arg->argv, arg->argc, &head) < 0) {
+        fprintf(stderr, "Warning: dependency cycle; the last packages are not in order.\n");
+        retval |= ERR_MINOR;
+    }
+    list_println(head, "");
+
+    list_free_nodes(&head);
+    depgraph_free(g);
+    return retval;
+}
+
+
+int repo_clean(Arguments *arg)
+{
+    debug_puts("repo_clean()");
+
+    HashMap *db;
+    NodeStr *head;
+    NodeStr *orphans = NULL, *superseded = NULL, *pending = NULL, *missing = NULL;
+    NodeStr *delete = NULL;
+    int retval = OK;
+    int count;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    db = read_database(arg->db_path);
+    if (db == NULL)
+        return ERR_SYSTEM;
+
+    count = find_packages(arg, ".*" PKG_EXT, 0, &head);
+    if (count < 0) {
+        fprintf(stderr, "Error: failed to retrieve files.\n");
+        hashmap_free(db, free_package);
+        return ERR_SYSTEM;
+    }
+
+    HashMap *newer = hashmap_new(16);
+
+    /* sort both sides by file name ... */
+    char **files;
+    size_t nfiles = list_to_array(head, (void ***)&files);
+    qsort(files, nfiles, sizeof (char *), compare_basenames);
+
+    Package **pkgs = malloc((db->count + 1) * sizeof (Package *));
+    size_t npkgs = 0;
+    hashmap_foreach(db, e) {
+        Package *pkg = e->value;
+        if (pkg->filename != NULL)
+            pkgs[npkgs++] = pkg;
+    }
+    qsort(pkgs, npkgs, sizeof (Package *), compare_filenames);
+
+    /* ... and merge them in a single pass */
+    size_t i = 0, j = 0;
+    while (i < nfiles || j < npkgs) {
+        int cmp = i == nfiles ? 1 : j == npkgs ? -1 : strcmp(file_name(files[i]), pkgs[j]->filename);
+        if (cmp == 0) {
+            i++;
+            j++;
+        } else if (cmp > 0) {
+            /* unless a newer file is waiting for update (checked below) */
+            list_push(&missing, pkgs[j++]->name);
+        } else {
+            /* a file not in the database: older version, newer version, or orphan */
+            char *name, *version;
+            Package *pkg = NULL;
+            if (package_parse_filename(files[i], &name, &version, NULL)) {
+                pkg = hashmap_get(db, name);
+                if (pkg != NULL && pkg->version != NULL && vercmp(version, pkg->version) > 0) {
+                    list_push(&pending, files[i]);
+                    hashmap_put(newer, pkg->name, pkg);
+                }
+                else if (pkg != NULL)
+                    list_push(&superseded, files[i]);
+                free(name);
+                free(version);
+            }
+            if (pkg == NULL)
+                list_push(&orphans, files[i]);
+            i++;
+        }
+    }
+
+    for (NodeStr **iter = &missing; *iter != NULL;) {
+        if (hashmap_contains(newer, (*iter)->data))
+            list_pop(iter);
+        else
+            iter = &(*iter)->next;
+    }
+
+#define _report(L, M) \
+    if (L != NULL) { \
+        printf(M, list_length(L)); \
+        list_println(L, "    "); \
+    }
+    _report(orphans, "Found %zu files that do not belong to any package in the database:\n");
+    _report(superseded, "Found %zu files superseded by the version in the database:\n");
+    _report(pending, "Found %zu files newer than the database (not removed; see update):\n");
+    _report(missing, "Found %zu packages in the database whose file is missing:\n");
+#undef _report
+
+    if (orphans == NULL && superseded == NULL && missing == NULL) {
+        puts("Repository is clean: nothing to do.");
+    } else if (!arg->soft && confirm("Clean up the repository as listed above?", 1, arg->noconfirm)) {
+        /* superseded files are older versions, which rollback may need;
+         * everything else goes (with its signature) in one batch */
+        NodeStr *lists[] = { orphans, arg->keep_versions > 0 ? NULL : superseded };
+        for (size_t l = 0; l < sizeof lists / sizeof lists[0]; l++) {
+            for (NodeStr *iter = lists[l]; iter != NULL; iter = iter->next) {
+                char *sig = cs_strcat(iter->data, ".sig");
+                list_push(&delete, cs_strclone(iter->data));
+                if (file_readable(sig))
+                    list_push(&delete, sig);
+                else
+                    free(sig);
+            }
+        }
+        retval |= delete_files(delete);
+        if (arg->keep_versions > 0)
+            retval |= archive_files(superseded, arg->db_dir, arg->keep_versions);
+
+        /* the transaction brings the index up to date as well */
+        if (missing != NULL) {
+            char **names;
+            size_t len = list_to_array(missing, (void ***)&names);
+            retval |= db_transaction(arg, SYSTEM_REPO_REMOVE, names, len);
+            free(names);
+        } else {
+            refresh_index(arg);
+        }
+    }
+
+    list_free_all(&delete);
+    list_free_nodes(&orphans);
+    list_free_nodes(&superseded);
+    list_free_nodes(&pending);
+    list_free_nodes(&missing);
+    free(pkgs);
+    free(files);
+    list_free_all(&head);
+    hashmap_free(newer, NULL);
+    hashmap_free(db, free_package);
+    return retval;
+}
+
+int repo_rollback(Arguments *arg)
+{
+    debug_puts("repo_rollback()");
+
+    NodeStr *restored = NULL, *current = NULL;
+    HashMap *db;
+    int retval = OK;
+
+    /* check prerequisites */
+    if (!db_usable(arg))
+        return ERR_SYSTEM;
+
+    db = read_database(arg->db_path);
+    if (db == NULL)
+        return ERR_SYSTEM;
+
+    /* find and restore the archived files, using only the version indexes */
+    for (int i = 0; i < arg->argc; i++) {
+        char *name = cs_substr(arg->argv[i], 0, strcspn(arg->argv[i], "="));
+        const char *version = strchr(arg->argv[i], '=');
+        Package *pkg = hashmap_get(db, name);
+        NodeStr *versions;
+        char *filename = NULL;
+
+        if (version != NULL)
+            version++;
+        if (pkg == NULL || pkg->version == NULL) {
+            fprintf(stderr, "Error: package not in database: %s\n", name);
+            retval |= ERR_DEFAULT;
+            free(name);
+            continue;
+        }
+
+        if (history_versions(arg->db_dir, name, &versions) < 0) {
+            char *errmsg = cs_strvcat("Error: read version index of '", name, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_SYSTEM;
+        }
+
+        /* the index is ordered from newest to oldest */
+        for (NodeStr *iter = versions; iter != NULL && filename == NULL; iter = iter->next) {
+            char *v;
+            if (!package_parse_filename(iter->data, NULL, &v, NULL))
+                continue;
+            if (version != NULL ? strcmp(v, version) == 0 : vercmp(v, pkg->version) < 0)
+                filename = iter->data;
+            free(v);
+        }
+
+        if (filename == NULL && version != NULL) {
+            fprintf(stderr, "Error: version %s of %s is not archived\n", version, name);
+            retval |= ERR_DEFAULT;
+        } else if (filename == NULL) {
+            fprintf(stderr, "Error: no archived version of %s older than %s\n", name, pkg->version);
+            retval |= ERR_DEFAULT;
+        } else if (history_restore(arg->db_dir, filename) != 0) {
+            char *errmsg = cs_strvcat("Error: restore '", filename, "' from archive", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_SYSTEM;
+        } else {
+            printf("Restoring: %s (replacing %s)\n", filename, pkg->version);
+            list_push(&restored, cs_strclone(filename));
+            if (pkg->filename != NULL)
+                list_push(&current, cs_strclone(pkg->filename));
+        }
+
+        list_free_all(&versions);
+        free(name);
+    }
+
+    /* point the database to all restored files at once */
+    if (restored != NULL) {
+        char **files;
+        size_t len = list_to_array(restored, (void ***)&files);
+        int ret = db_transaction(arg, SYSTEM_REPO_ADD, files, len);
+        free(files);
+
+        if (ret != OK) {
+            /* the database is unchanged, so put everything back */
+            fprintf(stderr, "Error: failed to update database, moving files back into the archive.\n");
+            for (NodeStr *iter = restored; iter != NULL; iter = iter->next)
+                history_archive(arg->db_dir, iter->data, INT_MAX, NULL);
+            retval |= ret;
+        } else {
+            /* keep the newer versions around, so that we can go forward again */
+            retval |= archive_files(current, arg->db_dir,
+                                    arg->keep_versions > 0 ? arg->keep_versions : INT_MAX);
+            refresh_index(arg);
+        }
+    }
+
+    list_free_all(&restored);
+    list_free_all(&current);
+    hashmap_free(db, free_package);
+    return retval;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * db_usable: print an error message and quit in case there is anything
+ * wrong with db_name and db_dir given in the configuration file.
+ */
+static bool db_usable(Arguments *arg)
+{
+    debug_puts("db_usable()");
+
+    if (!file_readable(arg->db_path)) {
+        fprintf(stderr, "Error: cannot open database '%s'\n", arg->db_path);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * read_database: read all packages in the database at path into a map from
+ * package name to Package. Returns NULL if the database could not be read.
+ */
+static HashMap *read_database(const char *path)
+{
+    debug_printf("read_database(%s)\n", path);
+
+    HashMap *map = hashmap_new(1024);
+    if (db_read(path, db_index_package, map) < 0) {
+        char *errmsg = cs_strvcat("Error: ", DEBUG_FILENO_, "read database '", path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        hashmap_free(map, free_package);
+        return NULL;
+    }
+    return map;
+}
+
+
+/*
+ * sync_metadata: stream the AUR metadata dump given by arg->metadata and
+ * print every package in the database for which the AUR has a newer version.
+ * Each object in the dump costs a single lookup in a map of the database.
+ */
+struct sync_args {
+    HashMap *db;
+    NodeStr *outdated;
+    int found;
+};
+
+static int sync_compare(char **values, void *data)
+{
+    struct sync_args *args = data;
+    const char *name = values[0], *version = values[1];
+
+    if (name == NULL || version == NULL)
+        return 0;
+
+    Package *pkg = hashmap_get(args->db, name);
+    if (pkg == NULL || pkg->version == NULL)
+        return 0;
+
+    args->found++;
+    if (vercmp(version, pkg->version) > 0)
+        list_push(&args->outdated, cs_strvcat(name, " ", pkg->version, " -> ", version, NULL));
+    return 0;
+}
+
+static int sync_metadata(Arguments *arg, HashMap *db)
+{
+    debug_puts("sync_metadata()");
+
+    static const char *keys[] = { "Name", "Version" };
+    struct sync_args args = { db, NULL, 0 };
+    struct archive *ar;
+    int retval = OK;
+    int count;
+
+    ar = archive_open(arg->metadata);
+    if (ar == NULL) {
+        char *errmsg = cs_strvcat("Error: open '", arg->metadata, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    }
+
+    count = json_read_objects(ar, keys, 2, sync_compare, &args);
+    if (archive_close(ar) != 0 || count < 0) {
+        fprintf(stderr, "Error: cannot parse AUR metadata '%s'\n", arg->metadata);
+        retval |= ERR_DEFAULT;
+    } else {
+        if (arg->verbose)
+            printf("Compared %d AUR packages against %zu in the database; %zu not in the AUR.\n",
+                   count, db->count, db->count - args.found);
+
+        if (args.outdated == NULL) {
+            printf("All packages are up-to-date with the AUR.\n");
+        } else {
+            printf("Found %zu outdated packages:\n", list_length(args.outdated));
+            print_sorted(args.outdated, "    ");
+        }
+    }
+
+    list_free_all(&args.outdated);
+    return retval;
+}
+
+
+/*
+ * sync_official: find the packages in the database that are also available
+ * from the official repositories, i.e. from the pacman sync databases in
+ * arg->official. Each official package is checked by name and by everything
+ * it provides against the database in O(1), while the sync databases are
+ * streamed only once.
+ */
+struct official_args {
+    HashMap *db;
+    const char *repo;       // name of the sync database being read
+    NodeStr *shadowed;
+};
+
+static void official_match(struct official_args *args, Package *official, const char *name, bool provided)
+{
+    Package *pkg = hashmap_get(args->db, name);
+    if (pkg == NULL || pkg->version == NULL || official->version == NULL)
+        return;
+
+    char *line;
+    if (provided)
+        line = cs_strvcat(pkg->name, " ", pkg->version, ": provided by ",
+                          args->repo, "/", official->name, " ", official->version, NULL);
+    else if (vercmp(official->version, pkg->version) > 0)
+        line = cs_strvcat(pkg->name, " ", pkg->version, ": older than ",
+                          args->repo, "/", official->name, " ", official->version, NULL);
+    else
+        line = cs_strvcat(pkg->name, " ", pkg->version, ": shadows ",
+                          args->repo, "/", official->name, " ", official->version, NULL);
+    list_push(&args->shadowed, line);
+}
+
+static int official_compare(Package *official, void *data)
+{
+    struct official_args *args = data;
+
+    if (official->name != NULL)
+        official_match(args, official, official->name, false);
+
+    /* provides may carry a version, e.g. "libfoo.so=1-64" or "foo=1.2" */
+    for (NodeStr *iter = official->provides; iter != NULL; iter = iter->next) {
+        char *name = cs_substr(iter->data, 0, strcspn(iter->data, "<>="));
+        if (official->name == NULL || strcmp(name, official->name) != 0)
+            official_match(args, official, name, true);
+        free(name);
+    }
+
+    package_free(official);
+    return 0;
+}
+
+static int sync_official(Arguments *arg, HashMap *db)
+{
+    debug_puts("sync_official()");
+
+    struct official_args args = { db, NULL, NULL };
+    NodeStr *head;
+    int retval = OK;
+    int count;
+
+    count = get_filenames_filter_regex(arg->official, &head, "\\.db$");
+    if (count < 0) {
+        char *errmsg = cs_strvcat("Error: read directory '", arg->official, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        return ERR_SYSTEM;
+    } else if (count == 0) {
+        fprintf(stderr, "Error: no sync databases found in '%s'\n", arg->official);
+        return ERR_DEFAULT;
+    }
+
+    /* our own database might be configured in pacman.conf, so skip it */
+    char *stem = db_stem(arg->db_name);
+
+    for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        char *repo = cs_substr(iter->data, 0, strlen(iter->data) - 3);
+        if (strcmp(repo, stem) == 0) {
+            free(repo);
+            continue;
+        }
+
+        char *path = cs_strvcat(arg->official, "/", iter->data, NULL);
+        args.repo = repo;
+        if (db_read(path, official_compare, &args) < 0) {
+            char *errmsg = cs_strvcat("Error: read database '", path, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_MINOR;
+        } else if (arg->verbose) {
+            printf("Compared against sync database: %s\n", repo);
+        }
+        free(path);
+        free(repo);
+    }
+
+    if (args.shadowed == NULL) {
+        printf("No packages are available from the official repositories.\n");
+    } else {
+        printf("Found %zu packages available from the official repositories:\n", list_length(args.shadowed));
+        print_sorted(args.shadowed, "    ");
+    }
+
+    free(stem);
+    list_free_all(&args.shadowed);
+    list_free_all(&head);
+    return retval;
+}
+
+
+/*
+ * update_aux_dbs: bring the soname index and, with --files, the files
+ * database up to date with the database. A package that is new to both is
+ * read once, for its sonames and its file list together.
+ */
+static int update_aux_dbs(Arguments *arg)
+{
+    HashMap *scanned = arg->files ? hashmap_new(64) : NULL;
+    int retval = OK;
+
+    retval |= update_links_db(arg, scanned);
+    if (arg->files) {
+        retval |= update_files_db(arg, scanned);
+        hashmap_foreach(scanned, e)
+            free((char *)e->key);
+        hashmap_free(scanned, free);
+    }
+    return retval;
+}
+
+/*
+ * update_files_db: regenerate the files database <stem>.files.tar.* next to
+ * the database, for use by pacman -F; like repo-add, a symlink <stem>.files
+ * is created as well. The packages in scanned have been read already. It is
+ * written and signed in STAGE_DIR, so the caller holds the transaction lock,
+ * and published together with its signature.
+ */
+static int update_files_db(Arguments *arg, HashMap *scanned)
+{
+    debug_puts("update_files_db()");
+
+    char *stem = db_stem(arg->db_name);
+    const char *ext = arg->db_name + strlen(stem) + strlen(".db");
+    char *files_name = cs_strvcat(stem, ".files", ext, NULL);
+    char *files_path = cs_strcat(arg->db_dir, files_name);
+    char *files_sig = cs_strcat(files_name, ".sig");
+    char *staged = cs_strvcat(STAGE_DIR "/", files_name, NULL);
+    char *staged_sig = cs_strcat(staged, ".sig");
+    NodeStr *head;
+    HashMap *paths = package_paths(arg, &head);
+    int retval = OK;
+    int count;
+
+    if (arg->verbose) printf("Writing files database: %s\n", files_path);
+    count = db_write_files(arg->db_path, files_path, staged, arg->db_dir, paths, arg->jobs, scanned);
+    if (count < 0) {
+        char *errmsg = cs_strvcat("Error: write files database '", files_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_SYSTEM;
+    } else {
+        if (arg->verbose) printf("Read %d package archives for the files database.\n", count);
+        if (arg->sign_key != NULL)
+            retval |= sign_database(arg, staged);
+        if (retval != OK) {
+            fprintf(stderr, "Error: signing failed; the files database is unchanged.\n");
+        } else if (fs_publish_signed(staged, files_name, NULL, arg->sign_key != NULL ? staged_sig : NULL,
+                                     files_sig) != 0) {
+            char *errmsg = cs_strvcat("Error: publish '", files_path, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_SYSTEM;
+        } else {
+            if (arg->sign_key == NULL)
+                sign_database(arg, files_name);
+            if (*ext != '\0') {
+                retval |= link_database(stem, ".files", files_name);
+                retval |= link_database(stem, ".files.sig", files_sig);
+            }
+        }
+    }
+
+    if (paths != NULL)
+        hashmap_free(paths, NULL);
+    list_free_all(&head);
+    free(staged_sig);
+    free(staged);
+    free(files_sig);
+    free(files_path);
+    free(files_name);
+    free(stem);
+    return retval;
+}
+
+
+/*
+ * update_links_db: bring the soname index <stem>.links next to the database
+ * up to date, which only reads the packages that are new to it; their files
+ * entries are put in scanned, if it is not NULL.
+ */
+static int update_links_db(Arguments *arg, HashMap *scanned)
+{
+    debug_puts("update_links_db()");
+
+    char *path = links_path(arg);
+    NodeStr *head;
+    HashMap *paths = package_paths(arg, &head);
+    int retval = OK;
+    int count;
+
+    count = depgraph_update(arg->db_path, path, arg->db_dir, paths, arg->jobs, scanned);
+    if (count < 0) {
+        char *errmsg = cs_strvcat("Error: write soname index '", path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_MINOR;
+    } else if (arg->verbose) {
+        printf("Read %d package archives for the soname index.\n", count);
+    }
+
+    if (paths != NULL)
+        hashmap_free(paths, NULL);
+    list_free_all(&head);
+    free(path);
+    return retval;
+}
+
+/*
+ * links_path: the path of the soname index belonging to the database.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *links_path(Arguments *arg)
+{
+    char *stem = db_stem(arg->db_name);
+    char *path = cs_strvcat(arg->db_dir, stem, ".links", NULL);
+    free(stem);
+    return path;
+}
+
+/*
+ * package_paths: as the database only knows file names, map these to their
+ * paths in the subdirectories of db_dir; NULL if there are no subdirectories.
+ * The paths are stored in head, which must be freed with list_free_all.
+ */
+static HashMap *package_paths(Arguments *arg, NodeStr **head)
+{
+    HashMap *paths = NULL;
+
+    *head = NULL;
+    if (arg->max_depth > 0 && find_packages(arg, ".*" PKG_EXT, 0, head) > 0) {
+        paths = hashmap_new(1024);
+        for (NodeStr *iter = *head; iter != NULL; iter = iter->next)
+            hashmap_put(paths, file_name(iter->data), iter->data);
+    }
+    return paths;
+}
+
+/*
+ * check_needed: make sure that no package that stays in the database needs
+ * one of the count packages in names that are about to be removed, or else ask.
+ * Returns true if the removal can go ahead.
+ */
+static bool check_needed(Arguments *arg, char **names, size_t count)
+{
+    debug_puts("check_needed()");
+
+    char *path = links_path(arg);
+    struct depgraph *g = depgraph_load(arg->db_path, path);
+    HashMap *removing = hashmap_new(count);
+    bool needed = false;
+    bool ok = true;
+
+    free(path);
+    if (g == NULL)
+        return true; // repo-remove will complain
+
+    for (size_t i = 0; i < count; i++)
+        hashmap_put(removing, names[i], NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        NodeStr *users;
+        if (depgraph_needed_by(g, names[i], removing, &users) > 0) {
+            char *list = list_strjoin(users, " ");
+            printf("Warning: %s is still needed by: %s\n", names[i], list);
+            free(list);
+            needed = true;
+        }
+        list_free_nodes(&users);
+    }
+
+    if (needed)
+        ok = confirm("Remove anyway?", 0, arg->noconfirm);
+
+    hashmap_free(removing, NULL);
+    depgraph_free(g);
+    return ok;
+}
+
+/*
+ * find_packages: find the package files matching regex in the database
+ * directory, and in its subdirectories up to arg->max_depth levels deep.
+ * The paths are relative to arg->db_dir.
+ */
+static int find_packages(Arguments *arg, const char *regex, time_t newer, NodeStr **head)
+{
+    struct scan_options opt = { arg->max_depth, newer, arg->pool_dir, arg->jobs, NULL };
+    return scan_packages(".", regex, &opt, head);
+}
+
+/*
+ * index_path: the path of the package index, relative to db_dir.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *index_path(Arguments *arg)
+{
+    char *stem = db_stem(arg->db_name);
+    char *path = cs_strvcat(STATE_DIR "/", stem, ".idx", NULL);
+    free(stem);
+    return path;
+}
+
+/*
+ * open_index: map the index of the package files in the repository.
+ * Returns NULL if it is missing or out of date, in which case the caller
+ * has to fall back to find_packages; only update_index writes it.
+ */
+static struct pkgindex *open_index(Arguments *arg)
+{
+    debug_puts("open_index()");
+
+    char *path = index_path(arg);
+    struct pkgindex *idx = pkgindex_open(path, arg->db_path, arg->max_depth);
+
+    free(path);
+    return idx;
+}
+
+/*
+ * update_index: rebuild the index of the package files, for the commands
+ * that have just changed the database or the files, so that the commands
+ * after them can use it. The caller holds the transaction lock. A failure
+ * only costs the next command a scan, so it is not an error.
+ */
+static void update_index(Arguments *arg)
+{
+    debug_puts("update_index()");
+
+    char *path = index_path(arg);
+    NodeStr *files, *dirs;
+    struct scan_options opt = { arg->max_depth, 0, arg->pool_dir, arg->jobs, &dirs };
+    struct timespec now, since;
+
+    /* what was just changed has to be older than the reading of it, or
+     * the index would be out of date at once; the wait is a tick or two */
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    do {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_REALTIME_COARSE, &since);
+    } while (since.tv_sec == now.tv_sec && since.tv_nsec == now.tv_nsec);
+
+    if (scan_packages(".", ".*" PKG_EXT, &opt, &files) >= 0) {
+        if (pkgindex_write(path, arg->db_path, arg->max_depth, files, dirs, &since) != 0 && arg->verbose)
+            fprintf(stderr, "Warning: cannot write package index '%s%s': %s\n",
+                    arg->db_dir, path, strerror(errno));
+        list_free_all(&files);
+        list_free_all(&dirs);
+    }
+    free(path);
+}
+
+/*
+ * refresh_index: update_index after files were moved or removed outside
+ * of a transaction, taking the transaction lock for it.
+ */
+static void refresh_index(Arguments *arg)
+{
+    int lock = lock_transaction(arg);
+
+    if (lock >= 0) {
+        update_index(arg);
+        close(lock);
+    }
+}
+
+/*
+ * manifest_file: the path of the manifest, relative to db_dir.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *manifest_file(Arguments *arg)
+{
+    char *stem = db_stem(arg->db_name);
+    char *path = cs_strvcat(STATE_DIR "/", stem, ".manifest", NULL);
+    free(stem);
+    return path;
+}
+
+/*
+ * load_manifest: the manifest of the database, which is built from the
+ * database and written if it is missing or out of date.
+ */
+static struct manifest *load_manifest(Arguments *arg)
+{
+    debug_puts("load_manifest()");
+
+    char *path = manifest_file(arg);
+    char *stem, *journal;
+    struct manifest *m = manifest_open(path, arg->db_name);
+    struct manifest_source src = { arg, NULL, NULL, NULL, false };
+
+    if (m != NULL) {
+        free(path);
+        return m;
+    }
+
+    if (arg->verbose)
+        printf("Building manifest: %s%s\n", arg->db_dir, path);
+    stem = db_stem(arg->db_name);
+    journal = cs_strcat(stem, ".journal");
+    src.m = m = manifest_new();
+    manifest_set_seq(m, journal_last(journal));
+    if (db_read(arg->db_name, manifest_package, &src) < 0) {
+        char *errmsg = cs_strvcat("Error: read database '", arg->db_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        manifest_free(m);
+        m = NULL;
+    } else if ((mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) || manifest_write(m, path, arg->db_name) != 0) {
+        fprintf(stderr, "Warning: cannot write manifest '%s%s': %s\n", arg->db_dir, path, strerror(errno));
+    }
+
+    hashmap_free(src.paths, NULL);
+    list_free_all(&src.head);
+    free(journal);
+    free(stem);
+    free(path);
+    return m;
+}
+
+/*
+ * update_manifest: bring the manifest up to date with a transaction that
+ * was just published, by applying the journal entries it does not include
+ * yet to the manifest of the previous generation (<db_name>.old). If there
+ * is none, the manifest is built from the database instead.
+ *
+ * @returns: OK or ERR_MINOR.
+ */
+static int update_manifest(Arguments *arg)
+{
+    debug_puts("update_manifest()");
+
+    char *path = manifest_file(arg);
+    char *old = cs_strcat(arg->db_name, ".old");
+    char *stem = db_stem(arg->db_name);
+    char *journal = cs_strcat(stem, ".journal");
+    unsigned long last = journal_last(journal);
+    struct manifest *m = manifest_open(path, old);
+    struct manifest_source src = { arg, m, NULL, NULL, false };
+    int retval = OK;
+
+    if (m == NULL || manifest_seq(m) > last
+        || journal_read(journal, manifest_seq(m), manifest_entry, &src) < 0) {
+        manifest_free(m);
+        m = load_manifest(arg);
+        retval = m != NULL ? OK : ERR_MINOR;
+    } else {
+        manifest_set_seq(m, last);
+        if (manifest_write(m, path, arg->db_name) != 0) {
+            char *errmsg = cs_strvcat("Error: write manifest '", arg->db_dir, path, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval = ERR_MINOR;
+        }
+    }
+
+    manifest_free(m);
+    hashmap_free(src.paths, NULL);
+    list_free_all(&src.head);
+    free(journal);
+    free(stem);
+    free(old);
+    free(path);
+    return retval;
+}
+
+/*
+ * source_path: the path of the package file filename relative to db_dir,
+ * which only needs to be looked for if it is in a subdirectory.
+ */
+static const char *source_path(struct manifest_source *src, const char *filename)
+{
+    const char *path;
+
+    if (access(filename, F_OK) == 0)
+        return filename;
+    if (!src->scanned) {
+        src->paths = package_paths(src->arg, &src->head);
+        src->scanned = true;
+    }
+    path = src->paths != NULL ? hashmap_get(src->paths, filename) : NULL;
+    return path != NULL ? path : filename;
+}
+
+/*
+ * manifest_package: package_callback for db_read, adding each package of
+ * the database to the manifest.
+ */
+static int manifest_package(Package *pkg, void *data)
+{
+    struct manifest_source *src = data;
+
+    if (pkg->name != NULL && pkg->filename != NULL)
+        manifest_put(src->m, pkg->name, pkg->version, source_path(src, pkg->filename), pkg->sha256sum);
+    package_free(pkg);
+    return 0;
+}
+
+/*
+ * manifest_entry: journal_callback applying each change to the manifest.
+ */
+static int manifest_entry(const struct journal_entry *entry, void *data)
+{
+    struct manifest_source *src = data;
+
+    if (strcmp(entry->op, "remove") == 0)
+        manifest_remove(src->m, entry->name);
+    else
+        manifest_put(src->m, entry->name, entry->version, source_path(src, entry->filename),
+                     strcmp(entry->sha256, "-") != 0 ? entry->sha256 : NULL);
+    return 0;
+}
+
+/*
+ * replicate_package: manifest_callback for replicate, copying the file of
+ * each package that is new or changed, and noting the files to delete.
+ */
+static int replicate_package(const struct manifest_record *src, const struct manifest_record *dst, void *data)
+{
+    struct replication *r = data;
+
+    if (dst != NULL && (src == NULL || strcmp(src->path, dst->path) != 0))
+        list_push(&r->obsolete, cs_strvcat(r->dest, "/", dst->path, NULL));
+    if (src != NULL) {
+        char *sig = cs_strcat(src->path, ".sig");
+        if (replicate_file(r, src->path) == OK)
+            r->copied++;
+        else
+            r->retval |= ERR_MINOR;
+        if (file_readable(sig))
+            r->retval |= replicate_file(r, sig);
+        free(sig);
+    }
+    return 0;
+}
+
+/*
+ * replicate_file: copy the file at path (relative to db_dir) to the same
+ * path in the destination, with a reflink where possible and keeping its
+ * modification time. A file that is already there with the same size and
+ * modification time is left alone.
+ *
+ * @returns: OK or ERR_MINOR.
+ */
+static int replicate_file(struct replication *r, const char *path)
+{
+    char *dest = cs_strvcat(r->dest, "/", path, NULL);
+    struct stat st, dest_st;
+    struct timespec times[2];
+    int retval = OK;
+
+    if (stat(path, &st) == 0 && stat(dest, &dest_st) == 0 && st.st_size == dest_st.st_size
+        && st.st_mtim.tv_sec == dest_st.st_mtim.tv_sec && st.st_mtim.tv_nsec == dest_st.st_mtim.tv_nsec) {
+        free(dest);
+        return OK;
+    }
+
+    if (r->arg->verbose)
+        printf("Copying: %s\n", path);
+    /* packages may be in subdirectories */
+    for (char *slash = strchr(dest + strlen(r->dest) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dest, 0755);
+        *slash = '/';
+    }
+    if (fs_copy(path, dest) != 0) {
+        char *errmsg = cs_strvcat("Error: copy '", path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_MINOR;
+    } else {
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        utimensat(AT_FDCWD, dest, times, 0);
+    }
+    free(dest);
+    return retval;
+}
+
+/*
+ * snapshot_dir: the directory of the snapshot name, relative to db_dir,
+ * or NULL (with a message) if name cannot be the name of a snapshot.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *snapshot_dir(const char *name)
+{
+    if (*name == '\0' || *name == '.' || strchr(name, '/') != NULL) {
+        fprintf(stderr, "Error: invalid snapshot name '%s'\n", name);
+        return NULL;
+    }
+    return cs_strvcat(SNAPSHOT_DIR "/", name, NULL);
+}
+
+/*
+ * list_snapshots: print the names of the snapshots that have been taken.
+ */
+static int list_snapshots(void)
+{
+    DIR *dirp = opendir(SNAPSHOT_DIR);
+    struct dirent *entry;
+    NodeStr *head = NULL;
+
+    if (dirp == NULL)
+        return errno == ENOENT ? OK : ERR_SYSTEM;
+    while ((entry = readdir(dirp)) != NULL)
+        if (entry->d_name[0] != '.')
+            list_push(&head, cs_strclone(entry->d_name));
+    closedir(dirp);
+
+    print_sorted(head, "");
+    list_free_all(&head);
+    return OK;
+}
+
+/*
+ * list_snapshot: print the packages starting with prefix in the database
+ * stored with the snapshot arg->snapshot, without touching the repository.
+ */
+static int list_snapshot(Arguments *arg, const char *prefix)
+{
+    debug_printf("list_snapshot(%s)\n", arg->snapshot);
+
+    struct snapshot_names sn = { prefix, NULL };
+    char *dir = snapshot_dir(arg->snapshot);
+    char *path, **array;
+    size_t len;
+    int retval = OK;
+
+    if (dir == NULL)
+        return ERR_DEFAULT;
+    path = cs_strvcat(dir, "/", arg->db_name, NULL);
+    if (db_read(path, snapshot_name, &sn) < 0) {
+        char *errmsg = cs_strvcat("Error: read snapshot '", arg->db_dir, path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_SYSTEM;
+    } else {
+        len = list_to_array(sn.names, (void ***)&array);
+        cs_qsort(array, len);
+        print_names(array, len, arg->format);
+        free(array);
+    }
+
+    list_free_all(&sn.names);
+    free(path);
+    free(dir);
+    return retval;
+}
+
+/*
+ * take_snapshot: make dir a hardlink farm of the package files in the
+ * database, with their signatures, at the same paths, and of the database
+ * itself. Nothing is copied, so this costs a few inode operations per
+ * package. The snapshot is built under a temporary name and renamed, so it
+ * is either complete or not there.
+ *
+ * @returns: OK, ERR_DEFAULT, ERR_MINOR or ERR_SYSTEM.
+ */
+static int take_snapshot(Arguments *arg, const char *dir)
+{
+    debug_printf("take_snapshot(%s)\n", dir);
+
+    char *stem = db_stem(arg->db_name);
+    const char *ext = strstr(arg->db_name, ".db") != NULL ? strstr(arg->db_name, ".db") + 3 : "";
+    char *files_name = cs_strvcat(stem, ".files", ext, NULL);
+    char *links_name = cs_strcat(stem, ".links");
+    char *db_sig = cs_strcat(arg->db_name, ".sig");
+    char *files_sig = cs_strcat(files_name, ".sig");
+    char *metadata[] = { arg->db_name, files_name, links_name, db_sig, files_sig };
+    char *tmp = cs_strvcat(dir, ".tmp", NULL);
+    struct snapshot snap = { { arg, NULL, NULL, NULL, false }, tmp, 0, OK };
+    int lock;
+
+    if (access(dir, F_OK) == 0) {
+        fprintf(stderr, "Error: snapshot '%s' exists already.\n", file_name(dir));
+        free(tmp);
+        free(files_sig);
+        free(db_sig);
+        free(links_name);
+        free(files_name);
+        free(stem);
+        return ERR_DEFAULT;
+    }
+
+    /* the database must match the package files it refers to */
+    lock = open(STATE_DIR "/lock", O_RDONLY | O_CLOEXEC);
+    if (lock >= 0)
+        flock(lock, LOCK_SH);
+
+    fs_remove_tree(tmp);
+    if ((mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) || (mkdir(SNAPSHOT_DIR, 0755) != 0 && errno != EEXIST)
+        || mkdir(tmp, 0755) != 0) {
+        char *errmsg = cs_strvcat("Error: prepare '", arg->db_dir, tmp, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        snap.retval = ERR_SYSTEM;
+        goto cleanup;
+    }
+
+    if (db_read(arg->db_name, snapshot_package, &snap) < 0) {
+        char *errmsg = cs_strvcat("Error: read database '", arg->db_path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        snap.retval |= ERR_SYSTEM;
+    }
+
+    /* the database is replaced by rename and never changed in place,
+     * so a link keeps this generation of it */
+    for (size_t i = 0; i < sizeof metadata / sizeof metadata[0] && !(snap.retval & ERR_SYSTEM); i++) {
+        char *path = cs_strvcat(tmp, "/", metadata[i], NULL);
+        if (file_readable(metadata[i]) && fs_link(metadata[i], path) != 0) {
+            char *errmsg = cs_strvcat("Error: link '", metadata[i], "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            snap.retval |= ERR_SYSTEM;
+        }
+        free(path);
+    }
+
+    if (!(snap.retval & ERR_SYSTEM) && rename(tmp, dir) != 0) {
+        char *errmsg = cs_strvcat("Error: rename '", tmp, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        snap.retval |= ERR_SYSTEM;
+    }
+    if (snap.retval & ERR_SYSTEM)
+        fs_remove_tree(tmp);
+    else
+        printf("Took snapshot %s of %d packages.\n", file_name(dir), snap.count);
+
+cleanup:
+    if (lock >= 0)
+        close(lock);
+    hashmap_free(snap.src.paths, NULL);
+    list_free_all(&snap.src.head);
+    free(tmp);
+    free(files_sig);
+    free(db_sig);
+    free(links_name);
+    free(files_name);
+    free(stem);
+    return snap.retval;
+}
+
+/*
+ * restore_snapshot: make the repository what it was when the snapshot in
+ * dir was taken: link the package files back where they are missing or
+ * differ, and then publish the database of the snapshot as a new
+ * generation, which is journaled like any other. Files added since then
+ * are left alone; clean deletes them.
+ *
+ * @returns: OK, ERR_DEFAULT, ERR_MINOR or ERR_SYSTEM.
+ */
+static int restore_snapshot(Arguments *arg, const char *dir)
+{
+    debug_printf("restore_snapshot(%s)\n", dir);
+
+    char *stem = db_stem(arg->db_name);
+    const char *ext = strstr(arg->db_name, ".db") != NULL ? strstr(arg->db_name, ".db") + 3 : "";
+    char *files_name = cs_strvcat(stem, ".files", ext, NULL);
+    char *links_name = cs_strcat(stem, ".links");
+    char *db_sig = cs_strcat(arg->db_name, ".sig");
+    char *files_sig = cs_strcat(files_name, ".sig");
+    char *metadata[] = { arg->db_name, files_name, links_name, db_sig, files_sig };
+    char *path = cs_strvcat(dir, "/", arg->db_name, NULL);
+    /* the snapshot holds nothing but the packages and the database */
+    struct scan_options opt = { INT_MAX, 0, NULL, arg->jobs, NULL };
+    NodeStr *head = NULL;
+    unsigned long since = 0, last = 0;
+    int lock, count = 0, retval = OK;
+
+    if (!file_readable(path)) {
+        fprintf(stderr, "Error: no snapshot '%s' of %s\n", file_name(dir), arg->db_name);
+        free(path);
+        free(files_sig);
+        free(db_sig);
+        free(links_name);
+        free(files_name);
+        free(stem);
+        return ERR_DEFAULT;
+    }
+    free(path);
+
+    lock = lock_transaction(arg);
+    if (lock < 0) {
+        free(files_sig);
+        free(db_sig);
+        free(links_name);
+        free(files_name);
+        free(stem);
+        return ERR_SYSTEM;
+    }
+
+    /* first the packages, so that the database never refers to a missing file */
+    if (scan_packages(dir, ".*" PKG_EXT, &opt, &head) < 0) {
+        char *errmsg = cs_strvcat("Error: read snapshot '", arg->db_dir, dir, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_SYSTEM;
+    }
+    for (NodeStr *iter = head; iter != NULL && retval == OK; iter = iter->next) {
+        char *src = cs_strvcat(dir, "/", iter->data, NULL);
+        char *src_sig = cs_strcat(src, ".sig");
+        char *sig = cs_strcat(iter->data, ".sig");
+        if (fs_link(src, iter->data) != 0
+            || (access(src_sig, F_OK) == 0 && fs_link(src_sig, sig) != 0)) {
+            char *errmsg = cs_strvcat("Error: link '", iter->data, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_SYSTEM;
+        } else {
+            count++;
+        }
+        free(sig);
+        free(src_sig);
+        free(src);
+    }
+
+    /* a files database, soname index or signature that the snapshot lacks
+     * would describe other packages, so it goes */
+    for (size_t i = 0; i < sizeof metadata / sizeof metadata[0] && retval == OK; i++) {
+        char *src = cs_strvcat(dir, "/", metadata[i], NULL);
+        char *staged = cs_strvcat(STAGE_DIR "/", metadata[i], NULL);
+        char *old = cs_strcat(metadata[i], ".old");
+        if (access(src, F_OK) != 0) {
+            if (unlink(metadata[i]) == 0 && arg->verbose)
+                printf("Deleting: %s\n", metadata[i]);
+        } else if (fs_link(src, staged) != 0 || fs_publish(staged, metadata[i], i < 2 ? old : NULL) != 0) {
+            char *errmsg = cs_strvcat("Error: publish '", metadata[i], "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_SYSTEM;
+        }
+        free(old);
+        free(staged);
+        free(src);
+    }
+
+    if (retval == OK && *ext != '\0') {
+        retval |= link_database(stem, ".db", arg->db_name);
+        retval |= link_database(stem, ".files", files_name);
+        retval |= link_database(stem, ".db.sig", db_sig);
+        retval |= link_database(stem, ".files.sig", files_sig);
+    }
+
+    if (retval == OK) {
+        retval |= record_generation(arg, &since, &last);
+        printf("Restored snapshot %s with %d packages.\n", file_name(dir), count);
+    } else {
+        fprintf(stderr, "Error: snapshot %s not restored completely.\n", file_name(dir));
+    }
+
+    clear_stage();
+    close(lock);
+    if (last > since)
+        retval |= run_hooks(arg, since, last);
+    list_free_all(&head);
+    free(files_sig);
+    free(db_sig);
+    free(links_name);
+    free(files_name);
+    free(stem);
+    return retval;
+}
+
+/*
+ * snapshot_package: package_callback for db_read, linking the file of each
+ * package in the database (and its signature) into the snapshot.
+ */
+static int snapshot_package(Package *pkg, void *data)
+{
+    struct snapshot *snap = data;
+
+    if (pkg->filename != NULL && !(snap->retval & ERR_SYSTEM)) {
+        const char *path = source_path(&snap->src, pkg->filename);
+        char *dst = cs_strvcat(snap->dir, "/", path, NULL);
+        char *sig = cs_strcat(path, ".sig");
+        char *dst_sig = cs_strcat(dst, ".sig");
+
+        if (fs_link(path, dst) != 0) {
+            char *errmsg = cs_strvcat("Error: link '", path, "'", NULL);
+            /* a missing file is missing from the repository already */
+            snap->retval |= errno == ENOENT ? ERR_MINOR : ERR_SYSTEM;
+            perror(errmsg);
+            free(errmsg);
+        } else if (access(sig, F_OK) == 0 && fs_link(sig, dst_sig) != 0) {
+            char *errmsg = cs_strvcat("Error: link '", sig, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            snap->retval |= ERR_SYSTEM;
+        } else {
+            snap->count++;
+        }
+        free(dst_sig);
+        free(sig);
+        free(dst);
+    }
+    package_free(pkg);
+    return 0;
+}
+
+/*
+ * snapshot_name: package_callback for db_read, collecting the names of the
+ * packages starting with the prefix.
+ */
+static int snapshot_name(Package *pkg, void *data)
+{
+    struct snapshot_names *sn = data;
+
+    if (pkg->name != NULL && cs_isprefix(sn->prefix, pkg->name)) {
+        list_push(&sn->names, pkg->name);
+        pkg->name = NULL;
+    }
+    package_free(pkg);
+    return 0;
+}
+
+static void stop_check(int sig)
+{
+    (void)sig;
+    check_stopped = 1;
+}
+
+/*
+ * check_package: package_callback for check, giving the file of each package
+ * to the verifier and saving the progress every now and then.
+ */
+static int check_package(Package *pkg, void *data)
+{
+    struct check_state *state = data;
+    unsigned long n = state->count++;
+
+    if (check_stopped) {
+        state->stopped = true;
+        package_free(pkg);
+        return 1;
+    }
+    if (n >= state->skip) {
+        /* an entry without a file name is reported as missing */
+        const char *filename = pkg->filename != NULL ? pkg->filename : pkg->name;
+        const char *path = state->paths != NULL ? hashmap_get(state->paths, filename) : NULL;
+        verifier_add(state->v, path != NULL ? path : filename, pkg->csize > 0 ? pkg->csize : -1,
+                     pkg->sha256sum);
+    }
+    package_free(pkg);
+    check_progress(state);
+    return 0;
+}
+
+/*
+ * check_progress: save how far the check got, at most once a second.
+ */
+static void check_progress(struct check_state *state)
+{
+    time_t now = time(NULL);
+
+    if (now != state->saved) {
+        save_progress(state, state->skip + verifier_done(state->v));
+        state->saved = now;
+    }
+}
+
+/*
+ * check_report: verify_callback for check, printing what is wrong.
+ */
+static void check_report(unsigned long n, const char *path, VerifyResult result, int err, void *data)
+{
+    struct check_state *state = data;
+
+    if (result != verify_ok) {
+        pthread_mutex_lock(&state->lock);
+        if (state->nfailures == state->failures_size) {
+            state->failures_size = state->failures_size > 0 ? 2 * state->failures_size : 64;
+            state->failures = realloc(state->failures, state->failures_size * sizeof (struct check_failure));
+        }
+        state->failures[state->nfailures++] = (struct check_failure){ state->skip + n, result };
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    if (result == verify_unreadable)
+        printf("%s: %s\n", path, strerror(err));
+    else if (result != verify_ok)
+        printf("%s: %s\n", path, verify_result_string(result));
+    else if (state->arg->verbose)
+        printf("%s: ok\n", path);
+}
+
+/*
+ * count_failures: the number of packages before position done in the
+ * database that failed the check, by result.
+ */
+static void count_failures(struct check_state *state, unsigned long done, unsigned long *counts)
+{
+    memcpy(counts, state->failed, sizeof state->failed);
+    pthread_mutex_lock(&state->lock);
+    for (size_t i = 0; i < state->nfailures; i++)
+        if (state->failures[i].n < done)
+            counts[state->failures[i].result]++;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/*
+ * load_progress: find out how far a previous check of the database, with
+ * the same modification time, got and what it found.
+ */
+static void load_progress(struct check_state *state)
+{
+    FILE *in = fopen(state->progress, "r");
+    unsigned long *f = state->failed;
+    long long sec;
+    long nsec;
+
+    if (in == NULL)
+        return;
+    if (fscanf(in, "%lld %ld %lu %lu %lu %lu %lu %lu", &sec, &nsec, &state->skip, &f[verify_missing],
+               &f[verify_truncated], &f[verify_size], &f[verify_checksum], &f[verify_unreadable]) != 8
+        || sec != (long long)state->db_st.st_mtim.tv_sec || nsec != state->db_st.st_mtim.tv_nsec) {
+        state->skip = 0;
+        memset(state->failed, 0, sizeof state->failed);
+    }
+    fclose(in);
+}
+
+/*
+ * save_progress: remember that the first done packages of the database
+ * have been checked, and what was found.
+ */
+static void save_progress(struct check_state *state, unsigned long done)
+{
+    char *tmp = cs_strcat(state->progress, ".tmp");
+    unsigned long f[verify_unreadable + 1];
+    FILE *out = fopen(tmp, "w");
+
+    count_failures(state, done, f);
+    if (out != NULL) {
+        fprintf(out, "%lld %ld %lu %lu %lu %lu %lu %lu\n", (long long)state->db_st.st_mtim.tv_sec,
+                state->db_st.st_mtim.tv_nsec, done, f[verify_missing], f[verify_truncated],
+                f[verify_size], f[verify_checksum], f[verify_unreadable]);
+        if (fclose(out) == 0)
+            rename(tmp, state->progress);
+    }
+    free(tmp);
+}
+
+/*
+ * is_pattern: whether str is a glob pattern rather than a package name.
+ */
+static bool is_pattern(const char *str)
+{
+    return strpbrk(str, "*?[") != NULL;
+}
+
+/*
+ * is_regex: whether str has characters that only a regular expression
+ * uses; they cannot occur in a package name and fnmatch gives them no
+ * meaning, so such an argument would never match.
+ */
+static bool is_regex(const char *str)
+{
+    return strpbrk(str, "|^$(){}\\") != NULL;
+}
+
+/*
+ * glob_to_regex: append the glob pattern to buf as an extended regular
+ * expression that matches the same names as fnmatch would; buf stays
+ * terminated, with room for one more character.
+ */
+static void glob_to_regex(const char *glob, char **buf, size_t *len, size_t *size)
+{
+    for (const char *c = glob; *c != '\0'; c++) {
+        const char *end = NULL;
+        char piece[8];
+
+        if (*c == '[') {
+            /* a bracket expression reads the same in both, apart from ! */
+            end = c + 1;
+            if (*end == '!' || *end == '^')
+                end++;
+            if (*end == ']')
+                end++;
+            while (*end != '\0' && *end != ']') {
+                if (end[0] == '[' && (end[1] == ':' || end[1] == '.' || end[1] == '=')) {
+                    const char *close = strchr(end + 2, end[1]);
+                    end = close != NULL && close[1] == ']' ? close + 2 : end + 1;
+                } else {
+                    end++;
+                }
+            }
+            if (*end != ']')
+                end = NULL;
+        }
+
+        if (end != NULL) {
+            size_t n = end - c + 1;
+            if (*len + n + 2 > *size)
+                *buf = realloc(*buf, *size = (*len + n) * 2 + 2);
+            memcpy(*buf + *len, c, n);
+            if (c[1] == '!')
+                (*buf)[*len + 1] = '^';
+            *len += n;
+            c = end;
+            continue;
+        }
+
+        if (*c == '*')
+            strcpy(piece, ".*");
+        else if (*c == '?')
+            strcpy(piece, ".");
+        else if (strchr(".[]()+{}|^$\\", *c) != NULL)
+            sprintf(piece, "\\%c", *c);
+        else
+            sprintf(piece, "%c", *c);
+        if (*len + strlen(piece) + 2 > *size)
+            *buf = realloc(*buf, *size = (*len + strlen(piece)) * 2 + 2);
+        strcpy(*buf + *len, piece);
+        *len += strlen(piece);
+    }
+    (*buf)[*len] = '\0';
+}
+
+/*
+ * matcher_init: prepare to match package names against args, which are
+ * package names or glob patterns. The patterns are compiled into a single
+ * regular expression, so that each name is matched once, however many
+ * patterns there are. Returns false if they cannot be compiled.
+ */
+static bool matcher_init(struct name_matcher *m, char **args, int count)
+{
+    size_t len = 0, size = 64;
+    char *buf;
+    int err;
+
+    m->names = hashmap_new(count);
+    m->patterns = malloc((count + 1) * sizeof (char *));
+    m->npatterns = 0;
+    for (int i = 0; i < count; i++) {
+        if (is_pattern(args[i]))
+            m->patterns[m->npatterns++] = args[i];
+        else
+            hashmap_put(m->names, args[i], NULL);
+    }
+    if (m->npatterns == 0)
+        return true;
+
+    buf = malloc(size);
+    strcpy(buf, "^(");
+    len = 2;
+    for (size_t i = 0; i < m->npatterns; i++) {
+        if (i > 0)
+            buf[len++] = '|';
+        glob_to_regex(m->patterns[i], &buf, &len, &size);
+    }
+    buf = realloc(buf, len + 3);
+    strcpy(buf + len, ")$");
+
+    err = regcomp(&m->regex, buf, REG_EXTENDED | REG_NOSUB);
+    if (err != 0) {
+        char errbuf[BUFSIZ];
+        regerror(err, &m->regex, errbuf, sizeof errbuf);
+        fprintf(stderr, "Error: invalid pattern: %s\n", errbuf);
+        m->npatterns = 0;
+    }
+    free(buf);
+    return err == 0;
+}
+
+/*
+ * matcher_match: whether name is one of the names or matches a pattern.
+ */
+static bool matcher_match(const struct name_matcher *m, const char *name)
+{
+    if (hashmap_contains(m->names, name))
+        return true;
+    return m->npatterns > 0 && regexec(&m->regex, name, 0, NULL, 0) == 0;
+}
+
+/*
+ * matcher_filter: list_filter function keeping the paths of the package
+ * files that match.
+ */
+static bool matcher_filter(void *path, void *m)
+{
+    char *name, *version, *pkgarch;
+    bool match;
 
-    fprintf(stderr, "\n=== THIS FUNCTION HAS NOT BEEN IMPLEMENTED YET! ===\n");
-    return ERR_UNDEF;
+    if (!package_parse_filename(file_name(path), &name, &version, &pkgarch))
+        return false;
+    match = matcher_match(m, name);
+    free(name);
+    free(version);
+    free(pkgarch);
+    return match;
 }
 
-/* ------------------------------------------------------------------------- */
+static void matcher_free(struct name_matcher *m)
+{
+    if (m->npatterns > 0)
+        regfree(&m->regex);
+    hashmap_free(m->names, NULL);
+    free(m->patterns);
+}
 
 /*
- * repo_check: print an error message and quit in case there is anything
- * wrong with db_name and db_dir given in the configuration file.
+ * add_pattern_name: add name, which is freed unless it is used, to the
+ * packages to remove if it matches a pattern and has not been added yet.
  */
-static bool repo_check(Arguments *arg)
+static void add_pattern_name(struct pattern_names *pn, char *name)
 {
-    debug_puts("repo_check()");
+    if (hashmap_contains(pn->matched, name) || !matcher_match(pn->m, name)) {
+        free(name);
+        return;
+    }
+    hashmap_put(pn->matched, name, name);
+    list_push(pn->names, name);
+}
 
-    if (!file_readable(arg->db_path)) {
-        fprintf(stderr, "Error: cannot open database '%s'\n", arg->db_path);
-        return false;
+/*
+ * pattern_package: package_callback adding database packages to the
+ * packages to remove.
+ */
+static int pattern_package(Package *pkg, void *data)
+{
+    if (pkg->name != NULL) {
+        add_pattern_name(data, pkg->name);
+        pkg->name = NULL;
     }
-    return true;
+    package_free(pkg);
+    return 0;
+}
+
+/*
+ * file_name: return the last component of path, without copying it.
+ */
+static const char *file_name(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    return name != NULL ? name + 1 : path;
 }
 
 
 /*
- * add_package: add a single package to the database.
+ * add_packages: add the newest file of each of the packages to the database,
+ * with a single scan of the directory and a single run of repo-add; the
+ * older files are deleted (or archived) after one confirmation.
  *
  * \warning we are assuming that we are in the directory arg->db_dir.
  */
-static int add_package(const char *pkg_name, Arguments *arg)
+static int add_packages(char **names, int count, Arguments *arg)
 {
-    debug_printf("add_package(%s)\n", pkg_name);
+    debug_printf("add_packages(%d)\n", count);
 
+    NodeStr **found = calloc(count + 1, sizeof (NodeStr *));
+    NodeStr *head, *oldest = NULL, *pooled = NULL;
+    HashMap *wanted = hashmap_new(count);
+    char **adding = malloc((count + 1) * sizeof (char *));
+    size_t nadding = 0;
     int retval = OK;
-    NodeStr *head;
 
-    char *regex = cs_strvcat("^(", pkg_name, ")", PKG_EXT, NULL);
-    int count = get_filenames_filter_regex(".", &head, regex);
-    free(regex);
+    /* names given twice are only added once */
+    for (int i = 0; i < count; i++)
+        if (!hashmap_contains(wanted, names[i]))
+            hashmap_put(wanted, names[i], &found[i]);
+
+    if (find_packages(arg, ".*" PKG_EXT, 0, &head) < 0) {
+        fprintf(stderr, "Error: failed to retrieve files.\n");
+        retval |= ERR_SYSTEM;
+    }
+    for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        char *name, *version, *arch;
+        NodeStr **files;
+
+        if (!package_parse_filename(file_name(iter->data), &name, &version, &arch))
+            continue;
+        if ((files = hashmap_get(wanted, name)) != NULL)
+            list_push(files, iter->data);
+        free(name);
+        free(version);
+        free(arch);
+    }
 
-    /* test age of file */
-    if (count > 0) {
-        char *cmd, *filename;
+    for (int i = 0; i < count; i++) {
+        const char *filename = NULL;
         time_t filetime = 0;
+        int n;
+
+        if (hashmap_get(wanted, names[i]) != &found[i])
+            continue;
+
+        /* another repository may have put the package into the pool already */
+        if (found[i] == NULL && arg->pool_dir != NULL) {
+            char *path = pool_find(arg->pool_dir, names[i]);
+            if (path != NULL && pool_link(arg->pool_dir, path, arg->db_dir) == 0) {
+                printf("Linked from pool: %s\n", path);
+                list_push(&pooled, path);
+                list_push(&found[i], path);
+            } else if (path != NULL) {
+                char *errmsg = cs_strvcat("Error: link '", path, "' from pool", NULL);
+                perror(errmsg);
+                free(errmsg);
+                free(path);
+            }
+        }
 
-        printf("Found %d files for: %s\n", count, pkg_name);
+        n = list_length(found[i]);
+        if (n == 0) {
+            fprintf(stderr, "Error: did not find any files to add for: %s\n", names[i]);
+            retval |= ERR_DEFAULT;
+            continue;
+        }
+        printf("Found %d files for: %s\n", n, names[i]);
 
         /* get youngest file */
-        filename = NULL;
-        for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        for (NodeStr *iter = found[i]; iter != NULL; iter = iter->next) {
             struct stat statbuf;
 
             if (stat(iter->data, &statbuf) == -1) {
@@ -299,33 +2717,52 @@ static int add_package(const char *pkg_name, Arguments *arg)
                 filetime = statbuf.st_mtime;
             }
         }
+        if (filename == NULL)
+            continue;
+
+        /* put older files into a list, to be deleted if we're not soft */
+        if (n > 1 && !arg->soft) {
+            for (NodeStr *iter = found[i]; iter != NULL; iter = iter->next)
+                if (iter->data != filename)
+                    list_push(&oldest, iter->data);
+            printf("Keeping: %s\n", filename);
+        }
 
-        /* delete files if we're not soft */
-        if (count > 1 && !arg->soft) {
-            /* put oldest files into a list */
-            NodeStr *oldest = NULL;
-
-            for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
-                if (iter->data == filename)
-                    continue;
-
-                list_push(&oldest, iter->data);
-            }
+        if (arg->pool_dir != NULL && pool_import(arg->pool_dir, arg->db_dir, filename) != 0) {
+            char *errmsg = cs_strvcat("Error: put '", filename, "' into pool", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_MINOR;
+        }
+        adding[nadding++] = (char *)filename;
+    }
 
-            printf("Keeping: %s\n", filename);
-            remove_files(oldest, arg->noconfirm);
+    /* the older files go once the database no longer refers to them, so
+     * not at all if the transaction fails (e.g. on a bad signature) */
+    if (nadding > 0) {
+        int ret = db_transaction(arg, SYSTEM_REPO_ADD, adding, nadding);
+        if (ret & (ERR_DEFAULT | ERR_SYSTEM))
             list_free_nodes(&oldest);
-        }
+        retval |= ret;
+    }
 
-        cmd = cs_strvcat(SYSTEM_REPO_ADD, " ", arg->db_path, " ", filename, NULL);
-        retval |= exec_system(cmd, arg->verbose);
-        free(cmd);
-    } else {
-        fprintf(stderr, "Error: did not find any files to add.\n");
-        retval |= ERR_DEFAULT;
+    if (oldest != NULL) {
+        if (arg->keep_versions > 0)
+            retval |= archive_files(oldest, arg->db_dir, arg->keep_versions);
+        else
+            remove_files(oldest, arg->noconfirm);
+        refresh_index(arg);
     }
 
+    // Cleanup:
+    for (int i = 0; i < count; i++)
+        list_free_nodes(&found[i]);
+    free(found);
+    free(adding);
+    list_free_nodes(&oldest);
+    list_free_all(&pooled);
     list_free_all(&head);
+    hashmap_free(wanted, NULL);
     return retval;
 }
 
@@ -354,18 +2791,56 @@ static int remove_files(NodeStr *head, bool noconfirm)
     list_free_nodes(&names);
 
     /* ask if user wants to delete all the files and do it */
-    if (confirm(mesg, 1, noconfirm)) {
-        for (iter = head; iter != NULL; iter = iter->next) {
-            printf("Removing file: %s\n", iter->data);
-            if (remove(iter->data) != 0) {
-                char *errmsg = cs_strvcat("Error: ", DEBUG_FILENO_, "remove '", iter->data, "'", NULL);
-                perror(errmsg);
-                free(errmsg);
-                retval |= ERR_MINOR;
-            }
+    if (confirm(mesg, 1, noconfirm))
+        retval |= delete_files(head);
+
+    free(mesg);
+    return retval;
+}
+
+/*
+ * delete_files: remove the files in the list, without asking.
+ */
+static int delete_files(NodeStr *head)
+{
+    int retval = OK;
+
+    for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        printf("Removing file: %s\n", iter->data);
+        if (remove(iter->data) != 0) {
+            char *errmsg = cs_strvcat("Error: ", DEBUG_FILENO_, "remove '", iter->data, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_MINOR;
+        }
+    }
+    return retval;
+}
+
+/*
+ * archive_files: move package files into the archive directory, where only
+ * the newest keep versions of each package are kept.
+ */
+static int archive_files(NodeStr *head, const char *dir, int keep)
+{
+    debug_puts("archive_files()");
+
+    NodeStr *removed = NULL;
+    int retval = OK;
+
+    for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+        printf("Archiving file: %s\n", iter->data);
+        if (history_archive(dir, iter->data, keep, &removed) != 0) {
+            char *errmsg = cs_strvcat("Error: archive '", iter->data, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            retval |= ERR_MINOR;
         }
     }
+    for (NodeStr *iter = removed; iter != NULL; iter = iter->next)
+        printf("Removing file: %s\n", iter->data);
 
+    list_free_all(&removed);
     return retval;
 }
 
@@ -378,7 +2853,7 @@ static char *pkg_name(const char *input)
 {
     debug_puts("pkg_name()");
 
-    const char *regex = "^(/.*/)?(" PKG_NAME ")" PKG_EXT;
+    const char *regex = "^(.*/)?(" PKG_NAME ")" PKG_EXT;
     char errbuf[BUFSIZ];      /* for holding error messages by regex.h */
     int errcode;
 
@@ -429,17 +2904,27 @@ static bool file_readable(const char *file)
  * If the parameter noconfirm is false, the question is actually asked, and on
  * stderr. Otherwise, the default is accepted. (This is useful for documenting
  * what the system is doing if you used an option such as --noconfirm.)
+ * Only the first character of the line counts; without an answer (at the
+ * end of the input), the answer is no.
  */
 static bool confirm(const char *question, int def, bool noconfirm)
 {
     debug_printf("confirm(%s)\n", question);
-    char c = ' ';
+    int c = ' ';
 
     if (noconfirm) {
         printf("%s [%s] .\n", question, def ? "Y/n" : "y/N");
     } else {
+        fflush(stdout);     // what the question refers to comes first
         fprintf(stderr, "%s [%s] ", question, def ? "Y/n" : "y/N");
         c = getchar();
+        if (c == EOF) {
+            fputc('\n', stderr);
+            return false;
+        }
+        /* the rest of the line must not answer the next question */
+        for (int rest = c; rest != '\n' && rest != EOF; )
+            rest = getchar();
     }
 
     if (def)
@@ -464,17 +2949,515 @@ static bool confirm(const char *question, int def, bool noconfirm)
 
 
 /*
- * exec_system: print the command, run it in the system, return status.
+ * print_sorted: print every string in the list on its own line, sorted.
+ */
+static void print_sorted(NodeStr *head, const char *prefix)
+{
+    char **array;
+    size_t len = list_to_array(head, (void ***)&array);
+
+    cs_qsort(array, len);
+    for (size_t i = 0; i < len; i++)
+        printf("%s%s\n", prefix, array[i]);
+    free(array);
+}
+
+
+/*
+ * print_names: print the sorted package names in array, either in columns
+ * like ls, or once each for scripts.
+ */
+static void print_names(char **array, size_t len, ListFormat format)
+{
+    size_t printed = 0;
+
+    if (format == format_columns) {
+        if (len > 0)
+            print_columns(array, len);
+        return;
+    }
+
+    if (format == format_json)
+        putchar('[');
+    for (size_t i = 0; i < len; i++) {
+        if (i > 0 && strcmp(array[i], array[i-1]) == 0)
+            continue;
+        switch (format) {
+            case format_lines:
+                puts(array[i]);
+                break;
+            case format_null:
+                fputs(array[i], stdout);
+                putchar('\0');
+                break;
+            case format_json:
+                if (printed > 0)
+                    putchar(',');
+                putchar('"');
+                for (const char *c = array[i]; *c != '\0'; c++) {
+                    if (*c == '"' || *c == '\\')
+                        printf("\\%c", *c);
+                    else if ((unsigned char)*c < 0x20)
+                        printf("\\u%04x", *c);
+                    else
+                        putchar(*c);
+                }
+                putchar('"');
+                break;
+            default:
+                break;
+        }
+        printed++;
+    }
+    if (format == format_json)
+        puts("]");
+}
+
+
+/*
+ * db_stem: get the name of the repository from the name of its database,
+ * e.g. "local" from "local.db.tar.gz".
+ * Warning: you must call free() on the result of this function.
+ */
+static char *db_stem(const char *db_name)
+{
+    const char *ext = strstr(db_name, ".db");
+    return ext != NULL ? cs_substr(db_name, 0, ext - db_name) : cs_strclone(db_name);
+}
+
+
+/*
+ * db_index_package: package_callback for read_database.
+ */
+static int db_index_package(Package *pkg, void *data)
+{
+    if (pkg->name == NULL || hashmap_contains(data, pkg->name)) {
+        package_free(pkg);
+        return 0;
+    }
+    hashmap_put(data, pkg->name, pkg);
+    return 0;
+}
+
+/*
+ * compare_basenames: compare paths by their last component, for use with qsort.
+ */
+static int compare_basenames(const void *a, const void *b)
+{
+    return strcmp(file_name(*(char * const *)a), file_name(*(char * const *)b));
+}
+
+/*
+ * compare_filenames: compare packages by file name, for use with qsort.
+ */
+static int compare_filenames(const void *a, const void *b)
+{
+    return strcmp((*(Package * const *)a)->filename, (*(Package * const *)b)->filename);
+}
+
+/*
+ * free_package: package_free for use with hashmap_free.
+ */
+static void free_package(void *pkg)
+{
+    package_free(pkg);
+}
+
+
+/*
+ * exec_system: print the command, run it directly, without a shell, and pass
+ * on what it printed once it has finished; to stderr if it failed.
+ *
+ * @returns: OK or ERR_SYSTEM.
+ */
+static int exec_system(char **argv, bool verbose)
+{
+    debug_printf("exec_system(%s)\n", argv[0]);
+
+    struct process_job job = { argv, NULL, 0, -1 };
+    int status;
+
+    if (verbose) {
+        printf("Running:");
+        for (char **iter = argv; *iter != NULL; iter++)
+            printf(" %s", *iter);
+        putchar('\n');
+        fflush(stdout);
+    }
+
+    status = process_run(&job);
+    if (status < 0) {
+        char *errmsg = cs_strvcat("Error: run '", argv[0], "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+    } else if (job.output != NULL) {
+        fputs(job.output, status == 0 ? stdout : stderr);
+    }
+    free(job.output);
+    return status == 0 ? OK : ERR_SYSTEM;
+}
+
+/*
+ * clear_stage: remove everything that a run of repo-add left in STAGE_DIR.
+ */
+static void clear_stage(void)
+{
+    DIR *dirp = opendir(STAGE_DIR);
+    struct dirent *entry;
+
+    if (dirp == NULL)
+        return;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        unlinkat(dirfd(dirp), entry->d_name, 0);
+    }
+    closedir(dirp);
+}
+
+/*
+ * lock_transaction: take the lock that keeps transactions from running at
+ * the same time, as they share STAGE_DIR, and empty STAGE_DIR.
+ * Returns the file descriptor holding the lock, or -1 on error.
+ */
+static int lock_transaction(Arguments *arg)
+{
+    int lock = -1;
+
+    if ((mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) || (mkdir(STAGE_DIR, 0755) != 0 && errno != EEXIST)
+        || (lock = open(STATE_DIR "/lock", O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || flock(lock, LOCK_EX) != 0) {
+        char *errmsg = cs_strvcat("Error: prepare '", arg->db_dir, STAGE_DIR, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        if (lock >= 0)
+            close(lock);
+        return -1;
+    }
+    clear_stage();
+    return lock;
+}
+
+/*
+ * record_generation: append the difference between <db_name>.old and the
+ * database that was just published to the journal, and update the manifest.
+ * The new entries of the journal are those after since, up to last.
+ *
+ * @returns: OK or ERR_MINOR.
+ */
+static int record_generation(Arguments *arg, unsigned long *since, unsigned long *last)
+{
+    char *stem = db_stem(arg->db_name);
+    char *journal = cs_strcat(stem, ".journal");
+    char *old = cs_strcat(arg->db_name, ".old");
+    int retval = OK;
+
+    *since = journal_last(journal);
+    if (journal_record(journal, old, arg->db_name) < 0) {
+        char *errmsg = cs_strvcat("Error: write journal '", journal, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_MINOR;
+    }
+    *last = journal_last(journal);
+    retval |= update_manifest(arg);
+
+    free(old);
+    free(journal);
+    free(stem);
+    return retval;
+}
+
+/*
+ * sign_database: sign the database at path with arg->sign_key, making
+ * <path>.sig, and leave a mark in STATE_DIR that the signature is ours. If
+ * no key is set, a signature that we made before is deleted; one that
+ * someone else made, such as a hook, is theirs to keep up to date.
+ *
+ * @returns: OK or ERR_SYSTEM.
+ */
+static int sign_database(Arguments *arg, const char *path)
+{
+    char *sig = cs_strcat(path, ".sig");
+    char *mark = cs_strvcat(STATE_DIR "/", file_name(path), ".signed", NULL);
+    int retval = OK;
+
+    if (arg->sign_key == NULL) {
+        /* a stale signature would make pacman reject the database */
+        if (access(mark, F_OK) == 0 && unlink(sig) == 0)
+            fprintf(stderr, "Warning: deleted the signature of the previous %s; "
+                            "set sign_key to sign it.\n", path);
+        unlink(mark);
+        free(mark);
+        free(sig);
+        return OK;
+    }
+    if (arg->verbose) printf("Signing: %s\n", path);
+    if (sign_file(path, sig, arg->sign_key) != 0) {
+        if (errno != 0) {
+            char *errmsg = cs_strvcat("Error: run " SYSTEM_GPG " to sign '", path, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+        } else {
+            fprintf(stderr, "Error: cannot sign '%s'\n", path);
+        }
+        retval = ERR_SYSTEM;
+    } else {
+        int fd = open(mark, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0)
+            close(fd);
+    }
+    free(mark);
+    free(sig);
+    return retval;
+}
+
+/*
+ * link_database: like repo-add, point <stem><suffix> at the file name, such
+ * as local.db at local.db.tar.gz, or remove it if there is no such file.
+ *
+ * @returns: OK or ERR_MINOR.
+ */
+static int link_database(const char *stem, const char *suffix, const char *name)
+{
+    char *link = cs_strcat(stem, suffix);
+    int retval = OK;
+
+    if (access(name, F_OK) != 0) {
+        unlink(link);
+    } else if (fs_symlink(name, link) != 0) {
+        char *errmsg = cs_strvcat("Error: symlink '", link, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_MINOR;
+    }
+    free(link);
+    return retval;
+}
+
+/*
+ * run_hooks: run the hooks in HOOKS_DIR once for the transaction whose
+ * journal entries are those after since, up to last. Their stdin is the
+ * list of changed files, each as "add <filename>" or "remove <filename>"
+ * and terminated by NUL; REPO_DB and REPO_SINCE tell them the database and
+ * the sequence number to give repo log --since for the details.
+ *
+ * @returns: OK or ERR_MINOR.
+ */
+static int run_hooks(Arguments *arg, unsigned long since, unsigned long last)
+{
+    debug_printf("run_hooks(%lu, %lu)\n", since, last);
+
+    char *stem = db_stem(arg->db_name);
+    char *journal = cs_strcat(stem, ".journal");
+    struct hook_input in = { last, NULL, 0, 0 };
+    char seq[32];
+    int failed, retval = OK;
+
+    if (journal_read(journal, since, hook_entry, &in) < 0) {
+        char *errmsg = cs_strvcat("Error: read journal '", journal, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_MINOR;
+        goto cleanup;
+    }
+
+    snprintf(seq, sizeof seq, "%lu", since);
+    setenv("REPO_DB", arg->db_path, 1);
+    setenv("REPO_SINCE", seq, 1);
+    failed = hooks_run(HOOKS_DIR, in.data, in.len, arg->hook_timeout, arg->verbose);
+    if (failed < 0) {
+        char *errmsg = cs_strvcat("Error: read hooks '", arg->db_dir, HOOKS_DIR, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval = ERR_MINOR;
+    } else if (failed > 0) {
+        retval = ERR_MINOR;
+    }
+
+cleanup:
+    free(in.data);
+    free(journal);
+    free(stem);
+    return retval;
+}
+
+/*
+ * hook_entry: journal_callback adding each change of the transaction to
+ * the input of the hooks; a replaced file is removed and its successor added.
+ */
+static int hook_entry(const struct journal_entry *entry, void *data)
+{
+    struct hook_input *in = data;
+    const char *ops[2] = { "remove ", "add " };
+    const char *files[2] = { NULL, NULL };
+
+    if (entry->seq > in->last)
+        return 1;
+    if (strcmp(entry->op, "remove") == 0)
+        files[0] = entry->filename;
+    else
+        files[1] = entry->filename;
+    if (strcmp(entry->op, "replace") == 0 && strcmp(entry->replaced, "-") != 0)
+        files[0] = entry->replaced;
+
+    for (int i = 0; i < 2; i++) {
+        size_t n;
+        if (files[i] == NULL)
+            continue;
+        n = strlen(ops[i]) + strlen(files[i]) + 1;
+        if (in->len + n > in->size) {
+            in->size = in->size > 0 ? 2 * in->size + n : BUFSIZ + n;
+            in->data = realloc(in->data, in->size);
+        }
+        memcpy(in->data + in->len, ops[i], strlen(ops[i]));
+        memcpy(in->data + in->len + strlen(ops[i]), files[i], strlen(files[i]) + 1);
+        in->len += n;
+    }
+    return 0;
+}
+
+/*
+ * db_transaction: run tool (repo-add or repo-remove) with args on a copy of
+ * the database in STAGE_DIR, and only if that succeeds, publish the result
+ * with fs_publish, so that clients never download a partial database. The
+ * previous database stays available as <db_name>.old, like repo-add does.
+ * The package index is rebuilt for the new database under the same lock.
+ *
+ * @returns: OK, ERR_MINOR or ERR_SYSTEM.
+ */
+static int db_transaction(Arguments *arg, const char *tool, char **args, size_t count)
+{
+    debug_printf("db_transaction(%s, %zu)\n", tool, count);
+
+    char *stem = db_stem(arg->db_name);
+    const char *ext = strstr(arg->db_name, ".db") != NULL ? strstr(arg->db_name, ".db") + 3 : "";
+    char *staged = cs_strvcat(STAGE_DIR "/", arg->db_name, NULL);
+    char *sig = cs_strcat(arg->db_name, ".sig");
+    char *staged_sig = cs_strvcat(STAGE_DIR "/", sig, NULL);
+    char *old = cs_strcat(arg->db_name, ".old");
+    unsigned long since = 0, last = 0;
+    int lock, bad, retval = OK;
+
+    /* the signatures of the packages are checked before taking the lock,
+     * as that takes a while; a signed repository takes no package with a
+     * bad signature, an unsigned one only warns about them */
+    if (strcmp(tool, SYSTEM_REPO_ADD) == 0) {
+        bad = sign_verify(args, count, arg->jobs, arg->verbose);
+        if (bad < 0 && arg->sign_key != NULL)
+            perror("Error: run " SYSTEM_GPG);
+        else if (bad > 0 && arg->sign_key != NULL)
+            fprintf(stderr, "Error: %d packages have a bad signature; the database is unchanged.\n", bad);
+        else if (bad > 0)
+            fprintf(stderr, "Warning: %d packages have a bad signature; set sign_key to refuse them.\n", bad);
+        if (bad != 0 && arg->sign_key != NULL) {
+            retval = ERR_DEFAULT;
+            goto cleanup;
+        }
+    }
+
+    lock = lock_transaction(arg);
+    if (lock < 0) {
+        retval = ERR_SYSTEM;
+        goto cleanup;
+    }
+
+    /* the copy is a reflink where the filesystem allows; the files
+     * database is not staged, as update_files_db writes it anew */
+    if (file_readable(arg->db_name) && fs_copy(arg->db_name, staged) != 0) {
+        char *errmsg = cs_strvcat("Error: copy '", arg->db_name, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_SYSTEM;
+    }
+
+    if (retval == OK) {
+        retval |= exec_batch(tool, staged, args, count, arg->verbose);
+        if (retval != OK)
+            fprintf(stderr, "Error: %s failed; the database is unchanged.\n", tool);
+    }
+
+    /* one signature, however many runs the tool took */
+    if (retval == OK && arg->sign_key != NULL && access(staged, F_OK) == 0) {
+        retval |= sign_database(arg, staged);
+        if (retval != OK)
+            fprintf(stderr, "Error: signing failed; the database is unchanged.\n");
+    }
+
+    if (retval == OK && access(staged, F_OK) == 0
+        && fs_publish_signed(staged, arg->db_name, old, arg->sign_key != NULL ? staged_sig : NULL, sig) != 0) {
+        char *errmsg = cs_strvcat("Error: publish '", arg->db_name, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        retval |= ERR_SYSTEM;
+    } else if (retval == OK && arg->sign_key == NULL) {
+        sign_database(arg, arg->db_name);
+    }
+
+    /* like repo-add, point <stem>.db at the database */
+    if (retval == OK && *ext != '\0') {
+        retval |= link_database(stem, ".db", arg->db_name);
+        retval |= link_database(stem, ".db.sig", sig);
+    }
+
+    /* the soname index and the files database belong to this generation,
+     * and the hooks have to see them as well; record what changed while
+     * still holding the lock, so that the sequence numbers follow the
+     * order of the generations */
+    if (retval == OK) {
+        retval |= update_aux_dbs(arg);
+        retval |= record_generation(arg, &since, &last);
+        update_index(arg);
+    }
+
+    clear_stage();
+    close(lock);
+
+    /* outside the lock, so that hooks can run repo themselves */
+    if (last > since)
+        retval |= run_hooks(arg, since, last);
+cleanup:
+    free(old);
+    free(staged_sig);
+    free(sig);
+    free(staged);
+    free(stem);
+    return retval;
+}
+
+/*
+ * exec_batch: run tool on the database db with all of args, split into as
+ * few runs as BATCH_MAX allows. The runs change the same database, so they
+ * are made one after the other.
  *
  * @returns: OK or ERR_SYSTEM.
  */
-static int exec_system(const char *command, bool verbose)
+static int exec_batch(const char *tool, const char *db, char **args, size_t count, bool verbose)
 {
-    debug_printf("exec_system(%s)\n", command);
-    int retval;
+    debug_printf("exec_batch(%s, %zu)\n", tool, count);
+
+    size_t base = strlen(tool) + strlen(db) + 2;
+    char **argv = malloc((count + 3) * sizeof (char *));
+    int retval = OK;
+    size_t i = 0;
+
+    argv[0] = (char *)tool;
+    argv[1] = (char *)db;
+    while (i < count) {
+        size_t len = base, n = 2;
+
+        /* always take at least one argument, however long */
+        do {
+            size_t size = strlen(args[i]) + 1;
+            if (n > 2 && len + size > BATCH_MAX)
+                break;
+            argv[n++] = args[i];
+            len += size;
+        } while (++i < count);
+        argv[n] = NULL;
+        retval |= exec_system(argv, verbose);
+    }
 
-    if (verbose) printf("Running: %s\n", command);
-    retval = system(command) == 0 ? OK : ERR_SYSTEM;
+    free(argv);
     return retval;
 }
 
@@ -1,7 +1,7 @@
 /*
  * actions.h
  * Includes the code for all the actions:
- *   add, remove, list, update, sync.
+ *   add, remove, list, query, rdeps, update, sync, gc, clean, rollback.
  * 
  * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
  * 
@@ -47,10 +47,87 @@ extern int repo_remove(Arguments *);
 extern int repo_update(Arguments *);
 
 /*
- * repo_sync: ...
+ * repo_sync: compare the packages in the database to those in the AUR
+ * (arg->metadata) and/or in the official repositories (arg->official).
  */
 extern int repo_sync(Arguments *);
 
+/*
+ * repo_log: print the lines of the journal after sequence number arg->since.
+ */
+extern int repo_log(Arguments *);
+
+/*
+ * repo_manifest: bring the manifest of the database up to date and print
+ * its root hash.
+ */
+extern int repo_manifest(Arguments *);
+
+/*
+ * repo_replicate: make the directory arg->argv[0] a copy of the repository,
+ * copying only the packages that differ according to the manifests.
+ */
+extern int repo_replicate(Arguments *);
+
+/*
+ * repo_check: check the files of all packages in the database against the
+ * sizes and checksums recorded there, in parallel, and print what is wrong.
+ */
+extern int repo_check(Arguments *);
+
+/*
+ * repo_split: write a separate database for each architecture of the
+ * packages in the directory, with the packages for any in all of them.
+ */
+extern int repo_split(Arguments *);
+
+/*
+ * repo_snapshot: take the snapshot arg->argv[0] of the repository, or restore
+ * it with arg->restore; without a name, print the snapshots there are.
+ */
+extern int repo_snapshot(Arguments *);
+
+/*
+ * repo_gc: delete the objects in the package pool that are no longer
+ * referenced by any repository.
+ */
+extern int repo_gc(Arguments *);
+
+/*
+ * repo_ingest: move the packages in the directory arg->argv[0] into the
+ * database directory and add them all at once.
+ */
+extern int repo_ingest(Arguments *);
+
+/*
+ * repo_query: list the packages in the database matching the predicates in
+ * arg->argv, sorted by arg->sort.
+ */
+extern int repo_query(Arguments *);
+
+/*
+ * repo_rdeps: print the packages that need to be rebuilt when the packages
+ * in arg->argv change, in the order in which to rebuild them.
+ */
+extern int repo_rdeps(Arguments *);
+
+/*
+ * repo_clean: reconcile the directory with the database, removing files
+ * that are not in the database and entries whose files are missing.
+ */
+extern int repo_clean(Arguments *);
+
+/*
+ * repo_rollback: replace packages in the database by an archived version,
+ * the previous one unless given as name=version.
+ */
+extern int repo_rollback(Arguments *);
+
+/*
+ * repo_serve: serve the database directory over HTTP on arg->http.
+ */
+extern int repo_serve(Arguments *);
+
 #endif // ACTIONS_H
 
 /* vim: set cin ts=4 sw=4 et: */
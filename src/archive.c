@@ -0,0 +1,749 @@
+/*
+ * archive.c
+ * Streaming reader for (compressed) tar archives, as used by pacman for
+ * both packages and databases.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "archive.h"
+#include "background.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bzlib.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+#define ARCHIVE_BUFFER  (64*1024)
+#define TAR_BLOCK       512
+
+struct archive {
+    FILE *file;
+    Compression compression;
+    union {
+        z_stream gz;
+        lzma_stream xz;
+        bz_stream bz;
+    } strm;
+    bool eof;               // no more input in file
+    bool end;               // no more output from decompressor
+    bool error;
+    bool drop;              // drop the pages of file from the page cache when done
+    Sha256 *digest;         // fed with the raw input, if not NULL
+    size_t peeked;          // compression_none: bytes of in[] not returned yet
+    unsigned char *next;
+
+    struct tar_entry entry;
+    char *longname;         // name for the next member (GNU 'L' or pax 'path')
+    off_t remaining;        // data of the current member not read yet
+    off_t padding;          // padding after the data of the current member
+
+    unsigned char in[ARCHIVE_BUFFER];
+};
+
+/* ------------------------------------------------------------------------- */
+
+static Compression detect(const unsigned char *buf, size_t len)
+{
+    if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+        return compression_gzip;
+    if (len >= 3 && memcmp(buf, "BZh", 3) == 0)
+        return compression_bzip2;
+    if (len >= 6 && memcmp(buf, "\xfd" "7zXZ\0", 6) == 0)
+        return compression_xz;
+    return compression_none;
+}
+
+/*
+ * fill: read more raw input from the file into ar->in.
+ * Returns the number of bytes now available.
+ */
+static size_t fill(struct archive *ar)
+{
+    size_t n = fread(ar->in, 1, ARCHIVE_BUFFER, ar->file);
+    background_read(n);
+    if (ar->digest != NULL)
+        sha256_update(ar->digest, ar->in, n);
+    if (n < ARCHIVE_BUFFER) {
+        if (ferror(ar->file))
+            ar->error = true;
+        ar->eof = true;
+    }
+    return n;
+}
+
+struct archive *archive_open(const char *path)
+{
+    return archive_open_digest(path, NULL);
+}
+
+struct archive *archive_open_digest(const char *path, Sha256 *digest)
+{
+    debug_printf("archive_open(%s)\n", path);
+
+    struct archive *ar = calloc(1, sizeof (struct archive));
+    if (ar == NULL)
+        return NULL;
+    ar->digest = digest;
+
+    ar->file = fopen(path, "rb");
+    if (ar->file == NULL) {
+        free(ar);
+        return NULL;
+    }
+    ar->drop = background_open(fileno(ar->file));
+
+    size_t avail = fill(ar);
+    ar->compression = detect(ar->in, avail);
+
+    int ret = 0;
+    switch (ar->compression) {
+        case compression_gzip:
+            ar->strm.gz.next_in = ar->in;
+            ar->strm.gz.avail_in = avail;
+            ret = inflateInit2(&ar->strm.gz, 15 + 32) == Z_OK ? 0 : -1;
+            break;
+        case compression_xz:
+            ar->strm.xz = (lzma_stream) LZMA_STREAM_INIT;
+            ar->strm.xz.next_in = ar->in;
+            ar->strm.xz.avail_in = avail;
+            ret = lzma_stream_decoder(&ar->strm.xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK ? 0 : -1;
+            break;
+        case compression_bzip2:
+            ar->strm.bz.next_in = (char *)ar->in;
+            ar->strm.bz.avail_in = avail;
+            ret = BZ2_bzDecompressInit(&ar->strm.bz, 0, 0) == BZ_OK ? 0 : -1;
+            break;
+        case compression_none:
+            /* the bytes we peeked at are given back by archive_read */
+            ar->peeked = avail;
+            ar->next = ar->in;
+            break;
+    }
+
+    if (ret != 0) {
+        fclose(ar->file);
+        free(ar);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return ar;
+}
+
+int archive_close(struct archive *ar)
+{
+    int retval;
+
+    if (ar == NULL)
+        return 0;
+
+    switch (ar->compression) {
+        case compression_gzip:
+            inflateEnd(&ar->strm.gz);
+            break;
+        case compression_xz:
+            lzma_end(&ar->strm.xz);
+            break;
+        case compression_bzip2:
+            BZ2_bzDecompressEnd(&ar->strm.bz);
+            break;
+        case compression_none:
+            break;
+    }
+
+    retval = ar->error ? -1 : 0;
+    background_done(fileno(ar->file), ar->drop);
+    fclose(ar->file);
+    free(ar->entry.name);
+    free(ar->longname);
+    free(ar);
+    return retval;
+}
+
+Compression archive_compression(const struct archive *ar)
+{
+    return ar->compression;
+}
+
+static ssize_t read_none(struct archive *ar, unsigned char *buf, size_t len)
+{
+    size_t n = 0;
+
+    if (ar->peeked > 0) {
+        n = len < ar->peeked ? len : ar->peeked;
+        memcpy(buf, ar->next, n);
+        ar->next += n;
+        ar->peeked -= n;
+        return n;
+    }
+    if (ar->eof)
+        return 0;
+    n = fread(buf, 1, len, ar->file);
+    background_read(n);
+    if (ar->digest != NULL)
+        sha256_update(ar->digest, buf, n);
+    if (n < len) {
+        if (ferror(ar->file)) {
+            ar->error = true;
+            return -1;
+        }
+        ar->eof = true;
+    }
+    return n;
+}
+
+static ssize_t read_gzip(struct archive *ar, unsigned char *buf, size_t len)
+{
+    z_stream *s = &ar->strm.gz;
+
+    s->next_out = buf;
+    s->avail_out = len;
+    while (s->avail_out > 0 && !ar->end) {
+        if (s->avail_in == 0 && !ar->eof) {
+            s->avail_in = fill(ar);
+            s->next_in = ar->in;
+        }
+        int ret = inflate(s, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* gzip files may consist of several concatenated members */
+            if (s->avail_in == 0 && !ar->eof) {
+                s->avail_in = fill(ar);
+                s->next_in = ar->in;
+            }
+            if (s->avail_in == 0)
+                ar->end = true;
+            else
+                inflateReset(s);
+        } else if (ret == Z_BUF_ERROR && s->avail_in == 0 && ar->eof) {
+            ar->error = true;   /* truncated */
+            break;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ar->error = true;
+            break;
+        }
+    }
+
+    if (ar->error && s->avail_out == len)
+        return -1;
+    return len - s->avail_out;
+}
+
+static ssize_t read_xz(struct archive *ar, unsigned char *buf, size_t len)
+{
+    lzma_stream *s = &ar->strm.xz;
+
+    s->next_out = buf;
+    s->avail_out = len;
+    while (s->avail_out > 0 && !ar->end) {
+        if (s->avail_in == 0 && !ar->eof) {
+            s->avail_in = fill(ar);
+            s->next_in = ar->in;
+        }
+        lzma_ret ret = lzma_code(s, ar->eof ? LZMA_FINISH : LZMA_RUN);
+        if (ret == LZMA_STREAM_END) {
+            ar->end = true;
+        } else if (ret != LZMA_OK) {
+            ar->error = true;
+            break;
+        }
+    }
+
+    if (ar->error && s->avail_out == len)
+        return -1;
+    return len - s->avail_out;
+}
+
+static ssize_t read_bzip2(struct archive *ar, unsigned char *buf, size_t len)
+{
+    bz_stream *s = &ar->strm.bz;
+
+    s->next_out = (char *)buf;
+    s->avail_out = len;
+    while (s->avail_out > 0 && !ar->end) {
+        if (s->avail_in == 0 && !ar->eof) {
+            s->avail_in = fill(ar);
+            s->next_in = (char *)ar->in;
+        }
+        int ret = BZ2_bzDecompress(s);
+        if (ret == BZ_STREAM_END) {
+            ar->end = true;
+        } else if (ret != BZ_OK || (s->avail_in == 0 && ar->eof && s->avail_out > 0)) {
+            ar->error = true;
+            break;
+        }
+    }
+
+    if (ar->error && s->avail_out == len)
+        return -1;
+    return len - s->avail_out;
+}
+
+ssize_t archive_read(struct archive *ar, void *buf, size_t len)
+{
+    switch (ar->compression) {
+        case compression_gzip:
+            return read_gzip(ar, buf, len);
+        case compression_xz:
+            return read_xz(ar, buf, len);
+        case compression_bzip2:
+            return read_bzip2(ar, buf, len);
+        default:
+            return read_none(ar, buf, len);
+    }
+}
+
+int archive_drain(struct archive *ar)
+{
+    /* the decompressor may still point into in[], but is not used again */
+    ar->peeked = 0;
+    ar->end = true;
+    while (!ar->eof)
+        fill(ar);
+    return ar->error ? -1 : 0;
+}
+
+/*
+ * read_full: read exactly len bytes, or fail.
+ */
+static int read_full(struct archive *ar, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = archive_read(ar, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int skip(struct archive *ar, off_t len)
+{
+    char buf[8192];
+    while (len > 0) {
+        size_t n = len < (off_t)sizeof buf ? (size_t)len : sizeof buf;
+        if (read_full(ar, buf, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * parse_number: parse a numeric tar header field, which is either octal
+ * or (for large values) base-256 with the high bit of the first byte set.
+ */
+static off_t parse_number(const char *field, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)field;
+    off_t value = 0;
+
+    if (*p & 0x80) {
+        value = *p++ & 0x3f;
+        for (size_t i = 1; i < len; i++)
+            value = (value << 8) | *p++;
+        return value;
+    }
+
+    while (len > 0 && (*p == ' ' || *p == '\0')) {
+        p++;
+        len--;
+    }
+    while (len > 0 && *p >= '0' && *p <= '7') {
+        value = value * 8 + (*p++ - '0');
+        len--;
+    }
+    return value;
+}
+
+static bool checksum_valid(const unsigned char *block)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    return sum == (unsigned long)parse_number((const char *)block + 148, 8);
+}
+
+/*
+ * parse_pax: extract the path from a pax extended header, which consists of
+ * records of the form "<length> <key>=<value>\n".
+ */
+static void parse_pax(struct archive *ar, char *data, size_t len)
+{
+    char *p = data, *end = data + len;
+
+    while (p < end) {
+        char *rec = p;
+        long reclen = strtol(p, &p, 10);
+        if (reclen <= 0 || rec + reclen > end || *p != ' ')
+            return;
+        char *key = p + 1;
+        char *eq = memchr(key, '=', rec + reclen - key);
+        if (eq != NULL && eq - key == 4 && memcmp(key, "path", 4) == 0) {
+            free(ar->longname);
+            ar->longname = cs_substr(eq + 1, 0, rec + reclen - 1 - (eq + 1));
+        }
+        p = rec + reclen;
+    }
+}
+
+int archive_next(struct archive *ar, struct tar_entry **entry)
+{
+    unsigned char block[TAR_BLOCK];
+
+    for (;;) {
+        if (skip(ar, ar->remaining + ar->padding) != 0)
+            goto error;
+        ar->remaining = ar->padding = 0;
+
+        if (read_full(ar, block, TAR_BLOCK) != 0)
+            goto error;
+
+        /* two zero blocks mark the end; one is enough for us */
+        bool zero = true;
+        for (int i = 0; i < TAR_BLOCK && zero; i++)
+            zero = block[i] == 0;
+        if (zero)
+            return 0;
+
+        if (!checksum_valid(block))
+            goto error;
+
+        const char *h = (const char *)block;
+        off_t size = parse_number(h + 124, 12);
+        char type = h[156] == '\0' ? '0' : h[156];
+
+        ar->remaining = size;
+        ar->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (type == 'L' || type == 'x') {
+            char *data = archive_read_data_all(ar, NULL);
+            if (data == NULL)
+                goto error;
+            if (type == 'L') {
+                free(ar->longname);
+                ar->longname = data;
+            } else {
+                parse_pax(ar, data, size);
+                free(data);
+            }
+            continue;
+        } else if (type == 'g' || type == 'K') {
+            continue;
+        }
+
+        free(ar->entry.name);
+        if (ar->longname != NULL) {
+            ar->entry.name = ar->longname;
+            ar->longname = NULL;
+        } else {
+            char name[101], prefix[156];
+            memcpy(name, h, 100);
+            name[100] = '\0';
+            if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+                memcpy(prefix, h + 345, 155);
+                prefix[155] = '\0';
+                ar->entry.name = cs_strvcat(prefix, "/", name, NULL);
+            } else {
+                ar->entry.name = cs_strclone(name);
+            }
+        }
+        ar->entry.type = type;
+        ar->entry.mode = parse_number(h + 100, 8);
+        ar->entry.size = size;
+        ar->entry.mtime = parse_number(h + 136, 12);
+
+        *entry = &ar->entry;
+        return 1;
+    }
+
+error:
+    ar->error = true;
+    return -1;
+}
+
+ssize_t archive_read_data(struct archive *ar, void *buf, size_t len)
+{
+    if (ar->remaining == 0)
+        return 0;
+    if ((off_t)len > ar->remaining)
+        len = ar->remaining;
+    if (read_full(ar, buf, len) != 0) {
+        ar->error = true;
+        return -1;
+    }
+    ar->remaining -= len;
+    return len;
+}
+
+char *archive_read_data_all(struct archive *ar, size_t *len)
+{
+    size_t size = ar->remaining;
+    char *buf = malloc(size + 1);
+
+    if (buf == NULL)
+        return NULL;
+    if (archive_read_data(ar, buf, size) != (ssize_t)size) {
+        free(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    if (len != NULL)
+        *len = size;
+    return buf;
+}
+
+/* ------------------------------------------------------------------------- */
+
+Compression compression_from_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (ext == NULL)
+        return compression_none;
+    if (strcmp(ext, ".gz") == 0)
+        return compression_gzip;
+    if (strcmp(ext, ".bz2") == 0)
+        return compression_bzip2;
+    if (strcmp(ext, ".xz") == 0)
+        return compression_xz;
+    return compression_none;
+}
+
+struct archive_writer {
+    FILE *file;
+    Compression compression;
+    union {
+        z_stream gz;
+        lzma_stream xz;
+        bz_stream bz;
+    } strm;
+    bool error;
+    unsigned char out[ARCHIVE_BUFFER];
+};
+
+struct archive_writer *archive_create(const char *path, Compression compression)
+{
+    debug_printf("archive_create(%s)\n", path);
+
+    struct archive_writer *aw = calloc(1, sizeof (struct archive_writer));
+    if (aw == NULL)
+        return NULL;
+
+    aw->file = fopen(path, "wb");
+    if (aw->file == NULL) {
+        free(aw);
+        return NULL;
+    }
+
+    int ret = 0;
+    aw->compression = compression;
+    switch (compression) {
+        case compression_gzip:
+            ret = deflateInit2(&aw->strm.gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                               15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+            break;
+        case compression_xz:
+            aw->strm.xz = (lzma_stream) LZMA_STREAM_INIT;
+            ret = lzma_easy_encoder(&aw->strm.xz, 6, LZMA_CHECK_CRC64) == LZMA_OK ? 0 : -1;
+            break;
+        case compression_bzip2:
+            ret = BZ2_bzCompressInit(&aw->strm.bz, 9, 0, 0) == BZ_OK ? 0 : -1;
+            break;
+        case compression_none:
+            break;
+    }
+
+    if (ret != 0) {
+        fclose(aw->file);
+        free(aw);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aw;
+}
+
+static void flush_out(struct archive_writer *aw, size_t len)
+{
+    if (len > 0 && fwrite(aw->out, 1, len, aw->file) != len)
+        aw->error = true;
+}
+
+/*
+ * write_compressed: feed len bytes of buf to the compressor and write whatever
+ * comes out; if finish is true, the compressed stream is terminated.
+ */
+static void write_compressed(struct archive_writer *aw, const void *buf, size_t len, bool finish)
+{
+    bool done = false;
+
+    switch (aw->compression) {
+        case compression_none:
+            if (len > 0 && fwrite(buf, 1, len, aw->file) != len)
+                aw->error = true;
+            break;
+        case compression_gzip: {
+            z_stream *s = &aw->strm.gz;
+            s->next_in = (unsigned char *)buf;
+            s->avail_in = len;
+            while (!done) {
+                s->next_out = aw->out;
+                s->avail_out = ARCHIVE_BUFFER;
+                int ret = deflate(s, finish ? Z_FINISH : Z_NO_FLUSH);
+                if (ret == Z_STREAM_ERROR)
+                    aw->error = true;
+                flush_out(aw, ARCHIVE_BUFFER - s->avail_out);
+                done = aw->error || (finish ? ret == Z_STREAM_END : s->avail_in == 0 && s->avail_out != 0);
+            }
+            break;
+        }
+        case compression_xz: {
+            lzma_stream *s = &aw->strm.xz;
+            s->next_in = buf;
+            s->avail_in = len;
+            while (!done) {
+                s->next_out = aw->out;
+                s->avail_out = ARCHIVE_BUFFER;
+                lzma_ret ret = lzma_code(s, finish ? LZMA_FINISH : LZMA_RUN);
+                if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                    aw->error = true;
+                flush_out(aw, ARCHIVE_BUFFER - s->avail_out);
+                done = aw->error || (finish ? ret == LZMA_STREAM_END : s->avail_in == 0 && s->avail_out != 0);
+            }
+            break;
+        }
+        case compression_bzip2: {
+            bz_stream *s = &aw->strm.bz;
+            s->next_in = (char *)buf;
+            s->avail_in = len;
+            while (!done) {
+                s->next_out = (char *)aw->out;
+                s->avail_out = ARCHIVE_BUFFER;
+                int ret = BZ2_bzCompress(s, finish ? BZ_FINISH : BZ_RUN);
+                if (ret < 0)
+                    aw->error = true;
+                flush_out(aw, ARCHIVE_BUFFER - s->avail_out);
+                done = aw->error || (finish ? ret == BZ_STREAM_END : s->avail_in == 0 && s->avail_out != 0);
+            }
+            break;
+        }
+    }
+}
+
+static void write_octal(char *field, size_t len, unsigned long long value)
+{
+    field[len-1] = '\0';
+    for (size_t i = len - 1; i-- > 0; value >>= 3)
+        field[i] = '0' + (value & 7);
+}
+
+static void write_header(struct archive_writer *aw, const char *name, char type,
+                         mode_t mode, time_t mtime, size_t size)
+{
+    char block[TAR_BLOCK];
+    unsigned long sum = 0;
+
+    memset(block, 0, TAR_BLOCK);
+    strncpy(block, name, 100);
+    write_octal(block + 100, 8, mode & 07777);
+    write_octal(block + 108, 8, 0);
+    write_octal(block + 116, 8, 0);
+    write_octal(block + 124, 12, size);
+    write_octal(block + 136, 12, mtime);
+    block[156] = type;
+    memcpy(block + 257, "ustar\0" "00", 8);
+    strcpy(block + 265, "root");
+    strcpy(block + 297, "root");
+
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)block[i];
+    write_octal(block + 148, 7, sum);
+
+    write_compressed(aw, block, TAR_BLOCK, false);
+}
+
+static void write_data(struct archive_writer *aw, const void *data, size_t size)
+{
+    static const char zero[TAR_BLOCK];
+
+    if (size == 0)
+        return;
+    write_compressed(aw, data, size, false);
+    if (size % TAR_BLOCK != 0)
+        write_compressed(aw, zero, TAR_BLOCK - size % TAR_BLOCK, false);
+}
+
+int archive_write(struct archive_writer *aw, const char *name, char type,
+                  mode_t mode, time_t mtime, const void *data, size_t size)
+{
+    size_t namelen = strlen(name);
+
+    /* names that do not fit into the header get a GNU long name entry */
+    if (namelen >= 100) {
+        write_header(aw, "././@LongLink", 'L', 0644, 0, namelen + 1);
+        write_data(aw, name, namelen + 1);
+    }
+    write_header(aw, name, type, mode, mtime, size);
+    write_data(aw, data, size);
+
+    return aw->error ? -1 : 0;
+}
+
+int archive_finish(struct archive_writer *aw)
+{
+    static const char zero[2*TAR_BLOCK];
+    int retval;
+
+    write_compressed(aw, zero, sizeof zero, false);
+    write_compressed(aw, NULL, 0, true);
+
+    switch (aw->compression) {
+        case compression_gzip:
+            deflateEnd(&aw->strm.gz);
+            break;
+        case compression_xz:
+            lzma_end(&aw->strm.xz);
+            break;
+        case compression_bzip2:
+            BZ2_bzCompressEnd(&aw->strm.bz);
+            break;
+        case compression_none:
+            break;
+    }
+
+    if (fflush(aw->file) != 0)
+        aw->error = true;
+    if (fclose(aw->file) != 0)
+        aw->error = true;
+    retval = aw->error ? -1 : 0;
+    free(aw);
+    return retval;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
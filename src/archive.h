@@ -0,0 +1,138 @@
+/*
+ * archive.h
+ * Streaming reader for (compressed) tar archives, as used by pacman for
+ * both packages and databases.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+/* Compression of the underlying file, detected from its first bytes. */
+typedef enum archive_compression {
+    compression_none,
+    compression_gzip,
+    compression_bzip2,
+    compression_xz
+} Compression;
+
+/* A single member of a tar archive. */
+struct tar_entry {
+    char *name;             // path of the member inside the archive
+    char type;              // tar typeflag: '0' file, '5' directory, '2' symlink, ...
+    mode_t mode;
+    off_t size;             // size of the data belonging to this member
+    time_t mtime;
+};
+
+struct archive;
+
+/*
+ * archive_open: open the file at path for reading; the compression is
+ * detected automatically. Returns NULL (and sets errno) on failure.
+ */
+extern struct archive *archive_open(const char *path);
+
+/*
+ * archive_open_digest: like archive_open, but also feed every byte read
+ * from the file, as it is on disk, to digest; call archive_drain before
+ * archive_close to have it cover the whole file.
+ */
+extern struct archive *archive_open_digest(const char *path, Sha256 *digest);
+
+/*
+ * archive_drain: read the rest of the file without decompressing it, so
+ * that the digest given to archive_open_digest covers all of it. Nothing
+ * more can be read from the archive afterwards.
+ * Returns 0, or -1 if the file could not be read.
+ */
+extern int archive_drain(struct archive *ar);
+
+/*
+ * archive_close: close the archive and free all associated memory.
+ * Returns 0, or -1 if any error occurred while reading.
+ */
+extern int archive_close(struct archive *ar);
+
+/*
+ * archive_read: read up to len bytes of the decompressed stream.
+ * Returns the number of bytes read, 0 at the end of the stream, -1 on error.
+ * Use this when the file is not a tar archive (e.g. a compressed JSON dump).
+ */
+extern ssize_t archive_read(struct archive *ar, void *buf, size_t len);
+
+/*
+ * archive_next: advance to the next member of the tar archive, skipping
+ * whatever data of the previous member has not been read yet.
+ * The entry remains valid until the next call to archive_next.
+ * Returns 1 if there is an entry, 0 at the end of the archive, -1 on error.
+ */
+extern int archive_next(struct archive *ar, struct tar_entry **entry);
+
+/*
+ * archive_read_data: read up to len bytes of the data of the current member.
+ * Returns the number of bytes read, 0 at the end of the member, -1 on error.
+ */
+extern ssize_t archive_read_data(struct archive *ar, void *buf, size_t len);
+
+/*
+ * archive_read_data_all: read the remaining data of the current member into
+ * a newly allocated, NUL-terminated buffer; len may be NULL.
+ * Warning: you must call free() on the result of this function.
+ */
+extern char *archive_read_data_all(struct archive *ar, size_t *len);
+
+/*
+ * archive_compression: return the compression that was detected.
+ */
+extern Compression archive_compression(const struct archive *ar);
+
+/*
+ * compression_from_name: guess the compression from the extension of a file
+ * name, such as repo.db.tar.gz.
+ */
+extern Compression compression_from_name(const char *name);
+
+struct archive_writer;
+
+/*
+ * archive_create: create (or truncate) the tar archive at path, compressed
+ * with compression. Returns NULL (and sets errno) on failure.
+ */
+extern struct archive_writer *archive_create(const char *path, Compression compression);
+
+/*
+ * archive_write: append a member with the given data to the archive;
+ * data may be NULL if size is 0. Returns 0, or -1 on error.
+ */
+extern int archive_write(struct archive_writer *aw, const char *name, char type,
+                         mode_t mode, time_t mtime, const void *data, size_t size);
+
+/*
+ * archive_finish: terminate the archive, flush and close the file, and
+ * free aw. Returns 0, or -1 if any write failed.
+ */
+extern int archive_finish(struct archive_writer *aw);
+
+#endif // ARCHIVE_H
+
+/* vim: set cin ts=4 sw=4 et: */
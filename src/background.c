@@ -0,0 +1,134 @@
+/*
+ * background.c
+ * Running as a background job: idle priorities and throttled reading.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "background.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+
+/* from linux/ioprio.h, which glibc has no wrapper for */
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+
+static bool background = false;
+
+/* The token bucket limiting the rate of reading, shared by all threads. */
+static struct {
+    pthread_mutex_t lock;
+    double rate;            // bytes per second, 0 for no limit
+    double tokens;          // bytes that may be read now; negative if in debt
+    struct timespec last;   // when tokens was brought up to date
+} bucket = { PTHREAD_MUTEX_INITIALIZER, 0, 0, { 0, 0 } };
+
+int background_start(unsigned long rate)
+{
+    debug_printf("background_start(%lu)\n", rate);
+
+    int ret = 0;
+
+    background = true;
+    bucket.rate = rate;
+    clock_gettime(CLOCK_MONOTONIC, &bucket.last);
+
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        ret = -1;
+#endif
+    if (setpriority(PRIO_PROCESS, 0, BACKGROUND_NICE) != 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * cached: whether the first page of the file open as fd is in the page cache.
+ */
+static bool cached(int fd)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char vec = 0;
+    struct stat st;
+    void *addr;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        return false;
+    addr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    if (mincore(addr, page, &vec) != 0)
+        vec = 0;
+    munmap(addr, page);
+    return vec & 1;
+}
+
+bool background_open(int fd)
+{
+    if (!background)
+        return false;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return !cached(fd);
+}
+
+void background_read(size_t len)
+{
+    struct timespec now, wait;
+    double debt;
+
+    if (bucket.rate == 0)
+        return;
+
+    /* take the tokens, even if that means debt, and wait for it to be
+     * paid off; the threads that come later wait for their share as well */
+    pthread_mutex_lock(&bucket.lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bucket.tokens += bucket.rate * ((now.tv_sec - bucket.last.tv_sec) + (now.tv_nsec - bucket.last.tv_nsec) / 1e9);
+    if (bucket.tokens > bucket.rate)
+        bucket.tokens = bucket.rate;    // at most one second's worth in a burst
+    bucket.last = now;
+    bucket.tokens -= len;
+    debt = bucket.tokens < 0 ? -bucket.tokens / bucket.rate : 0;
+    pthread_mutex_unlock(&bucket.lock);
+
+    if (debt > 0) {
+        wait.tv_sec = (time_t)debt;
+        wait.tv_nsec = (long)((debt - wait.tv_sec) * 1e9);
+        while (nanosleep(&wait, &wait) != 0 && errno == EINTR)
+            ;
+    }
+}
+
+void background_done(int fd, bool drop)
+{
+    if (drop)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* vim: set cin ts=4 sw=4 et: */
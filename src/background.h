@@ -0,0 +1,58 @@
+/*
+ * background.h
+ * Running as a background job: idle priorities and throttled reading.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * background_start: make repo a background job, so that it does not get in
+ * the way of serving the packages: the idle I/O class and the lowest CPU
+ * priority, for the threads and programs it starts afterwards as well; and
+ * if rate is not 0, reading package files at no more than rate bytes per
+ * second in total. Returns 0, or -1 (and sets errno) if the priority could
+ * not be lowered.
+ */
+extern int background_start(unsigned long rate);
+
+/*
+ * background_open: prepare the file open as fd for reading from start to
+ * end. Returns whether its pages should be dropped from the page cache once
+ * it is read: only in background mode, and only if it was not cached
+ * already, e.g. because it is being served.
+ */
+extern bool background_open(int fd);
+
+/*
+ * background_read: account for len bytes that were just read from a
+ * package file, waiting as long as the rate limit requires.
+ */
+extern void background_read(size_t len);
+
+/*
+ * background_done: done reading the file open as fd; drop its pages from
+ * the page cache if background_open said so.
+ */
+extern void background_done(int fd, bool drop);
+
+#endif // BACKGROUND_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,825 @@
+/*
+ * database.c
+ * Streaming reader for pacman repository databases.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "database.h"
+#include "archive.h"
+#include "fsutil.h"
+#include "hashmap.h"
+#include "sha256.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+#include "libcassava/string.h"
+
+/*
+ * append: add data to the end of the list whose last node is *tail.
+ */
+static void append(NodeStr **head, NodeStr **tail, char *data)
+{
+    NodeStr *node = list_node();
+    node->data = data;
+    if (*head == NULL)
+        *head = node;
+    else
+        (*tail)->next = node;
+    *tail = node;
+}
+
+void package_parse_desc(Package *pkg, char *text)
+{
+    char **field = NULL;
+    off_t *number = NULL;
+    time_t *date = NULL;
+    NodeStr **list = NULL, *tail = NULL;
+    char *line, *next;
+
+    for (line = text; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        if (*line == '\0') {
+            field = NULL;
+            number = NULL;
+            date = NULL;
+            list = NULL;
+        } else if (field != NULL) {
+            free(*field);
+            *field = cs_strclone(line);
+        } else if (number != NULL) {
+            *number = strtoll(line, NULL, 10);
+        } else if (date != NULL) {
+            *date = strtoll(line, NULL, 10);
+        } else if (list != NULL) {
+            append(list, &tail, cs_strclone(line));
+        } else if (line[0] == '%') {
+#define _key(K)  (strcmp(line, "%" K "%") == 0)
+            if (_key("FILENAME"))           field = &pkg->filename;
+            else if (_key("NAME"))          field = &pkg->name;
+            else if (_key("BASE"))          field = &pkg->base;
+            else if (_key("VERSION"))       field = &pkg->version;
+            else if (_key("DESC"))          field = &pkg->desc;
+            else if (_key("ARCH"))          field = &pkg->arch;
+            else if (_key("PACKAGER"))      field = &pkg->packager;
+            else if (_key("MD5SUM"))        field = &pkg->md5sum;
+            else if (_key("SHA256SUM"))     field = &pkg->sha256sum;
+            else if (_key("CSIZE"))         number = &pkg->csize;
+            else if (_key("ISIZE"))         number = &pkg->isize;
+            else if (_key("BUILDDATE"))     date = &pkg->builddate;
+            else if (_key("DEPENDS"))       list = &pkg->depends;
+            else if (_key("PROVIDES"))      list = &pkg->provides;
+            else if (_key("CONFLICTS"))     list = &pkg->conflicts;
+            else if (_key("REPLACES"))      list = &pkg->replaces;
+            else if (_key("FILES"))         list = &pkg->files;
+#undef _key
+            if (list != NULL) {
+                /* continue a list that a previous entry may have started */
+                tail = *list;
+                while (tail != NULL && tail->next != NULL)
+                    tail = tail->next;
+            }
+        }
+    }
+}
+
+bool package_parse_filename(const char *filename, char **name, char **version, char **arch)
+{
+    const char *base = strrchr(filename, '/');
+    const char *ext, *dash[3];
+    const char *p;
+
+    base = base != NULL ? base + 1 : filename;
+    ext = strstr(base, ".pkg.tar");
+    if (ext == NULL)
+        return false;
+
+    /* the last three dashes separate pkgver, pkgrel and arch */
+    p = ext;
+    for (int i = 0; i < 3; i++) {
+        while (p > base && *--p != '-')
+            ;
+        if (p == base)
+            return false;
+        dash[i] = p;
+    }
+
+    if (name != NULL)
+        *name = cs_substr(base, 0, dash[2] - base);
+    if (version != NULL)
+        *version = cs_substr(base, dash[2] + 1 - base, dash[0] - base);
+    if (arch != NULL)
+        *arch = cs_substr(base, dash[0] + 1 - base, ext - base);
+    return true;
+}
+
+void package_free(Package *pkg)
+{
+    if (pkg == NULL)
+        return;
+
+    free(pkg->filename);
+    free(pkg->name);
+    free(pkg->base);
+    free(pkg->version);
+    free(pkg->desc);
+    free(pkg->arch);
+    free(pkg->packager);
+    free(pkg->md5sum);
+    free(pkg->sha256sum);
+    list_free_all(&pkg->depends);
+    list_free_all(&pkg->provides);
+    list_free_all(&pkg->conflicts);
+    list_free_all(&pkg->replaces);
+    list_free_all(&pkg->files);
+    free(pkg);
+}
+
+int db_read(const char *path, package_callback callback, void *data)
+{
+    debug_printf("db_read(%s)\n", path);
+
+    struct archive *ar;
+    struct tar_entry *entry;
+    Package *pkg = NULL;
+    char *dir = NULL;
+    int count = 0;
+    int ret = 0;
+    bool stop = false;
+
+    ar = archive_open(path);
+    if (ar == NULL)
+        return -1;
+
+    /* All entries of one package are stored together in the directory
+     * <name>-<version>/, so a package is complete once the directory changes. */
+    while (!stop && (ret = archive_next(ar, &entry)) == 1) {
+        char *slash = strrchr(entry->name, '/');
+        if (slash == NULL || slash == entry->name)
+            continue;
+
+        size_t dirlen = slash - entry->name;
+        if (dir == NULL || strlen(dir) != dirlen || strncmp(dir, entry->name, dirlen) != 0) {
+            if (pkg != NULL) {
+                count++;
+                stop = callback(pkg, data) != 0;
+                pkg = NULL;
+            }
+            free(dir);
+            dir = cs_substr(entry->name, 0, dirlen);
+        }
+
+        if (entry->type != '0' || slash[1] == '\0')
+            continue;
+        if (strcmp(slash+1, "desc") != 0 && strcmp(slash+1, "depends") != 0 && strcmp(slash+1, "files") != 0)
+            continue;
+
+        char *text = archive_read_data_all(ar, NULL);
+        if (text == NULL) {
+            ret = -1;
+            break;
+        }
+        if (pkg == NULL)
+            pkg = calloc(1, sizeof (Package));
+        package_parse_desc(pkg, text);
+        free(text);
+    }
+
+    if (pkg != NULL) {
+        if (ret >= 0 && !stop) {
+            count++;
+            callback(pkg, data);
+        } else {
+            package_free(pkg);
+        }
+    }
+    free(dir);
+
+    if (archive_close(ar) != 0 && !stop)
+        ret = -1;
+    if (ret < 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * A raw_callback receives the unparsed desc and files entries of a package
+ * (either may be NULL) and becomes the owner of all three strings.
+ */
+typedef void (*raw_callback)(char *dir, char *desc, char *files, void *data);
+
+/*
+ * read_raw: like db_read, but without parsing the entries.
+ */
+static int read_raw(const char *path, raw_callback callback, void *data)
+{
+    struct archive *ar;
+    struct tar_entry *entry;
+    char *dir = NULL, *desc = NULL, *files = NULL;
+    int count = 0;
+    int ret = 0;
+
+    ar = archive_open(path);
+    if (ar == NULL)
+        return -1;
+
+    while ((ret = archive_next(ar, &entry)) == 1) {
+        char *slash = strrchr(entry->name, '/');
+        if (slash == NULL || slash == entry->name)
+            continue;
+
+        size_t dirlen = slash - entry->name;
+        if (dir == NULL || strlen(dir) != dirlen || strncmp(dir, entry->name, dirlen) != 0) {
+            if (dir != NULL) {
+                count++;
+                callback(dir, desc, files, data);
+            }
+            dir = cs_substr(entry->name, 0, dirlen);
+            desc = files = NULL;
+        }
+
+        char **text = NULL;
+        if (entry->type == '0' && strcmp(slash+1, "desc") == 0)
+            text = &desc;
+        else if (entry->type == '0' && strcmp(slash+1, "files") == 0)
+            text = &files;
+        if (text == NULL)
+            continue;
+
+        free(*text);
+        *text = archive_read_data_all(ar, NULL);
+        if (*text == NULL) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (dir != NULL) {
+        if (ret >= 0) {
+            count++;
+            callback(dir, desc, files, data);
+        } else {
+            free(dir);
+            free(desc);
+            free(files);
+        }
+    }
+
+    if (archive_close(ar) != 0 || ret < 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * desc_identity: return "<filename> <checksum>" for a desc entry, which
+ * changes whenever the package file changes, or NULL.
+ */
+static char *desc_identity(const char *desc)
+{
+    Package *pkg = calloc(1, sizeof (Package));
+    char *text = cs_strclone(desc);
+    char *identity;
+
+    package_parse_desc(pkg, text);
+    identity = package_identity(pkg);
+
+    free(text);
+    package_free(pkg);
+    return identity;
+}
+
+/* A growable, NUL-terminated string. */
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void strbuf_append(struct strbuf *b, const char *str, size_t len)
+{
+    if (b->len + len + 1 > b->cap) {
+        while (b->len + len + 1 > b->cap)
+            b->cap = b->cap ? 2 * b->cap : 4096;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, str, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+char *package_identity(const Package *pkg)
+{
+    const char *sum = pkg->sha256sum != NULL ? pkg->sha256sum : pkg->md5sum;
+
+    if (pkg->filename == NULL)
+        return NULL;
+    return cs_strvcat(pkg->filename, " ", sum != NULL ? sum : "", NULL);
+}
+
+/*
+ * read_elf: read the rest of the current member, which starts with the
+ * magic number already read, into one buffer and give it to callback.
+ */
+static int read_elf(struct archive *ar, off_t size, elf_callback callback, void *data)
+{
+    unsigned char *image = malloc(size);
+    size_t done = SELFMAG;
+
+    if (image == NULL)
+        return -1;
+    memcpy(image, ELFMAG, SELFMAG);
+    while (done < (size_t)size) {
+        ssize_t n = archive_read_data(ar, image + done, size - done);
+        if (n <= 0) {
+            free(image);
+            return -1;
+        }
+        done += n;
+    }
+    callback(image, size, data);
+    free(image);
+    return 0;
+}
+
+char *package_scan(const char *path, elf_callback callback, void *data)
+{
+    debug_printf("package_scan(%s)\n", path);
+
+    struct archive *ar;
+    struct tar_entry *entry;
+    struct strbuf buf = { NULL, 0, 0 };
+    int ret;
+
+    ar = archive_open(path);
+    if (ar == NULL)
+        return NULL;
+
+    strbuf_append(&buf, "%FILES%\n", 8);
+    while ((ret = archive_next(ar, &entry)) == 1) {
+        const char *name = entry->name;
+        if (name[0] == '.' && name[1] == '/')
+            name += 2;
+        /* skip .PKGINFO, .MTREE, .INSTALL and friends */
+        if (name[0] == '.' || name[0] == '\0')
+            continue;
+
+        size_t len = strlen(name);
+        strbuf_append(&buf, name, len);
+        if (entry->type == '5' && name[len-1] != '/')
+            strbuf_append(&buf, "/", 1);
+        strbuf_append(&buf, "\n", 1);
+
+        if (callback != NULL && entry->type == '0' && entry->size >= EI_NIDENT) {
+            unsigned char magic[SELFMAG];
+            if (archive_read_data(ar, magic, SELFMAG) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0
+                && read_elf(ar, entry->size, callback, data) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    strbuf_append(&buf, "\n", 1);
+
+    if (archive_close(ar) != 0 || ret < 0) {
+        free(buf.data);
+        return NULL;
+    }
+    return buf.data;
+}
+
+/* The sections of a desc entry in the order of repo-add, with the keys of
+ * .PKGINFO they come from; NULL for those that are not in .PKGINFO. */
+static const struct {
+    const char *section;
+    const char *key;
+} desc_fields[] = {
+    { "FILENAME", NULL },
+    { "NAME", "pkgname" },
+    { "BASE", "pkgbase" },
+    { "VERSION", "pkgver" },
+    { "DESC", "pkgdesc" },
+    { "GROUPS", "group" },
+    { "CSIZE", NULL },
+    { "ISIZE", "size" },
+    { "SHA256SUM", NULL },
+    { "PGPSIG", NULL },
+    { "URL", "url" },
+    { "LICENSE", "license" },
+    { "ARCH", "arch" },
+    { "BUILDDATE", "builddate" },
+    { "PACKAGER", "packager" },
+    { "REPLACES", "replaces" },
+    { "CONFLICTS", "conflict" },
+    { "PROVIDES", "provides" },
+    { "DEPENDS", "depend" },
+    { "OPTDEPENDS", "optdepend" },
+    { "MAKEDEPENDS", "makedepend" },
+    { "CHECKDEPENDS", "checkdepend" },
+};
+
+static void strbuf_section(struct strbuf *b, const char *section, const char *value)
+{
+    strbuf_append(b, "%", 1);
+    strbuf_append(b, section, strlen(section));
+    strbuf_append(b, "%\n", 2);
+    strbuf_append(b, value, strlen(value));
+    strbuf_append(b, "\n\n", 2);
+}
+
+/*
+ * base64: encode the file at path, as repo-add does for signatures.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *base64(const char *path)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    FILE *in = fopen(path, "rb");
+    struct strbuf b = { NULL, 0, 0 };
+    unsigned char buf[3];
+    size_t n;
+
+    if (in == NULL)
+        return NULL;
+    strbuf_append(&b, "", 0);
+    while ((n = fread(buf, 1, 3, in)) > 0) {
+        char out[4];
+        unsigned v = buf[0] << 16 | (n > 1 ? buf[1] << 8 : 0) | (n > 2 ? buf[2] : 0);
+        out[0] = digits[v >> 18];
+        out[1] = digits[(v >> 12) & 63];
+        out[2] = n > 1 ? digits[(v >> 6) & 63] : '=';
+        out[3] = n > 2 ? digits[v & 63] : '=';
+        strbuf_append(&b, out, 4);
+    }
+    fclose(in);
+    return b.data;
+}
+
+char *package_read_desc(const char *path)
+{
+    debug_printf("package_read_desc(%s)\n", path);
+
+    char hex[SHA256_HEX_LENGTH], size[32];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct strbuf b = { NULL, 0, 0 };
+    struct archive *ar;
+    struct tar_entry *entry;
+    struct stat st;
+    Sha256 ctx;
+    char *info = NULL, *sig, *filename, *save;
+    char **keys = NULL, **values = NULL;
+    size_t nlines = 0, cap = 0;
+    int ret;
+
+    /* a single pass: .PKGINFO comes first, and the rest of the file is
+     * only read for the checksum, without being decompressed */
+    if (stat(path, &st) != 0)
+        return NULL;
+    sha256_init(&ctx);
+    ar = archive_open_digest(path, &ctx);
+    if (ar == NULL)
+        return NULL;
+    while (archive_next(ar, &entry) == 1) {
+        if (strcmp(entry->name, ".PKGINFO") == 0) {
+            info = archive_read_data_all(ar, NULL);
+            break;
+        }
+    }
+    ret = archive_drain(ar);
+    ret |= archive_close(ar);
+    if (ret != 0 || info == NULL) {
+        free(info);
+        return NULL;
+    }
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+
+    for (char *line = strtok_r(info, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char *eq = strstr(line, " = ");
+        if (line[0] == '#' || eq == NULL)
+            continue;
+        if (nlines == cap) {
+            cap = cap ? 2 * cap : 64;
+            keys = realloc(keys, cap * sizeof (char *));
+            values = realloc(values, cap * sizeof (char *));
+        }
+        *eq = '\0';
+        keys[nlines] = line;
+        values[nlines++] = eq + 3;
+    }
+
+    filename = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : (char *)path;
+    snprintf(size, sizeof size, "%lld", (long long)st.st_size);
+    sig = cs_strcat(path, ".sig");
+    for (size_t i = 0; i < sizeof desc_fields / sizeof desc_fields[0]; i++) {
+        const char *section = desc_fields[i].section;
+        size_t start = b.len;
+
+        if (desc_fields[i].key == NULL) {
+            if (strcmp(section, "FILENAME") == 0)
+                strbuf_section(&b, section, filename);
+            else if (strcmp(section, "CSIZE") == 0)
+                strbuf_section(&b, section, size);
+            else if (strcmp(section, "SHA256SUM") == 0)
+                strbuf_section(&b, section, hex);
+            else if (strcmp(section, "PGPSIG") == 0) {
+                char *encoded = base64(sig);
+                if (encoded != NULL)
+                    strbuf_section(&b, section, encoded);
+                free(encoded);
+            }
+            continue;
+        }
+
+        /* keys such as depend may be given any number of times */
+        for (size_t j = 0; j < nlines; j++) {
+            if (strcmp(keys[j], desc_fields[i].key) != 0)
+                continue;
+            if (b.len == start) {
+                strbuf_append(&b, "%", 1);
+                strbuf_append(&b, section, strlen(section));
+                strbuf_append(&b, "%\n", 2);
+            }
+            strbuf_append(&b, values[j], strlen(values[j]));
+            strbuf_append(&b, "\n", 1);
+        }
+        if (b.len != start)
+            strbuf_append(&b, "\n", 1);
+    }
+
+    free(sig);
+    free(values);
+    free(keys);
+    free(info);
+    return b.data;
+}
+
+int db_write(const char *path, const char *old, char **dirs, char **descs, size_t count)
+{
+    debug_printf("db_write(%s, %zu)\n", path, count);
+
+    char *tmp_path = cs_strcat(path, ".tmp");
+    struct archive_writer *aw = archive_create(tmp_path, compression_from_name(path));
+    time_t now = time(NULL);
+    int retval = 0;
+
+    if (aw == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char *name = cs_strcat(dirs[i], "/");
+        archive_write(aw, name, '5', 0755, now, NULL, 0);
+        free(name);
+        name = cs_strcat(dirs[i], "/desc");
+        archive_write(aw, name, '0', 0644, now, descs[i], strlen(descs[i]));
+        free(name);
+    }
+    if (archive_finish(aw) != 0 || fs_publish(tmp_path, path, old) != 0) {
+        remove(tmp_path);
+        retval = -1;
+    }
+    free(tmp_path);
+    return retval;
+}
+
+struct files_job {
+    char *dir;
+    char *desc;
+    char *path;             // package archive to read, NULL if files is reused
+    char *files;
+    bool done;
+};
+
+struct files_pool {
+    struct files_job *jobs;
+    size_t count;
+    size_t cap;
+    size_t next;            // next job to hand out to a worker
+    HashMap *previous;      // identity -> files entry of the previous files database
+    HashMap *scanned;       // identity -> files entry read just now (optional)
+    const char *pkg_dir;
+    const HashMap *paths;   // file name -> path relative to pkg_dir (optional)
+    int reads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void collect_previous(char *dir, char *desc, char *files, void *data)
+{
+    HashMap *previous = data;
+    char *identity = desc != NULL && files != NULL ? desc_identity(desc) : NULL;
+
+    if (identity != NULL && !hashmap_contains(previous, identity))
+        hashmap_put(previous, identity, files);
+    else {
+        free(identity);
+        free(files);
+    }
+    free(dir);
+    free(desc);
+}
+
+static void collect_jobs(char *dir, char *desc, char *files, void *data)
+{
+    struct files_pool *pool = data;
+    struct files_job *job;
+    char *identity;
+
+    free(files);
+    if (desc == NULL) {
+        free(dir);
+        return;
+    }
+
+    if (pool->count == pool->cap) {
+        pool->cap = pool->cap ? 2 * pool->cap : 256;
+        pool->jobs = realloc(pool->jobs, pool->cap * sizeof (struct files_job));
+    }
+    job = &pool->jobs[pool->count++];
+    memset(job, 0, sizeof (struct files_job));
+    job->dir = dir;
+    job->desc = desc;
+
+    identity = desc_identity(desc);
+    if (identity == NULL) {
+        job->done = true;
+        return;
+    }
+
+    if (pool->scanned != NULL && (job->files = hashmap_get(pool->scanned, identity)) != NULL) {
+        hashmap_put(pool->scanned, identity, NULL);
+        job->done = true;
+    } else if ((job->files = hashmap_get(pool->previous, identity)) != NULL) {
+        /* take it, so it is not freed with the map */
+        hashmap_put(pool->previous, identity, NULL);
+        job->done = true;
+    } else {
+        job->path = cs_substr(identity, 0, strchr(identity, ' ') - identity);
+        pool->reads++;
+    }
+    free(identity);
+}
+
+static void *files_worker(void *data)
+{
+    struct files_pool *pool = data;
+
+    for (;;) {
+        struct files_job *job = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && job == NULL) {
+            if (pool->jobs[pool->next].path != NULL)
+                job = &pool->jobs[pool->next];
+            pool->next++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (job == NULL)
+            break;
+
+        const char *rel = pool->paths != NULL ? hashmap_get(pool->paths, job->path) : NULL;
+        char *path = cs_strvcat(pool->pkg_dir, "/", rel != NULL ? rel : job->path, NULL);
+        char *files = package_scan(path, NULL, NULL);
+        if (files == NULL)
+            fprintf(stderr, "Warning: cannot read package '%s'; its file list is left out.\n", path);
+        free(path);
+
+        pthread_mutex_lock(&pool->lock);
+        job->files = files;
+        job->done = true;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void free_string(void *str)
+{
+    free(str);
+}
+
+int db_write_files(const char *db_path, const char *files_path, const char *out_path,
+                   const char *pkg_dir, const HashMap *paths, int jobs, HashMap *scanned)
+{
+    debug_printf("db_write_files(%s)\n", out_path);
+
+    struct files_pool pool;
+    struct archive_writer *aw;
+    pthread_t *threads;
+    int started = 0;
+    int retval = 0;
+    time_t now = time(NULL);
+
+    memset(&pool, 0, sizeof pool);
+    pool.pkg_dir = pkg_dir;
+    pool.paths = paths;
+    pool.previous = hashmap_new(1024);
+    pool.scanned = scanned;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    /* a missing or unreadable previous files database just means more work */
+    read_raw(files_path, collect_previous, pool.previous);
+    if (read_raw(db_path, collect_jobs, &pool) < 0) {
+        retval = -1;
+        goto cleanup;
+    }
+
+    aw = archive_create(out_path, compression_from_name(files_path));
+    if (aw == NULL) {
+        retval = -1;
+        goto cleanup;
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+    threads = malloc(jobs * sizeof (pthread_t));
+    for (int i = 0; i < jobs && i < pool.reads; i++)
+        if (pthread_create(&threads[started], NULL, files_worker, &pool) == 0)
+            started++;
+    if (started == 0 && pool.reads > 0)
+        files_worker(&pool);
+
+    /* write every package as soon as its turn has come and it is done */
+    for (size_t i = 0; i < pool.count; i++) {
+        struct files_job *job = &pool.jobs[i];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        char *name = cs_strcat(job->dir, "/");
+        archive_write(aw, name, '5', 0755, now, NULL, 0);
+        free(name);
+        name = cs_strcat(job->dir, "/desc");
+        archive_write(aw, name, '0', 0644, now, job->desc, strlen(job->desc));
+        free(name);
+        if (job->files != NULL) {
+            name = cs_strcat(job->dir, "/files");
+            archive_write(aw, name, '0', 0644, now, job->files, strlen(job->files));
+            free(name);
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (archive_finish(aw) != 0) {
+        remove(out_path);
+        retval = -1;
+    } else {
+        retval = pool.reads;
+    }
+
+cleanup:
+    for (size_t i = 0; i < pool.count; i++) {
+        free(pool.jobs[i].dir);
+        free(pool.jobs[i].desc);
+        free(pool.jobs[i].path);
+        free(pool.jobs[i].files);
+    }
+    free(pool.jobs);
+    hashmap_foreach(pool.previous, e)
+        free((char *)e->key);
+    hashmap_free(pool.previous, free_string);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    return retval;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
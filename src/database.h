@@ -0,0 +1,144 @@
+/*
+ * database.h
+ * Streaming reader for pacman repository databases.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "hashmap.h"
+
+#include "libcassava/list_str.h"
+
+/* A package entry as it is stored in the desc (and depends) files of a database. */
+typedef struct package {
+    char *filename;         // %FILENAME%
+    char *name;             // %NAME%
+    char *base;             // %BASE%
+    char *version;          // %VERSION%
+    char *desc;             // %DESC%
+    char *arch;             // %ARCH%
+    char *packager;         // %PACKAGER%
+    char *md5sum;           // %MD5SUM%
+    char *sha256sum;        // %SHA256SUM%
+    off_t csize;            // %CSIZE%
+    off_t isize;            // %ISIZE%
+    time_t builddate;       // %BUILDDATE%
+    NodeStr *depends;       // %DEPENDS%
+    NodeStr *provides;      // %PROVIDES%
+    NodeStr *conflicts;     // %CONFLICTS%
+    NodeStr *replaces;      // %REPLACES%
+    NodeStr *files;         // %FILES% (only in .files databases)
+} Package;
+
+/*
+ * A package_callback is given each package read from a database. It becomes
+ * the owner of pkg and must eventually call package_free on it.
+ * Returns 0 to continue reading, anything else to stop.
+ */
+typedef int (*package_callback)(Package *pkg, void *data);
+
+/*
+ * db_read: read the database at path entry by entry, calling callback for
+ * each package; the database is never held in memory as a whole.
+ * Returns: the number of packages read, or -1 if the database could not be
+ * read (see errno).
+ */
+extern int db_read(const char *path, package_callback callback, void *data);
+
+/*
+ * package_parse_desc: fill in pkg from the contents of a desc, depends or
+ * files entry; text is modified in the process.
+ */
+extern void package_parse_desc(Package *pkg, char *text);
+
+/*
+ * package_parse_filename: split a package file name of the form
+ * <name>-<pkgver>-<pkgrel>-<arch>.pkg.tar.<ext> into its parts, without
+ * resorting to regular expressions; any of the outputs may be NULL.
+ * Returns false if filename does not look like a package.
+ * Warning: you must call free() on the results of this function.
+ */
+extern bool package_parse_filename(const char *filename, char **name, char **version, char **arch);
+
+/*
+ * package_free: free pkg and everything it contains.
+ */
+extern void package_free(Package *pkg);
+
+/*
+ * package_identity: return "<filename> <checksum>" for pkg, which changes
+ * whenever the package file changes, or NULL if pkg has no file name.
+ * Warning: you must call free() on the result of this function.
+ */
+extern char *package_identity(const Package *pkg);
+
+/*
+ * An elf_callback is given the whole image of an ELF file in a package;
+ * the image belongs to the caller.
+ */
+typedef void (*elf_callback)(const unsigned char *image, size_t len, void *data);
+
+/*
+ * package_scan: read the package archive at path once, giving each ELF file
+ * in it to callback (which may be NULL), and return its contents as a files
+ * entry. Only the first bytes of the other files are looked at.
+ * Returns NULL if the archive cannot be read.
+ * Warning: you must call free() on the result of this function.
+ */
+extern char *package_scan(const char *path, elf_callback callback, void *data);
+
+/*
+ * package_read_desc: read the package archive at path, in a single pass for
+ * its checksum and its .PKGINFO, and return its desc entry
+ * as repo-add would write it, including a detached signature path.sig.
+ * Returns NULL if the archive cannot be read.
+ * Warning: you must call free() on the result of this function.
+ */
+extern char *package_read_desc(const char *path);
+
+/*
+ * db_write: write a database with the count desc entries descs, in the
+ * directories dirs (<name>-<version>), to path. The database is replaced
+ * with fs_publish, keeping the previous one as old if it is not NULL.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int db_write(const char *path, const char *old, char **dirs, char **descs, size_t count);
+
+/*
+ * db_write_files: write the files database (as used by pacman -F) belonging
+ * to the database at db_path to out_path, which the caller then publishes as
+ * files_path (the previous files database), by listing the contents of each
+ * package archive in pkg_dir; paths may map the file names of packages in
+ * subdirectories of pkg_dir to their relative paths. The archives are read
+ * in parallel by jobs threads, and the result is written in database order
+ * as soon as it is available. Packages that are unchanged since the previous files database
+ * (same file name and checksum) reuse their old file list, and those in
+ * scanned (may be NULL), which maps package_identity to a files entry that
+ * has been read already, take theirs from there.
+ * Returns: the number of package archives that had to be read, or -1 on error.
+ */
+extern int db_write_files(const char *db_path, const char *files_path, const char *out_path,
+                          const char *pkg_dir, const HashMap *paths, int jobs, HashMap *scanned);
+
+#endif // DATABASE_H
+
+/* vim: set cin ts=4 sw=4 et: */
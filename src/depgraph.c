@@ -0,0 +1,693 @@
+/*
+ * depgraph.c
+ * Reverse dependencies between the packages of a database.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "depgraph.h"
+#include "database.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+#include "libcassava/string.h"
+
+static void add_unique(NodeStr **head, const char *str)
+{
+    if (list_search(*head, str) == NULL)
+        list_push(head, cs_strclone(str));
+}
+
+/*
+ * ELF_DYNAMIC: define elf<bits>_dynamic, which adds the DT_SONAME and
+ * DT_NEEDED entries of the dynamic section of an ELF image of that class to
+ * sonames and needed. Everything is bounds checked, as the image may be
+ * truncated or not an ELF file at all.
+ */
+#define ELF_DYNAMIC(BITS) \
+static void elf##BITS##_dynamic(const unsigned char *data, size_t len, NodeStr **sonames, NodeStr **needed) \
+{ \
+    Elf##BITS##_Ehdr eh; \
+    Elf##BITS##_Shdr sh, strsh; \
+    Elf##BITS##_Dyn dyn; \
+ \
+    if (len < sizeof eh) \
+        return; \
+    memcpy(&eh, data, sizeof eh); \
+    if (eh.e_shentsize != sizeof sh || eh.e_shoff > len || eh.e_shnum > (len - eh.e_shoff) / sizeof sh) \
+        return; \
+ \
+    for (size_t i = 0; i < eh.e_shnum; i++) { \
+        memcpy(&sh, data + eh.e_shoff + i * sizeof sh, sizeof sh); \
+        if (sh.sh_type != SHT_DYNAMIC || sh.sh_link >= eh.e_shnum) \
+            continue; \
+        memcpy(&strsh, data + eh.e_shoff + sh.sh_link * sizeof sh, sizeof sh); \
+        if (sh.sh_offset > len || sh.sh_size > len - sh.sh_offset \
+            || strsh.sh_offset > len || strsh.sh_size > len - strsh.sh_offset) \
+            return; \
+ \
+        const char *strtab = (const char *)data + strsh.sh_offset; \
+        for (size_t j = 0; j + sizeof dyn <= sh.sh_size; j += sizeof dyn) { \
+            memcpy(&dyn, data + sh.sh_offset + j, sizeof dyn); \
+            if (dyn.d_tag == DT_NULL) \
+                break; \
+            if ((dyn.d_tag == DT_SONAME || dyn.d_tag == DT_NEEDED) && dyn.d_un.d_val < strsh.sh_size \
+                && memchr(strtab + dyn.d_un.d_val, '\0', strsh.sh_size - dyn.d_un.d_val) != NULL) \
+                add_unique(dyn.d_tag == DT_SONAME ? sonames : needed, strtab + dyn.d_un.d_val); \
+        } \
+        return; \
+    } \
+}
+
+ELF_DYNAMIC(32)
+ELF_DYNAMIC(64)
+
+#undef ELF_DYNAMIC
+
+/*
+ * elf_dynamic: read the sonames of an ELF image; only images in the byte
+ * order of the host are understood, which is what a repository holds.
+ */
+static void elf_dynamic(const unsigned char *data, size_t len, NodeStr **sonames, NodeStr **needed)
+{
+    const uint16_t one = 1;
+    const unsigned char order = *(const unsigned char *)&one ? ELFDATA2LSB : ELFDATA2MSB;
+
+    if (len < EI_NIDENT || memcmp(data, ELFMAG, SELFMAG) != 0 || data[EI_DATA] != order)
+        return;
+    if (data[EI_CLASS] == ELFCLASS64)
+        elf64_dynamic(data, len, sonames, needed);
+    else if (data[EI_CLASS] == ELFCLASS32)
+        elf32_dynamic(data, len, sonames, needed);
+}
+
+struct sonames {
+    NodeStr **sonames;
+    NodeStr **needed;
+};
+
+static void add_image(const unsigned char *image, size_t len, void *data)
+{
+    struct sonames *s = data;
+    elf_dynamic(image, len, s->sonames, s->needed);
+}
+
+/*
+ * read_sonames: read the sonames provided and needed by the ELF files in the
+ * package archive at path, and its files entry, which comes with the same
+ * pass. Only the first bytes of other files are read.
+ */
+static int read_sonames(const char *path, NodeStr **sonames, NodeStr **needed, char **files)
+{
+    struct sonames s = { sonames, needed };
+
+    *files = package_scan(path, add_image, &s);
+    if (*files == NULL)
+        return -1;
+
+    /* libraries that the package brings along itself are no dependencies */
+    for (NodeStr **iter = needed; *iter != NULL;) {
+        if (list_search(*sonames, (*iter)->data) != NULL)
+            free(list_pop(iter));
+        else
+            iter = &(*iter)->next;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct links_job {
+    char *identity;         // <filename>\t<checksum>
+    char *filename;
+    char *key;              // package_identity, for the files entry
+    char *line;             // the line in the index, once known
+    char *files;            // the files entry, if the archive has been read
+    bool read;              // whether the package archive has to be read
+};
+
+struct links_pool {
+    struct links_job *jobs;
+    size_t count;
+    size_t cap;
+    size_t next;            // next job to hand out to a worker
+    HashMap *previous;      // identity -> line of the previous index
+    const char *pkg_dir;
+    const HashMap *paths;   // file name -> path relative to pkg_dir (optional)
+    int reads;
+    pthread_mutex_t lock;
+};
+
+static char *index_identity(const Package *pkg)
+{
+    const char *sum = pkg->sha256sum != NULL ? pkg->sha256sum : pkg->md5sum;
+    return cs_strvcat(pkg->filename, "\t", sum != NULL ? sum : "", NULL);
+}
+
+static char *join_list(NodeStr *head)
+{
+    return head == NULL ? cs_strclone("") : list_strjoin(head, ",");
+}
+
+/*
+ * read_index: read the lines of the index at path into map, by identity
+ * (the first two fields). A missing index is the same as an empty one.
+ */
+static int read_index(const char *path, HashMap *map)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *in = fopen(path, "r");
+
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while ((len = getline(&line, &size, in)) > 0) {
+        char *tab;
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        tab = strchr(line, '\t');
+        if (tab == NULL || (tab = strchr(tab + 1, '\t')) == NULL)
+            continue;
+
+        char *identity = cs_substr(line, 0, tab - line);
+        char *old = hashmap_put(map, identity, cs_strclone(line));
+        if (old != NULL) {
+            /* the map still uses the first key */
+            free(old);
+            free(identity);
+        }
+    }
+
+    free(line);
+    fclose(in);
+    return 0;
+}
+
+static int collect_links_job(Package *pkg, void *data)
+{
+    struct links_pool *pool = data;
+    struct links_job *job;
+
+    if (pkg->filename == NULL) {
+        package_free(pkg);
+        return 0;
+    }
+
+    if (pool->count == pool->cap) {
+        pool->cap = pool->cap > 0 ? 2 * pool->cap : 256;
+        pool->jobs = realloc(pool->jobs, pool->cap * sizeof (struct links_job));
+    }
+    job = &pool->jobs[pool->count++];
+    job->identity = index_identity(pkg);
+    job->key = package_identity(pkg);
+    job->files = NULL;
+    job->filename = pkg->filename;
+    pkg->filename = NULL;
+
+    job->line = hashmap_get(pool->previous, job->identity);
+    if (job->line != NULL) {
+        /* take it, so it is not freed with the map */
+        hashmap_put(pool->previous, job->identity, NULL);
+        job->read = false;
+    } else {
+        job->read = true;
+        pool->reads++;
+    }
+
+    package_free(pkg);
+    return 0;
+}
+
+static void *links_worker(void *data)
+{
+    struct links_pool *pool = data;
+
+    for (;;) {
+        struct links_job *job = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && job == NULL) {
+            if (pool->jobs[pool->next].read)
+                job = &pool->jobs[pool->next];
+            pool->next++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (job == NULL)
+            break;
+
+        const char *rel = pool->paths != NULL ? hashmap_get(pool->paths, job->filename) : NULL;
+        char *path = cs_strvcat(pool->pkg_dir, "/", rel != NULL ? rel : job->filename, NULL);
+        NodeStr *sonames = NULL, *needed = NULL;
+
+        if (read_sonames(path, &sonames, &needed, &job->files) == 0) {
+            char *provided = join_list(sonames);
+            char *required = join_list(needed);
+            job->line = cs_strvcat(job->identity, "\t", provided, "\t", required, NULL);
+            free(provided);
+            free(required);
+        } else {
+            fprintf(stderr, "Warning: cannot read package '%s'; its sonames are left out.\n", path);
+        }
+
+        list_free_all(&sonames);
+        list_free_all(&needed);
+        free(path);
+    }
+    return NULL;
+}
+
+static void free_string(void *str)
+{
+    free(str);
+}
+
+int depgraph_update(const char *db_path, const char *index_path, const char *pkg_dir,
+                    const HashMap *paths, int jobs, HashMap *files)
+{
+    debug_printf("depgraph_update(%s)\n", index_path);
+
+    struct links_pool pool;
+    pthread_t *threads;
+    char *tmp_path;
+    FILE *out;
+    int started = 0;
+    int retval;
+
+    memset(&pool, 0, sizeof pool);
+    pool.pkg_dir = pkg_dir;
+    pool.paths = paths;
+    pool.previous = hashmap_new(1024);
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* a missing or unreadable index just means more work */
+    read_index(index_path, pool.previous);
+    if (db_read(db_path, collect_links_job, &pool) < 0) {
+        retval = -1;
+        goto cleanup;
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+    threads = malloc(jobs * sizeof (pthread_t));
+    for (int i = 0; i < jobs && i < pool.reads; i++)
+        if (pthread_create(&threads[started], NULL, links_worker, &pool) == 0)
+            started++;
+    if (started == 0 && pool.reads > 0)
+        links_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /* hand the files entries on, so that the archives are not read again */
+    for (size_t i = 0; i < pool.count && files != NULL; i++) {
+        struct links_job *job = &pool.jobs[i];
+        if (job->files != NULL && !hashmap_contains(files, job->key)) {
+            hashmap_put(files, job->key, job->files);
+            job->key = NULL;
+            job->files = NULL;
+        }
+    }
+
+    /* write the index in database order */
+    tmp_path = cs_strcat(index_path, ".tmp");
+    out = fopen(tmp_path, "w");
+    retval = out != NULL ? pool.reads : -1;
+    if (out != NULL) {
+        for (size_t i = 0; i < pool.count; i++)
+            if (pool.jobs[i].line != NULL)
+                fprintf(out, "%s\n", pool.jobs[i].line);
+        if (fclose(out) != 0 || rename(tmp_path, index_path) != 0)
+            retval = -1;
+    }
+    if (retval < 0)
+        unlink(tmp_path);
+    free(tmp_path);
+
+cleanup:
+    for (size_t i = 0; i < pool.count; i++) {
+        free(pool.jobs[i].identity);
+        free(pool.jobs[i].filename);
+        free(pool.jobs[i].key);
+        free(pool.jobs[i].line);
+        free(pool.jobs[i].files);
+    }
+    free(pool.jobs);
+    hashmap_foreach(pool.previous, e)
+        free((char *)e->key);
+    hashmap_free(pool.previous, free_string);
+    pthread_mutex_destroy(&pool.lock);
+    return retval;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * A node of the graph is a package with what it offers (its name, provides
+ * and sonames; the capabilities) and what it uses (depends and needed
+ * sonames), without any version constraints.
+ */
+struct dep_node {
+    Package *pkg;
+    NodeStr *caps;
+    NodeStr *uses;
+    size_t index;           // scratch space for depgraph_rdeps
+};
+
+struct depgraph {
+    HashMap *packages;      // name -> dep_node
+    HashMap *providers;     // capability -> list of package names
+    HashMap *consumers;     // capability -> list of package names
+};
+
+/* strip_version: "foo>=1.2" or "libfoo.so=1-64" becomes "foo" or "libfoo.so". */
+static char *strip_version(const char *str)
+{
+    return cs_substr(str, 0, strcspn(str, "<>="));
+}
+
+static int graph_add_package(Package *pkg, void *data)
+{
+    struct depgraph *g = data;
+    struct dep_node *node;
+
+    if (pkg->name == NULL || hashmap_contains(g->packages, pkg->name)) {
+        package_free(pkg);
+        return 0;
+    }
+
+    node = calloc(1, sizeof (struct dep_node));
+    node->pkg = pkg;
+    add_unique(&node->caps, pkg->name);
+    for (NodeStr *iter = pkg->provides; iter != NULL; iter = iter->next) {
+        char *cap = strip_version(iter->data);
+        add_unique(&node->caps, cap);
+        free(cap);
+    }
+    for (NodeStr *iter = pkg->depends; iter != NULL; iter = iter->next) {
+        char *use = strip_version(iter->data);
+        add_unique(&node->uses, use);
+        free(use);
+    }
+    hashmap_put(g->packages, pkg->name, node);
+    return 0;
+}
+
+/* add_sonames: add a comma-separated list of sonames to head. */
+static void add_sonames(NodeStr **head, const char *list, size_t len)
+{
+    while (len > 0) {
+        size_t n = strcspn(list, ",\t");
+        if (n > len)
+            n = len;
+        if (n > 0) {
+            char *soname = cs_substr(list, 0, n);
+            add_unique(head, soname);
+            free(soname);
+        }
+        list += n;
+        len -= n;
+        if (len > 0) {
+            list++;
+            len--;
+        }
+    }
+}
+
+/*
+ * graph_add_index: add the sonames in the index to the packages that are in
+ * the database with the same file name.
+ */
+static void graph_add_index(struct depgraph *g, const char *index_path)
+{
+    HashMap *by_file = hashmap_new(g->packages->count);
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *in;
+
+    in = fopen(index_path, "r");
+    if (in == NULL) {
+        hashmap_free(by_file, NULL);
+        return;
+    }
+
+    hashmap_foreach(g->packages, e) {
+        struct dep_node *node = e->value;
+        if (node->pkg->filename != NULL)
+            hashmap_put(by_file, node->pkg->filename, node);
+    }
+
+    while ((len = getline(&line, &size, in)) > 0) {
+        char *field[4];
+        int n = 1;
+
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        field[0] = line;
+        for (char *p = line; *p != '\0' && n < 4; p++)
+            if (*p == '\t') {
+                *p = '\0';
+                field[n++] = p + 1;
+            }
+        if (n < 4)
+            continue;
+
+        struct dep_node *node = hashmap_get(by_file, field[0]);
+        if (node == NULL)
+            continue;
+        add_sonames(&node->caps, field[2], strlen(field[2]));
+        add_sonames(&node->uses, field[3], strlen(field[3]));
+    }
+
+    free(line);
+    fclose(in);
+    hashmap_free(by_file, NULL);
+}
+
+/*
+ * add_edge: add name to the list of cap in map; cap stays owned by its node,
+ * which lives as long as the map.
+ */
+static void add_edge(HashMap *map, const char *cap, char *name)
+{
+    NodeStr *head = hashmap_get(map, cap);
+    list_push(&head, name);
+    hashmap_put(map, cap, head);
+}
+
+struct depgraph *depgraph_load(const char *db_path, const char *index_path)
+{
+    debug_printf("depgraph_load(%s)\n", db_path);
+
+    struct depgraph *g = calloc(1, sizeof (struct depgraph));
+
+    g->packages = hashmap_new(1024);
+    g->providers = hashmap_new(4096);
+    g->consumers = hashmap_new(4096);
+    if (db_read(db_path, graph_add_package, g) < 0) {
+        depgraph_free(g);
+        return NULL;
+    }
+    if (index_path != NULL)
+        graph_add_index(g, index_path);
+
+    hashmap_foreach(g->packages, e) {
+        struct dep_node *node = e->value;
+        for (NodeStr *iter = node->caps; iter != NULL; iter = iter->next)
+            add_edge(g->providers, iter->data, node->pkg->name);
+        for (NodeStr *iter = node->uses; iter != NULL; iter = iter->next)
+            add_edge(g->consumers, iter->data, node->pkg->name);
+    }
+    return g;
+}
+
+static void free_name_list(void *head)
+{
+    NodeStr *list = head;
+    list_free_nodes(&list);
+}
+
+static void free_node(void *data)
+{
+    struct dep_node *node = data;
+    package_free(node->pkg);
+    list_free_all(&node->caps);
+    list_free_all(&node->uses);
+    free(node);
+}
+
+void depgraph_free(struct depgraph *g)
+{
+    if (g == NULL)
+        return;
+
+    /* the keys of the edge maps belong to the nodes, so free those last */
+    hashmap_free(g->providers, free_name_list);
+    hashmap_free(g->consumers, free_name_list);
+    hashmap_free(g->packages, free_node);
+    free(g);
+}
+
+bool depgraph_contains(const struct depgraph *g, const char *name)
+{
+    return hashmap_contains(g->packages, name);
+}
+
+/*
+ * provided_elsewhere: whether cap is also provided by a package other than
+ * name that is not being removed.
+ */
+static bool provided_elsewhere(const struct depgraph *g, const char *cap, const char *name,
+                               const HashMap *removing)
+{
+    for (NodeStr *iter = hashmap_get(g->providers, cap); iter != NULL; iter = iter->next)
+        if (strcmp(iter->data, name) != 0 && (removing == NULL || !hashmap_contains(removing, iter->data)))
+            return true;
+    return false;
+}
+
+int depgraph_needed_by(const struct depgraph *g, const char *name, const HashMap *removing,
+                       NodeStr **head)
+{
+    struct dep_node *node = hashmap_get(g->packages, name);
+    HashMap *seen;
+    int count = 0;
+
+    *head = NULL;
+    if (node == NULL)
+        return 0;
+
+    seen = hashmap_new(16);
+    for (NodeStr *cap = node->caps; cap != NULL; cap = cap->next) {
+        if (provided_elsewhere(g, cap->data, name, removing))
+            continue;
+        for (NodeStr *iter = hashmap_get(g->consumers, cap->data); iter != NULL; iter = iter->next) {
+            if (strcmp(iter->data, name) == 0 || hashmap_contains(seen, iter->data)
+                || (removing != NULL && hashmap_contains(removing, iter->data)))
+                continue;
+            hashmap_put(seen, iter->data, NULL);
+            list_push(head, iter->data);
+            count++;
+        }
+    }
+
+    hashmap_free(seen, NULL);
+    return count;
+}
+
+int depgraph_rdeps(const struct depgraph *g, char **names, int count, NodeStr **head)
+{
+    debug_puts("depgraph_rdeps()");
+
+    struct dep_node **closure;
+    size_t len = 0, cap = 16;
+    size_t *indegree, *order;
+    size_t **edges, *nedges;
+    size_t done = 0;
+    HashMap *visited = hashmap_new(64);
+
+    *head = NULL;
+    closure = malloc(cap * sizeof (struct dep_node *));
+
+    /* breadth first from the given packages through all their consumers */
+    for (int i = 0; i < count; i++) {
+        struct dep_node *node = hashmap_get(g->packages, names[i]);
+        if (node != NULL && !hashmap_contains(visited, node->pkg->name)) {
+            hashmap_put(visited, node->pkg->name, node);
+            node->index = len;
+            if (len == cap)
+                closure = realloc(closure, (cap *= 2) * sizeof (struct dep_node *));
+            closure[len++] = node;
+        }
+    }
+
+    edges = NULL;
+    nedges = NULL;
+    for (size_t i = 0; i < len; i++) {
+        struct dep_node *node = closure[i];
+        edges = realloc(edges, len * sizeof (size_t *));
+        nedges = realloc(nedges, len * sizeof (size_t));
+        edges[i] = NULL;
+        nedges[i] = 0;
+
+        for (NodeStr *c = node->caps; c != NULL; c = c->next) {
+            for (NodeStr *iter = hashmap_get(g->consumers, c->data); iter != NULL; iter = iter->next) {
+                struct dep_node *user = hashmap_get(g->packages, iter->data);
+                if (user == node)
+                    continue;
+                if (!hashmap_contains(visited, user->pkg->name)) {
+                    hashmap_put(visited, user->pkg->name, user);
+                    user->index = len;
+                    if (len == cap)
+                        closure = realloc(closure, (cap *= 2) * sizeof (struct dep_node *));
+                    closure[len++] = user;
+                }
+                edges[i] = realloc(edges[i], (nedges[i] + 1) * sizeof (size_t));
+                edges[i][nedges[i]++] = user->index;
+            }
+        }
+    }
+
+    /* order the closure topologically (Kahn), keeping the order of discovery */
+    indegree = calloc(len + 1, sizeof (size_t));
+    order = malloc((len + 1) * sizeof (size_t));
+    for (size_t i = 0; i < len; i++)
+        for (size_t j = 0; j < nedges[i]; j++)
+            indegree[edges[i][j]]++;
+    for (size_t i = 0; i < len; i++)
+        if (indegree[i] == 0)
+            order[done++] = i;
+    for (size_t k = 0; k < done; k++) {
+        size_t i = order[k];
+        for (size_t j = 0; j < nedges[i]; j++)
+            if (--indegree[edges[i][j]] == 0)
+                order[done++] = edges[i][j];
+    }
+
+    /* whatever is left is part of a cycle */
+    size_t sorted = done;
+    for (size_t i = 0; i < len; i++)
+        if (indegree[i] > 0)
+            order[done++] = i;
+
+    for (size_t k = len; k-- > 0;)
+        list_push(head, closure[order[k]]->pkg->name);
+
+    for (size_t i = 0; i < len; i++)
+        free(edges[i]);
+    free(edges);
+    free(nedges);
+    free(indegree);
+    free(order);
+    free(closure);
+    hashmap_free(visited, NULL);
+    return sorted == len ? (int)len : -1;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
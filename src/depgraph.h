@@ -0,0 +1,92 @@
+/*
+ * depgraph.h
+ * Reverse dependencies between the packages of a database, by their
+ * depends, provides and the sonames of their shared libraries.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DEPGRAPH_H
+#define DEPGRAPH_H
+
+#include "hashmap.h"
+
+#include "libcassava/list_str.h"
+
+/*
+ * The soname index (<stem>.links next to the database) has one line per
+ * package, with tab-separated fields:
+ *
+ *   <filename> <checksum> <sonames provided> <sonames needed>
+ *
+ * where the sonames are separated by commas. The sonames are read from the
+ * dynamic section of the ELF files in the package, which is expensive, so
+ * packages whose file name and checksum are unchanged are not read again.
+ */
+
+/*
+ * depgraph_update: bring the soname index at index_path up to date with the
+ * database at db_path, reading new packages from pkg_dir (see db_write_files
+ * for paths) with jobs threads. If files is not NULL, the files entries of
+ * the packages that were read are put there by package_identity, to be
+ * given to db_write_files; the keys and values are then the caller's.
+ * Returns: the number of package archives that had to be read, or -1 on error.
+ */
+extern int depgraph_update(const char *db_path, const char *index_path, const char *pkg_dir,
+                           const HashMap *paths, int jobs, HashMap *files);
+
+struct depgraph;
+
+/*
+ * depgraph_load: read the database at db_path and the soname index at
+ * index_path; without an index, only depends and provides are known.
+ * Returns NULL (and sets errno) if the database could not be read.
+ */
+extern struct depgraph *depgraph_load(const char *db_path, const char *index_path);
+
+/*
+ * depgraph_free: free the graph and everything it contains.
+ */
+extern void depgraph_free(struct depgraph *g);
+
+/*
+ * depgraph_contains: whether the package name is in the graph.
+ */
+extern bool depgraph_contains(const struct depgraph *g, const char *name);
+
+/*
+ * depgraph_needed_by: find the packages that need something that only the
+ * package name provides, leaving out the packages in removing (a map of
+ * names, may be NULL) which are going away together with it.
+ * The names in head belong to g; use list_free_nodes.
+ * Returns: the number of such packages.
+ */
+extern int depgraph_needed_by(const struct depgraph *g, const char *name, const HashMap *removing,
+                              NodeStr **head);
+
+/*
+ * depgraph_rdeps: find all packages that (indirectly) depend on the count
+ * packages in names, which need to be rebuilt when these change, in an
+ * order in which they can be rebuilt: each package after the ones it
+ * depends on, and otherwise in the order in which they were found.
+ * The names in head belong to g; use list_free_nodes.
+ * Returns: the number of packages, or -1 if a dependency cycle prevented a
+ * complete order (the packages in the cycle are then added at the end).
+ */
+extern int depgraph_rdeps(const struct depgraph *g, char **names, int count, NodeStr **head);
+
+#endif // DEPGRAPH_H
+
+/* vim: set cin ts=4 sw=4 et: */
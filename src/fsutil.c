@@ -0,0 +1,379 @@
+/*
+ * fsutil.c
+ * Helpers for copying and linking files without moving more data than needed.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "fsutil.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+/*
+ * clone_fd: make the file open as out share the data of in.
+ */
+static int clone_fd(int in, int out)
+{
+#ifdef FICLONE
+    return ioctl(out, FICLONE, in);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+    debug_printf("fs_clone(%s, %s)\n", src, dst);
+
+    struct stat st;
+    int in, out, ret, saved;
+
+    in = open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    if (fstat(in, &st) != 0 || (out = open(dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777)) < 0) {
+        saved = errno;
+        close(in);
+        errno = saved;
+        return -1;
+    }
+
+    ret = clone_fd(in, out);
+    saved = errno;
+    close(in);
+    if (close(out) != 0 && ret == 0) {
+        ret = -1;
+        saved = errno;
+    }
+    if (ret != 0)
+        unlink(dst);
+    errno = saved;
+    return ret;
+}
+
+/*
+ * copy_fd: copy the whole of in to out, without a detour through user space
+ * where the kernel allows it.
+ */
+static int copy_fd(int in, int out, off_t size)
+{
+    char buf[64*1024];
+    ssize_t n;
+
+    if (clone_fd(in, out) == 0)
+        return 0;
+
+    while (size > 0) {
+        n = copy_file_range(in, NULL, out, NULL, size, 0);
+        if (n <= 0)
+            break;
+        size -= n;
+    }
+    if (size == 0)
+        return 0;
+
+    /* copy_file_range is not supported here (e.g. across filesystems
+     * on older kernels): fall back to read and write */
+    while ((n = read(in, buf, sizeof buf)) > 0) {
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t m = write(out, buf + done, n - done);
+            if (m < 0)
+                return -1;
+            done += m;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+    debug_printf("fs_copy(%s, %s)\n", src, dst);
+
+    struct stat st;
+    char *tmp;
+    int in, out, ret, saved;
+
+    in = open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    if (fstat(in, &st) != 0) {
+        saved = errno;
+        close(in);
+        errno = saved;
+        return -1;
+    }
+
+    tmp = cs_strcat(dst, ".part");
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out < 0) {
+        saved = errno;
+        close(in);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+
+    ret = copy_fd(in, out, st.st_size);
+    saved = errno;
+    close(in);
+    if (close(out) != 0 && ret == 0) {
+        ret = -1;
+        saved = errno;
+    }
+    if (ret == 0 && rename(tmp, dst) != 0) {
+        ret = -1;
+        saved = errno;
+    }
+    if (ret != 0)
+        unlink(tmp);
+
+    free(tmp);
+    errno = saved;
+    return ret;
+}
+
+/*
+ * sync_path: fsync the file or directory at path.
+ */
+static int sync_path(const char *path, int flags)
+{
+    int fd = open(path, O_RDONLY | flags);
+    int ret, saved;
+
+    if (fd < 0)
+        return -1;
+    ret = fsync(fd);
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return ret;
+}
+
+/*
+ * rename_new: rename src to dst, failing with EEXIST if dst exists. Where
+ * the filesystem does not support that in one step, dst is hard linked
+ * (which never replaces anything) and src removed.
+ */
+static int rename_new(const char *src, const char *dst)
+{
+    if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+    if (link(src, dst) != 0)
+        return -1;
+    return unlink(src);
+}
+
+int fs_move(const char *src, const char *dst)
+{
+    struct stat st;
+    struct timespec times[2];
+    char *tmp, *dir;
+    int ret, saved;
+
+    if (rename_new(src, dst) == 0)
+        return 0;
+    if (errno != EXDEV || stat(src, &st) != 0)
+        return -1;
+
+    /* src may only go once its copy is safely on disk under dst */
+    tmp = cs_strcat(dst, ".move");
+    if (fs_copy(src, tmp) != 0) {
+        free(tmp);
+        return -1;
+    }
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    utimensat(AT_FDCWD, tmp, times, 0);
+    ret = sync_path(tmp, 0);
+    if (ret == 0)
+        ret = rename_new(tmp, dst);
+    if (ret != 0) {
+        saved = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    free(tmp);
+
+    dir = cs_strclone(dst);
+    ret = sync_path(dirname(dir), O_DIRECTORY);
+    free(dir);
+    if (ret != 0)
+        return -1;
+    return unlink(src);
+}
+
+int fs_publish(const char *tmp, const char *path, const char *old)
+{
+    return fs_publish_signed(tmp, path, old, NULL, NULL);
+}
+
+int fs_publish_signed(const char *tmp, const char *path, const char *old, const char *tmp_sig, const char *sig)
+{
+    debug_printf("fs_publish_signed(%s, %s)\n", tmp, path);
+
+    char *dir;
+    int ret = 0;
+
+    /* everything that can take a while comes before the first rename */
+    if (sync_path(tmp, 0) != 0 || (tmp_sig != NULL && sync_path(tmp_sig, 0) != 0))
+        return -1;
+
+    /* keep the previous generation; linking costs the same for any size */
+    if (old != NULL) {
+        char *old_tmp = cs_strcat(old, ".tmp");
+        unlink(old_tmp);
+        if (link(path, old_tmp) == 0) {
+            if (rename(old_tmp, old) != 0)
+                unlink(old_tmp);
+        } else if (errno == ENOENT) {
+            /* there was no previous generation, so don't leave a stale one */
+            unlink(old);
+        } else {
+            ret = -1;
+        }
+        free(old_tmp);
+        if (ret != 0)
+            return -1;
+    }
+
+    if (rename(tmp, path) != 0)
+        return -1;
+    if (tmp_sig != NULL && rename(tmp_sig, sig) != 0)
+        return -1;
+
+    /* make the renames themselves durable */
+    dir = cs_strclone(path);
+    ret = sync_path(dirname(dir), O_DIRECTORY);
+    free(dir);
+    return ret;
+}
+
+int fs_symlink(const char *target, const char *path)
+{
+    char buf[PATH_MAX];
+    ssize_t len = readlink(path, buf, sizeof buf - 1);
+    char *tmp;
+    int ret;
+
+    /* nothing to do, which is the usual case */
+    if (len >= 0) {
+        buf[len] = '\0';
+        if (strcmp(buf, target) == 0)
+            return 0;
+    }
+
+    tmp = cs_strcat(path, ".tmp");
+    unlink(tmp);
+    ret = symlink(target, tmp);
+    if (ret == 0 && (ret = rename(tmp, path)) != 0)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/*
+ * make_parents: create the missing directories leading up to path.
+ */
+static int make_parents(const char *path)
+{
+    char *dir = cs_strclone(path);
+    int ret = 0;
+
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL && ret == 0; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+            ret = -1;
+        *slash = '/';
+    }
+    free(dir);
+    return ret;
+}
+
+int fs_link(const char *src, const char *dst)
+{
+    debug_printf("fs_link(%s, %s)\n", src, dst);
+
+    struct stat st_src, st_dst;
+    char *tmp;
+    int ret, saved;
+
+    if (link(src, dst) == 0)
+        return 0;
+    if (errno == ENOENT && access(src, F_OK) == 0) {
+        if (make_parents(dst) != 0)
+            return -1;
+        if (link(src, dst) == 0)
+            return 0;
+    }
+    if (errno != EEXIST)
+        return -1;
+
+    /* rename would do nothing and leave tmp behind */
+    if (lstat(src, &st_src) == 0 && lstat(dst, &st_dst) == 0
+        && st_src.st_dev == st_dst.st_dev && st_src.st_ino == st_dst.st_ino)
+        return 0;
+
+    tmp = cs_strcat(dst, ".tmp");
+    unlink(tmp);
+    ret = link(src, tmp);
+    if (ret == 0 && (ret = rename(tmp, dst)) != 0) {
+        saved = errno;
+        unlink(tmp);
+        errno = saved;
+    }
+    free(tmp);
+    return ret;
+}
+
+/*
+ * remove_entry: nftw callback for fs_remove_tree.
+ */
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+int fs_remove_tree(const char *path)
+{
+    debug_printf("fs_remove_tree(%s)\n", path);
+
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,88 @@
+/*
+ * fsutil.h
+ * Helpers for copying and linking files without moving more data than needed.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FSUTIL_H
+#define FSUTIL_H
+
+/*
+ * fs_clone: create dst as a reflink (copy-on-write clone) of src, which is
+ * only possible within one filesystem that supports it, e.g. btrfs or xfs.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int fs_clone(const char *src, const char *dst);
+
+/*
+ * fs_copy: create dst as a copy of src, using a reflink if possible, and
+ * copy_file_range otherwise, so the data need not pass through user space.
+ * dst is written under a temporary name and renamed when complete.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int fs_copy(const char *src, const char *dst);
+
+/*
+ * fs_move: move src to dst with rename if both are on the same filesystem,
+ * or else copy it with fs_copy (keeping its modification time) and remove
+ * src once the copy and its directory are synced to disk. An existing dst
+ * is never replaced. Returns 0, or -1 (and sets errno, EEXIST if dst
+ * exists).
+ */
+extern int fs_move(const char *src, const char *dst);
+
+/*
+ * fs_publish: replace path with the complete file tmp, which must be on the
+ * same filesystem, so that readers see either the old or the new file and
+ * never a partial one: tmp is synced to disk, renamed over path, and the
+ * directory is synced. If old is not NULL, the previous file stays
+ * available as old, by way of a hard link. Returns 0, or -1 (and sets errno).
+ */
+extern int fs_publish(const char *tmp, const char *path, const char *old);
+
+/*
+ * fs_publish_signed: like fs_publish, but publish the signature tmp_sig as
+ * sig along with path. Both files are synced before either is renamed, and
+ * the two renames follow each other directly, so the time in which a client
+ * can fetch the new file with the old signature is as short as two renames;
+ * it cannot be closed entirely, as pacman fetches them as separate files.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int fs_publish_signed(const char *tmp, const char *path, const char *old, const char *tmp_sig, const char *sig);
+
+/*
+ * fs_symlink: make path a symlink to target, replacing whatever path was
+ * with a single rename. Returns 0, or -1 (and sets errno).
+ */
+extern int fs_symlink(const char *target, const char *path);
+
+/*
+ * fs_link: make dst a hard link to src, creating the missing directories
+ * leading up to dst, and replacing whatever dst was with a single rename.
+ * This costs no data I/O, but src and dst must be on the same filesystem.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int fs_link(const char *src, const char *dst);
+
+/*
+ * fs_remove_tree: remove path and, if it is a directory, everything below
+ * it, without following symlinks. Returns 0, or -1 (and sets errno).
+ */
+extern int fs_remove_tree(const char *path);
+
+#endif // FSUTIL_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,110 @@
+/*
+ * hashmap.c
+ * A simple hash map with string keys, using open addressing.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hashmap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t hashmap_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+HashMap *hashmap_new(size_t hint)
+{
+    HashMap *map = malloc(sizeof (HashMap));
+    size_t size = 16;
+
+    /* keep the load factor below 1/2 */
+    while (size < 2 * hint)
+        size <<= 1;
+
+    map->size = size;
+    map->count = 0;
+    map->slots = calloc(size, sizeof (struct hash_entry));
+    return map;
+}
+
+void hashmap_free(HashMap *map, void (*free_value)(void *))
+{
+    if (map == NULL)
+        return;
+    if (free_value != NULL)
+        hashmap_foreach(map, e)
+            free_value(e->value);
+    free(map->slots);
+    free(map);
+}
+
+static struct hash_entry *lookup(struct hash_entry *slots, size_t size, const char *key)
+{
+    size_t i = hashmap_hash(key) & (size - 1);
+    while (slots[i].key != NULL && strcmp(slots[i].key, key) != 0)
+        i = (i + 1) & (size - 1);
+    return &slots[i];
+}
+
+static void grow(HashMap *map)
+{
+    size_t size = map->size << 1;
+    struct hash_entry *slots = calloc(size, sizeof (struct hash_entry));
+
+    for (size_t i = 0; i < map->size; i++)
+        if (map->slots[i].key != NULL)
+            *lookup(slots, size, map->slots[i].key) = map->slots[i];
+
+    free(map->slots);
+    map->slots = slots;
+    map->size = size;
+}
+
+void *hashmap_get(const HashMap *map, const char *key)
+{
+    return lookup(map->slots, map->size, key)->value;
+}
+
+bool hashmap_contains(const HashMap *map, const char *key)
+{
+    return lookup(map->slots, map->size, key)->key != NULL;
+}
+
+void *hashmap_put(HashMap *map, const char *key, void *value)
+{
+    if (2 * (map->count + 1) > map->size)
+        grow(map);
+
+    struct hash_entry *e = lookup(map->slots, map->size, key);
+    void *old = e->value;
+    if (e->key == NULL) {
+        e->key = key;
+        map->count++;
+    }
+    e->value = value;
+    return old;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
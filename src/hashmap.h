@@ -0,0 +1,77 @@
+/*
+ * hashmap.h
+ * A simple hash map with string keys, using open addressing.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct hash_entry {
+    const char *key;        // NULL if the slot is free
+    void *value;
+};
+
+typedef struct hashmap {
+    struct hash_entry *slots;
+    size_t size;            // number of slots, always a power of two
+    size_t count;           // number of used slots
+} HashMap;
+
+/*
+ * hashmap_new: create an empty map that can hold about hint entries
+ * before it needs to grow.
+ */
+extern HashMap *hashmap_new(size_t hint);
+
+/*
+ * hashmap_free: free the map; if free_value is not NULL, it is called on
+ * every value. The keys are not freed, as they belong to the caller.
+ */
+extern void hashmap_free(HashMap *map, void (*free_value)(void *));
+
+/*
+ * hashmap_get: return the value stored for key, or NULL.
+ */
+extern void *hashmap_get(const HashMap *map, const char *key);
+
+/*
+ * hashmap_contains: return whether there is an entry for key.
+ */
+extern bool hashmap_contains(const HashMap *map, const char *key);
+
+/*
+ * hashmap_put: store value under key, replacing and returning the previous
+ * value (or NULL). The key is not copied, so it must outlive the map.
+ */
+extern void *hashmap_put(HashMap *map, const char *key, void *value);
+
+/*
+ * hashmap_hash: the string hash function used by the map (FNV-1a).
+ */
+extern size_t hashmap_hash(const char *key);
+
+/* hashmap_foreach: iterate over all the used entries e of map. */
+#define hashmap_foreach(map, e) \
+    for (struct hash_entry *e = (map)->slots; e < (map)->slots + (map)->size; e++) \
+        if (e->key != NULL)
+
+#endif // HASHMAP_H
+
+/* vim: set cin ts=4 sw=4 et: */
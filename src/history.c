@@ -0,0 +1,241 @@
+/*
+ * history.c
+ * Archive directory for older versions of packages.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "history.h"
+#include "database.h"
+#include "vercmp.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+#include "libcassava/string.h"
+
+static char *index_path(const char *dir, const char *pkg_name)
+{
+    return cs_strvcat(dir, "/" HISTORY_DIR "/", pkg_name, ".versions", NULL);
+}
+
+/*
+ * read_index: read the file names in the index at path into head, in the
+ * order of the file. A missing index is the same as an empty one.
+ */
+static int read_index(const char *path, NodeStr **head)
+{
+    char line[PATH_MAX + 1];
+    NodeStr *reverse = NULL;
+    int count = 0;
+    FILE *in;
+
+    *head = NULL;
+    in = fopen(path, "r");
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while (fgets(line, sizeof line, in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (*line == '\0')
+            continue;
+        list_push(&reverse, cs_strclone(line));
+        count++;
+    }
+    fclose(in);
+
+    while (reverse != NULL)
+        list_push(head, list_pop(&reverse));
+    return count;
+}
+
+/*
+ * write_index: replace the index at path by the len file names in files;
+ * an empty index is removed.
+ */
+static int write_index(const char *path, char **files, size_t len)
+{
+    if (len == 0)
+        return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+
+    char *tmp = cs_strcat(path, ".tmp");
+    FILE *out = fopen(tmp, "w");
+    int ret = -1;
+
+    if (out != NULL) {
+        for (size_t i = 0; i < len; i++)
+            fprintf(out, "%s\n", files[i]);
+        ret = fclose(out);
+        if (ret == 0)
+            ret = rename(tmp, path);
+        if (ret != 0)
+            unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+/* compare_versions: order package file names from newest to oldest. */
+static int compare_versions(const void *a, const void *b)
+{
+    char *va = NULL, *vb = NULL;
+    int ret;
+
+    package_parse_filename(*(char * const *)a, NULL, &va, NULL);
+    package_parse_filename(*(char * const *)b, NULL, &vb, NULL);
+    if (va == NULL || vb == NULL)
+        ret = strcmp(*(char * const *)a, *(char * const *)b);
+    else
+        ret = vercmp(vb, va);
+
+    free(va);
+    free(vb);
+    return ret;
+}
+
+/*
+ * move_file: rename from/filename to to/name, where name is the last
+ * component of filename, together with its signature if there is one.
+ */
+static int move_file(const char *from, const char *to, const char *filename)
+{
+    const char *name = strrchr(filename, '/');
+    char *src = cs_strvcat(from, "/", filename, NULL);
+    char *dst = cs_strvcat(to, "/", name != NULL ? name + 1 : filename, NULL);
+    int ret = rename(src, dst);
+
+    if (ret == 0) {
+        char *src_sig = cs_strcat(src, ".sig");
+        char *dst_sig = cs_strcat(dst, ".sig");
+        if (rename(src_sig, dst_sig) != 0 && errno != ENOENT)
+            ret = -1;
+        free(src_sig);
+        free(dst_sig);
+    }
+
+    free(src);
+    free(dst);
+    return ret;
+}
+
+int history_archive(const char *dir, const char *filename, int keep, NodeStr **removed)
+{
+    debug_printf("history_archive(%s)\n", filename);
+
+    const char *base = strrchr(filename, '/');
+    char *archive, *index, *name;
+    NodeStr *head = NULL;
+    char **files = NULL;
+    size_t len;
+    int ret = -1;
+
+    if (!package_parse_filename(filename, &name, NULL, NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    base = base != NULL ? base + 1 : filename;
+    archive = cs_strvcat(dir, "/" HISTORY_DIR, NULL);
+    index = index_path(dir, name);
+
+    if (mkdir(archive, 0755) != 0 && errno != EEXIST)
+        goto end;
+    if (read_index(index, &head) < 0 || move_file(dir, archive, filename) != 0)
+        goto end;
+
+    if (list_search(head, base) == NULL)
+        list_push(&head, cs_strclone(base));
+    len = list_to_array(head, (void ***)&files);
+    qsort(files, len, sizeof (char *), compare_versions);
+
+    /* only the keep newest versions stay in the archive */
+    for (size_t i = keep; i < len; i++) {
+        char *path = cs_strvcat(archive, "/", files[i], NULL);
+        char *sig = cs_strcat(path, ".sig");
+        unlink(sig);
+        if (unlink(path) == 0 && removed != NULL)
+            list_push(removed, cs_strvcat(HISTORY_DIR "/", files[i], NULL));
+        free(path);
+        free(sig);
+    }
+    ret = write_index(index, files, (size_t)keep < len ? (size_t)keep : len);
+
+end:
+    free(files);
+    list_free_all(&head);
+    free(index);
+    free(archive);
+    free(name);
+    return ret;
+}
+
+int history_versions(const char *dir, const char *pkg_name, NodeStr **head)
+{
+    char *index = index_path(dir, pkg_name);
+    int count = read_index(index, head);
+    free(index);
+    return count;
+}
+
+int history_restore(const char *dir, const char *filename)
+{
+    debug_printf("history_restore(%s)\n", filename);
+
+    char *archive, *index, *name;
+    NodeStr *head = NULL, *keep = NULL;
+    char **files;
+    size_t len;
+    int ret = -1;
+
+    if (!package_parse_filename(filename, &name, NULL, NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    archive = cs_strvcat(dir, "/" HISTORY_DIR, NULL);
+    index = index_path(dir, name);
+
+    if (read_index(index, &head) >= 0 && move_file(archive, dir, filename) == 0) {
+        while (head != NULL) {
+            char *file = list_pop(&head);
+            if (strcmp(file, filename) == 0)
+                free(file);
+            else
+                list_push(&keep, file);
+        }
+        /* keep is in reverse order now, so sort it again */
+        len = list_to_array(keep, (void ***)&files);
+        qsort(files, len, sizeof (char *), compare_versions);
+        ret = write_index(index, files, len);
+        free(files);
+    }
+
+    list_free_all(&keep);
+    list_free_all(&head);
+    free(index);
+    free(archive);
+    free(name);
+    return ret;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,63 @@
+/*
+ * history.h
+ * Archive directory for older versions of packages, with a version index
+ * per package, so that older versions can be restored without a rescan.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "libcassava/list_str.h"
+
+/*
+ * The archive directory inside db_dir has the following layout:
+ *
+ *   <filename>              an older package file (and its .sig, if any)
+ *   <pkgname>.versions      the archived files of pkgname, one per line,
+ *                           newest version first
+ *
+ * Files are only ever moved with rename(), so db_dir and the archive
+ * directory must be on the same filesystem (which they are by default).
+ */
+#define HISTORY_DIR     "archive"
+
+/*
+ * history_archive: move dir/filename (and its signature) into the archive
+ * and add it to the version index of its package; filename may be in a
+ * subdirectory of dir, but it is restored into dir itself. Archived versions beyond
+ * the keep newest are deleted; their paths are pushed onto removed.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int history_archive(const char *dir, const char *filename, int keep, NodeStr **removed);
+
+/*
+ * history_versions: read the version index of pkg_name into head, ordered
+ * from the newest to the oldest version.
+ * Returns: the number of archived versions, or -1 on error.
+ */
+extern int history_versions(const char *dir, const char *pkg_name, NodeStr **head);
+
+/*
+ * history_restore: move the archived filename (and its signature) back into
+ * dir, and remove it from the version index.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int history_restore(const char *dir, const char *filename);
+
+#endif // HISTORY_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,299 @@
+/*
+ * hooks.c
+ * Programs run once after every transaction, in parallel stages.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "hooks.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+#define HOOK_GRACE      5       // seconds between SIGTERM and SIGKILL
+#define HOOK_POLL       100     // milliseconds between checks on the hooks
+
+extern char **environ;
+
+struct hook {
+    char *path;
+    pid_t pid;              // 0 once it has been reaped
+    int fd;                 // write end of its stdin, -1 once closed
+    size_t written;
+    time_t deadline;        // when the next signal is due, 0 for never
+    int signal;             // the last signal sent because of the timeout
+};
+
+/*
+ * monotonic: the seconds on a clock that is not changed by adjusting the time.
+ */
+static time_t monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * stage_len: the length of the number that name starts with.
+ */
+static size_t stage_len(const char *name)
+{
+    size_t len = 0;
+
+    while (isdigit((unsigned char)name[len]))
+        len++;
+    return len;
+}
+
+/*
+ * same_stage: whether the hooks a and b belong to the same stage.
+ */
+static bool same_stage(const char *a, const char *b)
+{
+    size_t len = stage_len(a);
+    return len > 0 && len == stage_len(b) && strncmp(a, b, len) == 0;
+}
+
+/*
+ * visible: scandir filter for the entries that can be hooks.
+ */
+static int visible(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/*
+ * start_hook: spawn the hook in its own process group, so that a timeout
+ * stops whatever it started, with a pipe on its stdin.
+ */
+static int start_hook(struct hook *h)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    char *argv[] = { h->path, NULL };
+    int fds[2], err;
+
+    /* the other hooks must not inherit the pipe, or it would never close */
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+
+    /* repo ignores SIGPIPE while writing, which must not be inherited */
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+
+    err = posix_spawn(&h->pid, h->path, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[0]);
+    if (err != 0) {
+        close(fds[1]);
+        h->pid = 0;
+        errno = err;
+        return -1;
+    }
+
+    h->fd = fds[1];
+    fcntl(h->fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * feed_hook: write as much of input to the hook as its pipe takes now;
+ * the pipe is closed when everything is written, or the hook is gone.
+ */
+static void feed_hook(struct hook *h, const char *input, size_t len)
+{
+    while (h->written < len) {
+        ssize_t n = write(h->fd, input + h->written, len - h->written);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            break;
+        }
+        h->written += n;
+    }
+    close(h->fd);
+    h->fd = -1;
+}
+
+/*
+ * reap_hook: check whether the hook has finished, and report it if it failed.
+ * Returns 1 if it has finished and failed, 0 otherwise.
+ */
+static int reap_hook(struct hook *h)
+{
+    int status;
+
+    if (waitpid(h->pid, &status, WNOHANG) != h->pid)
+        return 0;
+    h->pid = 0;
+    if (h->fd >= 0) {
+        close(h->fd);
+        h->fd = -1;
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 0;
+    if (h->signal != 0)
+        fprintf(stderr, "Error: hook '%s' timed out.\n", h->path);
+    else if (WIFSIGNALED(status))
+        fprintf(stderr, "Error: hook '%s' was killed by signal %d.\n", h->path, WTERMSIG(status));
+    else
+        fprintf(stderr, "Error: hook '%s' failed with status %d.\n", h->path, WEXITSTATUS(status));
+    return 1;
+}
+
+/*
+ * run_stage: run the count hooks at the same time, and wait for all of them.
+ * Returns the number of hooks that failed.
+ */
+static int run_stage(struct hook *hooks, int count, const char *input, size_t len, int timeout, bool verbose)
+{
+    struct pollfd *fds = malloc(count * sizeof (struct pollfd));
+    int running = 0, failed = 0;
+
+    /* what repo printed so far comes before the output of the hooks */
+    if (verbose)
+        for (int i = 0; i < count; i++)
+            printf("Running hook: %s\n", hooks[i].path);
+    fflush(stdout);
+    for (int i = 0; i < count; i++) {
+        if (start_hook(&hooks[i]) != 0) {
+            char *errmsg = cs_strvcat("Error: run hook '", hooks[i].path, "'", NULL);
+            perror(errmsg);
+            free(errmsg);
+            failed++;
+            continue;
+        }
+        hooks[i].deadline = timeout > 0 ? monotonic() + timeout : 0;
+        running++;
+    }
+
+    while (running > 0) {
+        int nfds = 0;
+        time_t now;
+
+        for (int i = 0; i < count; i++) {
+            if (hooks[i].fd < 0)
+                continue;
+            fds[nfds].fd = hooks[i].fd;
+            fds[nfds].events = POLLOUT;
+            nfds++;
+        }
+        /* wake up regularly to reap the hooks and check the time */
+        if (poll(fds, nfds, HOOK_POLL) > 0) {
+            for (int i = 0, j = 0; i < count; i++) {
+                if (hooks[i].fd < 0)
+                    continue;
+                if (fds[j++].revents != 0)
+                    feed_hook(&hooks[i], input, len);
+            }
+        }
+
+        now = monotonic();
+        for (int i = 0; i < count; i++) {
+            if (hooks[i].pid == 0)
+                continue;
+            if (hooks[i].deadline != 0 && now >= hooks[i].deadline) {
+                hooks[i].signal = hooks[i].signal == 0 ? SIGTERM : SIGKILL;
+                kill(-hooks[i].pid, hooks[i].signal);
+                hooks[i].deadline = hooks[i].signal == SIGTERM ? now + HOOK_GRACE : 0;
+            }
+            failed += reap_hook(&hooks[i]);
+            if (hooks[i].pid == 0)
+                running--;
+        }
+    }
+
+    free(fds);
+    return failed;
+}
+
+int hooks_run(const char *dir, const char *input, size_t len, int timeout, bool verbose)
+{
+    debug_printf("hooks_run(%s, %zu)\n", dir, len);
+
+    struct dirent **entries;
+    struct hook *hooks;
+    struct sigaction sa, old_pipe;
+    struct stat st;
+    int n, count = 0, failed = 0;
+
+    n = scandir(dir, &entries, visible, alphasort);
+    if (n < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    hooks = calloc(n > 0 ? n : 1, sizeof (struct hook));
+    for (int i = 0; i < n; i++) {
+        char *path = cs_strvcat(dir, "/", entries[i]->d_name, NULL);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            hooks[count].path = path;
+            hooks[count].fd = -1;
+            count++;
+        } else {
+            free(path);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    /* a hook that does not read its input must not take repo down */
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGPIPE, &sa, &old_pipe);
+
+    for (int i = 0, j; i < count; i = j) {
+        const char *name = hooks[i].path + strlen(dir) + 1;
+        for (j = i + 1; j < count && same_stage(name, hooks[j].path + strlen(dir) + 1); j++)
+            ;
+        failed += run_stage(hooks + i, j - i, input, len, timeout, verbose);
+    }
+
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    for (int i = 0; i < count; i++)
+        free(hooks[i].path);
+    free(hooks);
+    return failed;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,46 @@
+/*
+ * hooks.h
+ * Programs run once after every transaction, in parallel stages.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * The hooks are the executable files in a directory, run in the order of
+ * their names. Hooks whose names start with the same number, such as
+ * 10-sign and 10-purge-cache, are independent of each other and run at the
+ * same time; the next number only starts once all of them have finished.
+ * Names without a number form a stage of their own.
+ */
+
+/*
+ * hooks_run: run every hook in dir once, with input on its stdin and the
+ * working directory unchanged. A hook that is still running after timeout
+ * seconds (0 for no limit) gets SIGTERM, and SIGKILL a little later, along
+ * with every process it started.
+ * Returns the number of hooks that failed, or -1 (and sets errno) if dir
+ * cannot be read; if dir does not exist, there are no hooks.
+ */
+extern int hooks_run(const char *dir, const char *input, size_t len, int timeout, bool verbose);
+
+#endif // HOOKS_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,699 @@
+/*
+ * httpd.c
+ * Static HTTP server for the files in the database directory, so that
+ * pacman clients can use the repository without a separate web server.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "httpd.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+#define REQUEST_MAX   8192      // longest request head that is accepted
+#define HEADER_MAX    1024      // longest response head that is sent
+#define SEND_CHUNK    (1 << 20) // bytes given to one sendfile() call
+#define IDLE_TIMEOUT  60        // seconds before an idle connection is closed
+#define MAX_EVENTS    256
+
+/* One client connection, which is either reading a request or sending a response. */
+struct conn {
+    int fd;
+    int file;                   // file being sent, -1 if none
+    off_t offset;               // next byte of file to send
+    off_t end;                  // one past the last byte of file to send
+    char in[REQUEST_MAX];
+    size_t in_len;
+    char out[HEADER_MAX];
+    size_t out_len;
+    size_t out_sent;
+    bool writing;
+    bool keep_alive;
+    time_t active;
+};
+
+struct server {
+    int listen_fd;
+    int epoll_fd;
+    int dir_fd;                 // the directory that is served
+    bool paused;                // not accepting, for want of file descriptors
+    bool refusing;              // has said so, and not accepted anything since
+    struct conn **conns;        // indexed by file descriptor
+    size_t nconns;
+    bool verbose;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static void http_date(time_t t, char *buf, size_t len)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * parse_date: parse an HTTP date in the preferred format; -1 if it is not.
+ */
+static time_t parse_date(const char *str)
+{
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end != NULL ? timegm(&tm) : (time_t)-1;
+}
+
+/*
+ * listen_on: create a non-blocking socket listening on addr.
+ */
+static int listen_on(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host, *port;
+    int fd = -1, err, one = 1, saved = 0;
+
+    /* split [host]:port, with brackets around IPv6 addresses */
+    port = strrchr(addr, ':');
+    if (port == NULL) {
+        host = NULL;
+        port = (char *)addr;
+    } else {
+        const char *first = addr, *last = port;
+        if (*first == '[' && last > first && last[-1] == ']') {
+            first++;
+            last--;
+        }
+        host = last > first ? cs_substr(first, 0, last - first) : NULL;
+        port++;
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    err = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    if (err != 0) {
+        fprintf(stderr, "Error: address '%s': %s\n", addr, gai_strerror(err));
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            saved = errno;
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            break;
+        saved = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        errno = saved;
+    return fd;
+}
+
+/*
+ * raise_fd_limit: allow as many open files as we may, as every connection
+ * takes up to two of them.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * watch_listener: start or stop waiting for new connections. While there
+ * are no file descriptors left, the listening socket stays readable, so it
+ * is not watched until a connection has been closed.
+ */
+static void watch_listener(struct server *s, bool paused)
+{
+    struct epoll_event ev;
+
+    if (s->paused == paused)
+        return;
+    ev.events = EPOLLIN;
+    ev.data.fd = s->listen_fd;
+    epoll_ctl(s->epoll_fd, paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, s->listen_fd, &ev);
+    s->paused = paused;
+}
+
+static void conn_close(struct server *s, struct conn *c)
+{
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->file >= 0)
+        close(c->file);
+    s->conns[c->fd] = NULL;
+    free(c);
+    watch_listener(s, false);
+}
+
+static void conn_watch(struct server *s, struct conn *c, bool writing)
+{
+    struct epoll_event ev;
+
+    if (c->writing == writing)
+        return;
+    ev.events = writing ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->writing = writing;
+}
+
+/*
+ * decode_path: decode the percent escapes of the request target into a path
+ * relative to the served directory; NULL for anything that could leave it
+ * (an absolute path, an empty component or ..), or that names a hidden file,
+ * such as the package index.
+ */
+static char *decode_path(const char *target, size_t len)
+{
+    char *path = malloc(len + 1), *out = path;
+
+    if (len == 0 || *target != '/')
+        goto invalid;
+    for (size_t i = 1; i < len && target[i] != '?'; i++) {
+        char c = target[i];
+        if (c == '%') {
+            unsigned int byte;
+            if (i + 2 >= len || !isxdigit((unsigned char)target[i+1]) || !isxdigit((unsigned char)target[i+2])
+                || sscanf(target + i + 1, "%2x", &byte) != 1 || byte == 0)
+                goto invalid;
+            c = byte;
+            i += 2;
+        }
+        /* a component starting with a dot covers both .. and hidden files,
+         * and one starting with a slash both // and an absolute path */
+        if ((c == '.' || c == '/') && (out == path || out[-1] == '/'))
+            goto invalid;
+        *out++ = c;
+    }
+    *out = '\0';
+    if (*path == '\0')
+        goto invalid;
+    return path;
+
+invalid:
+    free(path);
+    return NULL;
+}
+
+/*
+ * header_value: find the value of header name in the request head, which
+ * is NUL-terminated; the value is copied into buf.
+ */
+static bool header_value(const char *head, const char *name, char *buf, size_t len)
+{
+    size_t n = strlen(name);
+
+    for (const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+            const char *value = line + n + 1, *end;
+            while (*value == ' ' || *value == '\t')
+                value++;
+            end = strstr(value, "\r\n");
+            if (end == NULL)
+                end = value + strlen(value);
+            if ((size_t)(end - value) >= len)
+                return false;
+            memcpy(buf, value, end - value);
+            buf[end - value] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * parse_range: parse a single byte range (bytes=a-b, bytes=a- or bytes=-n)
+ * for a file of size bytes into [*start, *end). Returns 1 for a valid range,
+ * 0 if the header is to be ignored, and -1 if the range cannot be satisfied.
+ */
+static int parse_range(const char *value, off_t size, off_t *start, off_t *end)
+{
+    char *rest;
+    long long a, b;
+
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL)
+        return 0;
+    value += 6;
+    if (*value == '-') {
+        b = strtoll(value + 1, &rest, 10);
+        if (rest == value + 1 || *rest != '\0' || b < 0)
+            return 0;
+        if (b == 0)
+            return -1;
+        *start = b < size ? size - b : 0;
+        *end = size;
+        return 1;
+    }
+    a = strtoll(value, &rest, 10);
+    if (rest == value || *rest != '-' || a < 0)
+        return 0;
+    value = rest + 1;
+    if (*value == '\0') {
+        b = size - 1;
+    } else {
+        b = strtoll(value, &rest, 10);
+        if (*rest != '\0' || b < a)
+            return 0;
+    }
+    if (a >= size)
+        return -1;
+    *start = a;
+    *end = (b < size ? b : size - 1) + 1;
+    return 1;
+}
+
+/*
+ * open_beneath: open the file at path for reading, refusing to resolve it
+ * to anything outside the directory dir, even through a symlink.
+ */
+static int open_beneath(int dir, const char *path)
+{
+    struct open_how how;
+    int fd;
+
+    memset(&how, 0, sizeof how);
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    fd = syscall(SYS_openat2, dir, path, &how, sizeof how);
+    /* before Linux 5.6, decode_path alone has to do */
+    if (fd < 0 && errno == ENOSYS)
+        fd = openat(dir, path, O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+static void respond(struct conn *c, int status, const char *reason, const char *extra)
+{
+    char date[64];
+
+    /* what follows an error in the input cannot be trusted to be a request */
+    if (status >= 400)
+        c->keep_alive = false;
+    http_date(time(NULL), date, sizeof date);
+    c->out_len = snprintf(c->out, sizeof c->out,
+                          "HTTP/1.1 %d %s\r\n"
+                          "Date: %s\r\n"
+                          "Server: repo/" REPO_VERSION "\r\n"
+                          "Connection: %s\r\n"
+                          "%s"
+                          "\r\n",
+                          status, reason, date, c->keep_alive ? "keep-alive" : "close",
+                          extra != NULL ? extra : "Content-Length: 0\r\n");
+    c->out_sent = 0;
+}
+
+/*
+ * handle_request: answer the complete request head at the start of c->in,
+ * which is NUL-terminated at len.
+ */
+static void handle_request(struct server *s, struct conn *c, size_t len)
+{
+    char *head = c->in, *method, *target, *version, *path = NULL;
+    char value[128], extra[512], modified[64];
+    struct stat st;
+    bool head_only;
+    int status = 200;
+
+    head[len] = '\0';
+    method = head;
+    target = strchr(method, ' ');
+    version = target != NULL ? strchr(target + 1, ' ') : NULL;
+    if (target == NULL || version == NULL || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+        c->keep_alive = false;
+        respond(c, 400, "Bad Request", NULL);
+        return;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+
+    /* HTTP/1.1 keeps the connection unless asked not to, 1.0 the other way around */
+    c->keep_alive = strncmp(version, "HTTP/1.1", 8) == 0;
+    if (header_value(version, "Connection", value, sizeof value))
+        c->keep_alive = strcasecmp(value, "close") != 0
+                        && (c->keep_alive || strcasecmp(value, "keep-alive") == 0);
+    /* a body is never read, so it must not be taken for the next request */
+    if (header_value(version, "Content-Length", value, sizeof value)
+        || header_value(version, "Transfer-Encoding", value, sizeof value))
+        c->keep_alive = false;
+
+    if (s->verbose)
+        printf("%s %s\n", method, target);
+
+    head_only = strcmp(method, "HEAD") == 0;
+    if (!head_only && strcmp(method, "GET") != 0) {
+        respond(c, 405, "Method Not Allowed", "Allow: GET, HEAD\r\nContent-Length: 0\r\n");
+        return;
+    }
+
+    path = decode_path(target, strlen(target));
+    c->file = path != NULL ? open_beneath(s->dir_fd, path) : -1;
+    free(path);
+    if (c->file < 0 || fstat(c->file, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (c->file >= 0)
+            close(c->file);
+        c->file = -1;
+        respond(c, 404, "Not Found", NULL);
+        return;
+    }
+
+    http_date(st.st_mtime, modified, sizeof modified);
+    if (header_value(version, "If-Modified-Since", value, sizeof value)) {
+        time_t since = parse_date(value);
+        if (since != -1 && st.st_mtime <= since) {
+            snprintf(extra, sizeof extra, "Last-Modified: %s\r\nContent-Length: 0\r\n", modified);
+            close(c->file);
+            c->file = -1;
+            respond(c, 304, "Not Modified", extra);
+            return;
+        }
+    }
+
+    c->offset = 0;
+    c->end = st.st_size;
+    if (header_value(version, "Range", value, sizeof value)) {
+        int ret = parse_range(value, st.st_size, &c->offset, &c->end);
+        if (ret < 0) {
+            snprintf(extra, sizeof extra, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n",
+                     (long long)st.st_size);
+            close(c->file);
+            c->file = -1;
+            respond(c, 416, "Range Not Satisfiable", extra);
+            return;
+        }
+        if (ret > 0)
+            status = 206;
+    }
+
+    if (status == 206)
+        snprintf(extra, sizeof extra,
+                 "Content-Type: application/octet-stream\r\nContent-Length: %lld\r\n"
+                 "Content-Range: bytes %lld-%lld/%lld\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+                 (long long)(c->end - c->offset), (long long)c->offset, (long long)c->end - 1,
+                 (long long)st.st_size, modified);
+    else
+        snprintf(extra, sizeof extra,
+                 "Content-Type: application/octet-stream\r\nContent-Length: %lld\r\n"
+                 "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+                 (long long)st.st_size, modified);
+    respond(c, status, status == 206 ? "Partial Content" : "OK", extra);
+
+    if (head_only) {
+        close(c->file);
+        c->file = -1;
+    }
+}
+
+/*
+ * conn_process: handle the next request in the input buffer, if it is
+ * complete. Returns false if the connection has to be closed.
+ */
+static bool conn_process(struct server *s, struct conn *c)
+{
+    char *end;
+    size_t len;
+
+    /* the buffer is not NUL-terminated, so look for the end of the head by hand */
+    end = NULL;
+    for (size_t i = 0; i + 3 < c->in_len; i++) {
+        if (memcmp(c->in + i, "\r\n\r\n", 4) == 0) {
+            end = c->in + i;
+            break;
+        }
+    }
+    if (end == NULL) {
+        if (c->in_len < sizeof c->in)
+            return true;
+        c->keep_alive = false;
+        respond(c, 431, "Request Header Fields Too Large", NULL);
+        c->in_len = 0;
+        conn_watch(s, c, true);
+        return true;
+    }
+
+    len = end - c->in;
+    handle_request(s, c, len);
+    /* keep whatever the client has pipelined after this request */
+    len += 4;
+    memmove(c->in, c->in + len, c->in_len - len);
+    c->in_len -= len;
+    conn_watch(s, c, true);
+    return true;
+}
+
+/*
+ * conn_read: read what the client sent. Returns false if it is gone.
+ */
+static bool conn_read(struct server *s, struct conn *c)
+{
+    while (c->in_len < sizeof c->in) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+        } else if (n == 0) {
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return conn_process(s, c);
+}
+
+/*
+ * conn_write: send the response head and then the file with sendfile(),
+ * until the socket is full. Returns false if the connection is done.
+ */
+static bool conn_write(struct server *s, struct conn *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->out_sent += n;
+    }
+
+    while (c->file >= 0 && c->offset < c->end) {
+        size_t chunk = c->end - c->offset < SEND_CHUNK ? c->end - c->offset : SEND_CHUNK;
+        ssize_t n = sendfile(c->fd, c->file, &c->offset, chunk);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (n == 0) // the file was truncated under us
+            return false;
+    }
+
+    /* the response is complete */
+    if (c->file >= 0) {
+        close(c->file);
+        c->file = -1;
+    }
+    c->out_len = c->out_sent = 0;
+    if (!c->keep_alive)
+        return false;
+    conn_watch(s, c, false);
+    return c->in_len > 0 ? conn_process(s, c) : true;
+}
+
+static void accept_all(struct server *s)
+{
+    for (;;) {
+        struct epoll_event ev;
+        struct conn *c;
+        int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                if (!s->refusing) {
+                    perror("Error: accept");
+                    fprintf(stderr, "Not accepting connections until one is closed.\n");
+                }
+                s->refusing = true;
+                watch_listener(s, true);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Error: accept");
+            }
+            return;
+        }
+        s->refusing = false;
+        if ((size_t)fd >= s->nconns) {
+            size_t n = s->nconns;
+            s->nconns = 2 * (fd + 1);
+            s->conns = realloc(s->conns, s->nconns * sizeof (struct conn *));
+            memset(s->conns + n, 0, (s->nconns - n) * sizeof (struct conn *));
+        }
+
+        c = malloc(sizeof *c);
+        c->fd = fd;
+        c->file = -1;
+        c->in_len = c->out_len = c->out_sent = 0;
+        c->writing = false;
+        c->keep_alive = true;
+        c->active = time(NULL);
+        s->conns[fd] = c;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            s->conns[fd] = NULL;
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+/*
+ * close_idle: close the connections that have not done anything for
+ * IDLE_TIMEOUT seconds.
+ */
+static void close_idle(struct server *s, time_t now)
+{
+    for (size_t i = 0; i < s->nconns; i++)
+        if (s->conns[i] != NULL && now - s->conns[i]->active > IDLE_TIMEOUT)
+            conn_close(s, s->conns[i]);
+}
+
+int httpd_serve(const char *addr, bool verbose)
+{
+    debug_printf("httpd_serve(%s)\n", addr);
+
+    struct server s;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct sigaction sa;
+    time_t last_sweep = time(NULL);
+
+    memset(&s, 0, sizeof s);
+    s.verbose = verbose;
+    s.listen_fd = listen_on(addr);
+    if (s.listen_fd < 0)
+        return -1;
+    s.dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s.dir_fd < 0 || s.epoll_fd < 0) {
+        if (s.dir_fd >= 0)
+            close(s.dir_fd);
+        if (s.epoll_fd >= 0)
+            close(s.epoll_fd);
+        close(s.listen_fd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = s.listen_fd;
+    epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.listen_fd, &ev);
+    raise_fd_limit();
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving on %s\n", addr);
+    fflush(stdout);
+    while (!stopping) {
+        int n = epoll_wait(s.epoll_fd, events, MAX_EVENTS, 1000);
+        time_t now = time(NULL);
+
+        if (n < 0 && errno != EINTR) {
+            perror("Error: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            struct conn *c;
+            bool ok;
+
+            if (fd == s.listen_fd) {
+                accept_all(&s);
+                continue;
+            }
+            if ((size_t)fd >= s.nconns || (c = s.conns[fd]) == NULL)
+                continue;
+            c->active = now;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                ok = false;
+            else if (c->writing)
+                ok = conn_write(&s, c);
+            else
+                ok = conn_read(&s, c);
+            /* a fresh response is sent right away instead of waiting a round */
+            if (ok && c->writing && c->out_sent == 0 && c->out_len > 0)
+                ok = conn_write(&s, c);
+            if (!ok)
+                conn_close(&s, c);
+        }
+        if (now - last_sweep >= 1) {
+            close_idle(&s, now);
+            /* ENFILE may be over without any of our connections closing */
+            watch_listener(&s, false);
+            last_sweep = now;
+        }
+    }
+
+    // Cleanup:
+    for (size_t i = 0; i < s.nconns; i++)
+        if (s.conns[i] != NULL)
+            conn_close(&s, s.conns[i]);
+    free(s.conns);
+    close(s.epoll_fd);
+    close(s.listen_fd);
+    close(s.dir_fd);
+    return 0;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
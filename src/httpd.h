@@ -0,0 +1,38 @@
+/*
+ * httpd.h
+ * Static HTTP server for the files in the database directory, so that
+ * pacman clients can use the repository without a separate web server.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HTTPD_H
+#define HTTPD_H
+
+#include <stdbool.h>
+
+/*
+ * httpd_serve: serve the files below the current directory over HTTP on
+ * addr ([host]:port, [::1]:port or just a port) until SIGINT or SIGTERM.
+ * Every request opens its file anew, so a database that is replaced with
+ * rename() is picked up by the next request, while downloads that are
+ * already running keep the generation they started with.
+ * Returns 0, or -1 (and sets errno) if addr cannot be listened on.
+ */
+extern int httpd_serve(const char *addr, bool verbose);
+
+#endif // HTTPD_H
+
+/* vim: set cin ts=4 sw=4 et: */
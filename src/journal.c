@@ -0,0 +1,343 @@
+/*
+ * journal.c
+ * Append-only log of the changes to the database, so that mirrors can
+ * follow them instead of comparing whole directories.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "journal.h"
+#include "database.h"
+#include "hashmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+
+#define TAIL_MAX 65536          // longest line that is looked for at the end
+
+/* One changed package; old is NULL for add, pkg is NULL for remove. */
+struct change {
+    const char *op;
+    Package *pkg;
+    Package *old;
+};
+
+static int collect_package(Package *pkg, void *data)
+{
+    if (pkg->name == NULL || hashmap_contains(data, pkg->name)) {
+        package_free(pkg);
+        return 0;
+    }
+    hashmap_put(data, pkg->name, pkg);
+    return 0;
+}
+
+static void free_package(void *pkg)
+{
+    package_free(pkg);
+}
+
+static const char *field(const char *str)
+{
+    return str != NULL && *str != '\0' ? str : "-";
+}
+
+static bool same_str(const char *a, const char *b)
+{
+    return strcmp(field(a), field(b)) == 0;
+}
+
+static const char *change_name(const struct change *c)
+{
+    return c->pkg != NULL ? c->pkg->name : c->old->name;
+}
+
+static int compare_changes(const void *a, const void *b)
+{
+    return strcmp(change_name(a), change_name(b));
+}
+
+/*
+ * last_sequence: the sequence number of the last line of the journal open
+ * as fd, 0 if it is empty.
+ */
+static unsigned long last_sequence(int fd)
+{
+    struct stat st;
+    char *buf, *line;
+    size_t len;
+    ssize_t n;
+    unsigned long seq = 0;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        return 0;
+    len = st.st_size < TAIL_MAX ? st.st_size : TAIL_MAX;
+    buf = malloc(len + 1);
+    n = pread(fd, buf, len, st.st_size - len);
+    if (n > 0) {
+        buf[n] = '\0';
+        /* skip the final newline, then find the one before the last line */
+        while (n > 0 && buf[n-1] == '\n')
+            buf[--n] = '\0';
+        line = buf + n;
+        while (line > buf && line[-1] != '\n')
+            line--;
+        seq = strtoul(line, NULL, 10);
+    }
+    free(buf);
+    return seq;
+}
+
+int journal_record(const char *path, const char *old_path, const char *new_path)
+{
+    debug_printf("journal_record(%s)\n", path);
+
+    HashMap *old = hashmap_new(1024), *new = hashmap_new(1024);
+    struct change *changes = NULL;
+    size_t count = 0, size = 0;
+    FILE *out = NULL;
+    int fd, retval = -1;
+
+    if ((db_read(old_path, collect_package, old) < 0 && errno != ENOENT)
+        || db_read(new_path, collect_package, new) < 0)
+        goto cleanup;
+
+    hashmap_foreach(new, e) {
+        Package *pkg = e->value, *prev = hashmap_get(old, e->key);
+        const char *op = NULL;
+
+        if (prev == NULL)
+            op = "add";
+        else if (!same_str(pkg->filename, prev->filename) || !same_str(pkg->version, prev->version)
+                 || !same_str(pkg->sha256sum, prev->sha256sum))
+            op = "replace";
+        if (op == NULL)
+            continue;
+        if (count == size)
+            changes = realloc(changes, (size = 2 * size + 16) * sizeof *changes);
+        changes[count++] = (struct change){ op, pkg, prev };
+    }
+    hashmap_foreach(old, e) {
+        if (hashmap_contains(new, e->key))
+            continue;
+        if (count == size)
+            changes = realloc(changes, (size = 2 * size + 16) * sizeof *changes);
+        changes[count++] = (struct change){ "remove", NULL, e->value };
+    }
+
+    retval = 0;
+    if (count == 0)
+        goto cleanup;
+    qsort(changes, count, sizeof *changes, compare_changes);
+
+    fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || (out = fdopen(fd, "a")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        retval = -1;
+        goto cleanup;
+    }
+
+    unsigned long seq = last_sequence(fd);
+    long now = time(NULL);
+    for (size_t i = 0; i < count; i++) {
+        const struct change *c = &changes[i];
+        const Package *pkg = c->pkg != NULL ? c->pkg : c->old;
+        fprintf(out, "%lu\t%ld\t%s\t%s\t%s\t%s\t%s\t%s\n", ++seq, now, c->op, pkg->name,
+                field(pkg->version), field(pkg->filename), field(pkg->sha256sum),
+                c->pkg != NULL && c->old != NULL ? field(c->old->filename) : "-");
+    }
+    retval = count;
+    if (fflush(out) != 0 || fsync(fd) != 0)
+        retval = -1;
+    if (fclose(out) != 0)
+        retval = -1;
+
+cleanup:
+    free(changes);
+    hashmap_free(old, free_package);
+    hashmap_free(new, free_package);
+    return retval;
+}
+
+/*
+ * line_sequence: read the line starting at offset; returns its sequence
+ * number and sets *next to the offset of the following line.
+ */
+static unsigned long line_sequence(FILE *in, off_t offset, off_t *next)
+{
+    char buf[32];
+    size_t n;
+    int c;
+
+    fseeko(in, offset, SEEK_SET);
+    n = fread(buf, 1, sizeof buf - 1, in);
+    buf[n] = '\0';
+    fseeko(in, offset, SEEK_SET);
+    while ((c = getc(in)) != EOF && c != '\n')
+        ;
+    *next = ftello(in);
+    return strtoul(buf, NULL, 10);
+}
+
+/*
+ * open_since: open the journal at path, positioned at the first line whose
+ * sequence number may be greater than since, which is found by binary search.
+ * Returns NULL (and sets errno) on failure.
+ */
+static FILE *open_since(const char *path, unsigned long since)
+{
+    FILE *in = fopen(path, "r");
+    struct stat st;
+    off_t lo = 0, hi;
+
+    if (in == NULL)
+        return NULL;
+    if (fstat(fileno(in), &st) != 0) {
+        fclose(in);
+        return NULL;
+    }
+
+    /*
+     * Every line starting before lo has a sequence number of at most since,
+     * every line starting at hi or later one greater than since.
+     */
+    hi = st.st_size;
+    while (lo < hi) {
+        off_t mid = lo + (hi - lo) / 2, start, next;
+        int c;
+
+        /* move to the start of the first line at or after mid */
+        fseeko(in, mid > 0 ? mid - 1 : 0, SEEK_SET);
+        if (mid > 0)
+            while ((c = getc(in)) != EOF && c != '\n')
+                ;
+        start = ftello(in);
+        if (start >= hi)
+            break;
+
+        if (line_sequence(in, start, &next) <= since)
+            lo = next;
+        else
+            hi = start;
+    }
+
+    fseeko(in, lo, SEEK_SET);
+    return in;
+}
+
+/*
+ * parse_entry: split line into the fields of entry, in place.
+ */
+static bool parse_entry(char *line, struct journal_entry *entry)
+{
+    char *fields[8];
+    int n = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    for (char *tok = line; n < 8; n++) {
+        fields[n] = tok;
+        tok = strchr(tok, '\t');
+        if (tok == NULL) {
+            n++;
+            break;
+        }
+        *tok++ = '\0';
+    }
+    if (n < 8)
+        return false;
+
+    entry->seq = strtoul(fields[0], NULL, 10);
+    entry->time = strtol(fields[1], NULL, 10);
+    entry->op = fields[2];
+    entry->name = fields[3];
+    entry->version = fields[4];
+    entry->filename = fields[5];
+    entry->sha256 = fields[6];
+    entry->replaced = fields[7];
+    return true;
+}
+
+int journal_read(const char *path, unsigned long since, journal_callback callback, void *data)
+{
+    debug_printf("journal_read(%s, %lu)\n", path, since);
+
+    FILE *in = open_since(path, since);
+    struct journal_entry entry;
+    char *line = NULL;
+    size_t size = 0;
+    int count = 0;
+
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while (getline(&line, &size, in) > 0) {
+        if (!parse_entry(line, &entry) || entry.seq <= since)
+            continue;
+        count++;
+        if (callback(&entry, data) != 0)
+            break;
+    }
+
+    free(line);
+    fclose(in);
+    return count;
+}
+
+int journal_print(const char *path, unsigned long since, FILE *out)
+{
+    debug_printf("journal_print(%s, %lu)\n", path, since);
+
+    FILE *in = open_since(path, since);
+    char *line = NULL;
+    size_t size = 0;
+    int count = 0;
+
+    if (in == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while (getline(&line, &size, in) > 0) {
+        if (strtoul(line, NULL, 10) <= since)
+            continue;
+        fputs(line, out);
+        count++;
+    }
+
+    free(line);
+    fclose(in);
+    return count;
+}
+
+unsigned long journal_last(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    unsigned long seq;
+
+    if (fd < 0)
+        return 0;
+    seq = last_sequence(fd);
+    close(fd);
+    return seq;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
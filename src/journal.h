@@ -0,0 +1,81 @@
+/*
+ * journal.h
+ * Append-only log of the changes to the database, so that mirrors can
+ * follow them instead of comparing whole directories.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * The journal (<stem>.journal in db_dir, next to the database, so that it
+ * is served along with it) has one line per change, with tab-separated
+ * fields: sequence number, time, operation (add, remove or replace),
+ * package name, version, file name, SHA-256 checksum and, for replace,
+ * the file name that was replaced. Unknown fields are written as -.
+ * Sequence numbers start at 1 and increase by one with every line.
+ */
+
+/* A line of the journal; the strings point into the line that was read. */
+struct journal_entry {
+    unsigned long seq;
+    time_t time;
+    const char *op;             // add, remove or replace
+    const char *name;
+    const char *version;
+    const char *filename;
+    const char *sha256;
+    const char *replaced;       // file name that was replaced, or -
+};
+
+/* Called for each entry by journal_read; a non-zero result stops reading. */
+typedef int (*journal_callback)(const struct journal_entry *entry, void *data);
+
+/*
+ * journal_record: append a line for every package that differs between the
+ * databases at old_path (which may be missing) and new_path to the journal
+ * at path, ordered by package name.
+ * Returns the number of lines appended, or -1 (and sets errno).
+ */
+extern int journal_record(const char *path, const char *old_path, const char *new_path);
+
+/*
+ * journal_print: write the lines of the journal at path whose sequence
+ * number is greater than since to out; the first of these is found by
+ * binary search. A missing journal is empty.
+ * Returns the number of lines written, or -1 (and sets errno).
+ */
+extern int journal_print(const char *path, unsigned long since, FILE *out);
+
+/*
+ * journal_read: like journal_print, but call callback for each entry.
+ * Returns the number of entries read, or -1 (and sets errno).
+ */
+extern int journal_read(const char *path, unsigned long since, journal_callback callback, void *data);
+
+/*
+ * journal_last: the sequence number of the last entry of the journal at
+ * path, or 0 if it is missing or empty.
+ */
+extern unsigned long journal_last(const char *path);
+
+#endif // JOURNAL_H
+
+/* vim: set cin ts=4 sw=4 et: */
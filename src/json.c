@@ -0,0 +1,288 @@
+/*
+ * json.c
+ * Streaming extraction of fields from a JSON array of objects.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "json.h"
+#include "archive.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_BUFFER (64*1024)
+
+/* A growable, NUL-terminated string. */
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct reader {
+    struct archive *ar;
+    char buf[JSON_BUFFER];
+    size_t pos;
+    size_t len;
+    bool error;
+};
+
+static int next(struct reader *r)
+{
+    if (r->pos == r->len) {
+        ssize_t n = archive_read(r->ar, r->buf, JSON_BUFFER);
+        if (n <= 0) {
+            if (n < 0)
+                r->error = true;
+            return EOF;
+        }
+        r->pos = 0;
+        r->len = n;
+    }
+    return (unsigned char)r->buf[r->pos++];
+}
+
+static int peek(struct reader *r)
+{
+    int c = next(r);
+    if (c != EOF)
+        r->pos--;
+    return c;
+}
+
+static int skip_ws(struct reader *r)
+{
+    int c;
+    do {
+        c = next(r);
+    } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+    return c;
+}
+
+static void put(struct buffer *b, char c)
+{
+    if (b == NULL)
+        return;
+    if (b->len + 1 >= b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 64;
+        b->data = realloc(b->data, b->cap);
+    }
+    b->data[b->len++] = c;
+    b->data[b->len] = '\0';
+}
+
+static void clear(struct buffer *b)
+{
+    if (b == NULL)
+        return;
+    if (b->cap == 0) {
+        b->cap = 64;
+        b->data = malloc(b->cap);
+    }
+    b->len = 0;
+    b->data[0] = '\0';
+}
+
+static void put_utf8(struct buffer *b, unsigned long cp)
+{
+    if (cp < 0x80) {
+        put(b, cp);
+    } else if (cp < 0x800) {
+        put(b, 0xc0 | (cp >> 6));
+        put(b, 0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        put(b, 0xe0 | (cp >> 12));
+        put(b, 0x80 | ((cp >> 6) & 0x3f));
+        put(b, 0x80 | (cp & 0x3f));
+    } else {
+        put(b, 0xf0 | (cp >> 18));
+        put(b, 0x80 | ((cp >> 12) & 0x3f));
+        put(b, 0x80 | ((cp >> 6) & 0x3f));
+        put(b, 0x80 | (cp & 0x3f));
+    }
+}
+
+static long read_hex4(struct reader *r)
+{
+    long cp = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = next(r);
+        cp <<= 4;
+        if (c >= '0' && c <= '9')      cp |= c - '0';
+        else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+        else return -1;
+    }
+    return cp;
+}
+
+/*
+ * read_string: read the rest of a string whose opening quote has been
+ * consumed into b (which may be NULL to skip it).
+ */
+static bool read_string(struct reader *r, struct buffer *b)
+{
+    int c;
+
+    clear(b);
+    while ((c = next(r)) != '"') {
+        if (c == EOF)
+            return false;
+        if (c != '\\') {
+            put(b, c);
+            continue;
+        }
+        switch (c = next(r)) {
+            case 'b': put(b, '\b'); break;
+            case 'f': put(b, '\f'); break;
+            case 'n': put(b, '\n'); break;
+            case 'r': put(b, '\r'); break;
+            case 't': put(b, '\t'); break;
+            case 'u': {
+                long cp = read_hex4(r);
+                if (cp < 0)
+                    return false;
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (next(r) != '\\' || next(r) != 'u')
+                        return false;
+                    long lo = read_hex4(r);
+                    if (lo < 0xdc00 || lo >= 0xe000)
+                        return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                put_utf8(b, cp);
+                break;
+            }
+            case EOF:
+                return false;
+            default:
+                put(b, c);
+        }
+    }
+    return true;
+}
+
+/*
+ * read_value: read any value, whose first character c has been consumed,
+ * into b if it is a scalar; nested values are skipped.
+ */
+static bool read_value(struct reader *r, int c, struct buffer *b)
+{
+    if (c == '"')
+        return read_string(r, b);
+
+    if (c == '[' || c == '{') {
+        int depth = 1;
+        while (depth > 0) {
+            c = next(r);
+            if (c == EOF)
+                return false;
+            else if (c == '"' && !read_string(r, NULL))
+                return false;
+            else if (c == '[' || c == '{')
+                depth++;
+            else if (c == ']' || c == '}')
+                depth--;
+        }
+        clear(b);
+        return true;
+    }
+
+    /* number, true, false or null */
+    clear(b);
+    put(b, c);
+    while ((c = peek(r)) != EOF && c != ',' && c != '}' && c != ']'
+           && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+        put(b, next(r));
+    return true;
+}
+
+int json_read_objects(struct archive *ar, const char **keys, size_t nkeys,
+                      json_callback callback, void *data)
+{
+    struct reader *r = calloc(1, sizeof (struct reader));
+    struct buffer key = { NULL, 0, 0 };
+    struct buffer *values = calloc(nkeys, sizeof (struct buffer));
+    char **found = calloc(nkeys, sizeof (char *));
+    int count = 0;
+    int c;
+
+    r->ar = ar;
+    if (skip_ws(r) != '[')
+        goto error;
+
+    c = skip_ws(r);
+    if (c == ']')
+        goto end;
+
+    for (;;) {
+        if (c != '{')
+            goto error;
+        memset(found, 0, nkeys * sizeof (char *));
+
+        c = skip_ws(r);
+        while (c != '}') {
+            if (c != '"' || !read_string(r, &key) || skip_ws(r) != ':')
+                goto error;
+
+            size_t i;
+            for (i = 0; i < nkeys; i++)
+                if (strcmp(keys[i], key.data) == 0)
+                    break;
+
+            struct buffer *b = i < nkeys ? &values[i] : NULL;
+            c = skip_ws(r);
+            if (!read_value(r, c, b))
+                goto error;
+            if (b != NULL && c != '[' && c != '{' && !(c == 'n' && strcmp(b->data, "null") == 0))
+                found[i] = b->data;
+
+            c = skip_ws(r);
+            if (c == ',')
+                c = skip_ws(r);
+            else if (c != '}')
+                goto error;
+        }
+
+        count++;
+        if (callback(found, data) != 0)
+            goto end;
+
+        c = skip_ws(r);
+        if (c == ']')
+            break;
+        if (c != ',')
+            goto error;
+        c = skip_ws(r);
+    }
+
+end:
+    for (size_t i = 0; i < nkeys; i++)
+        free(values[i].data);
+    free(values);
+    free(found);
+    free(key.data);
+    free(r);
+    return count;
+
+error:
+    count = -1;
+    goto end;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,47 @@
+/*
+ * json.h
+ * Streaming extraction of fields from a JSON array of objects.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdlib.h>
+
+#include "archive.h"
+
+/*
+ * A json_callback receives, for one object, the values of the requested keys
+ * in the same order as the keys; a value is NULL if the object does not have
+ * that key (or if it is not a string, number or literal). The strings are
+ * only valid during the call.
+ * Returns 0 to continue reading, anything else to stop.
+ */
+typedef int (*json_callback)(char **values, void *data);
+
+/*
+ * json_read_objects: read a document of the form [ {...}, {...}, ... ] from
+ * ar, one object at a time, and call callback with the values of the nkeys
+ * keys for each object. Nested arrays and objects are skipped.
+ * Returns: the number of objects read, or -1 if the document is malformed.
+ */
+extern int json_read_objects(struct archive *ar, const char **keys, size_t nkeys,
+                             json_callback callback, void *data);
+
+#endif // JSON_H
+
+/* vim: set cin ts=4 sw=4 et: */
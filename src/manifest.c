@@ -0,0 +1,479 @@
+/*
+ * manifest.c
+ * Merkle tree over the package records of the database, for comparing two
+ * copies of a repository without reading all of either.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "manifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+#define MANIFEST_MAGIC   "REPOMAN1"
+#define MANIFEST_VERSION 1
+
+#define FANOUT      16
+#define LEAVES      4096                    // FANOUT^3, so three levels below the root
+#define NODES       ((LEAVES * FANOUT - 1) / (FANOUT - 1))
+#define FIRST_LEAF  (NODES - LEAVES)        // nodes are stored level by level
+
+/* On-disk layout: the header, the hashes of all nodes, LEAVES + 1 offsets
+ * of the buckets into the text, and the text of all buckets. */
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t leaves;
+    uint64_t count;             // number of packages
+    uint64_t seq;               // last journal entry included
+    int64_t db_sec;             // modification time of the database
+    int64_t db_nsec;
+    uint64_t text_len;
+};
+
+struct bucket {
+    const char *text;           // lines of the packages, in the map or owned
+    size_t len;
+    bool owned;
+};
+
+struct manifest {
+    void *map;
+    size_t map_len;
+    unsigned char (*nodes)[SHA256_DIGEST_LENGTH];
+    bool *stale;                // node hashes that need to be computed again
+    struct bucket *buckets;
+    size_t count;
+    unsigned long seq;
+};
+
+static const unsigned char zero[SHA256_DIGEST_LENGTH];
+
+static size_t bucket_of(const char *name)
+{
+    Sha256 ctx;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, name, strlen(name));
+    sha256_final(&ctx, digest);
+    return (digest[0] << 4) | (digest[1] >> 4);
+}
+
+/*
+ * compare_name: compare the package name at the start of line to name.
+ */
+static int compare_name(const char *line, const char *name)
+{
+    for (; *line != '\t' && *line == *name; line++, name++)
+        ;
+    return (*line == '\t' ? 0 : (unsigned char)*line) - (unsigned char)*name;
+}
+
+static const char *line_end(const char *p, const char *end)
+{
+    const char *eol = memchr(p, '\n', end - p);
+    return eol != NULL ? eol + 1 : end;
+}
+
+/*
+ * parse_line: split a copy of the line from p to eol into the fields of r;
+ * the copy is kept in *buf.
+ */
+static void parse_line(const char *p, const char *eol, char **buf, struct manifest_record *r)
+{
+    const char **fields[] = { &r->name, &r->version, &r->path, &r->sha256 };
+    char *s;
+
+    free(*buf);
+    *buf = s = cs_substr(p, 0, eol - p);
+    s[strcspn(s, "\n")] = '\0';
+    for (size_t i = 0; i < sizeof fields / sizeof fields[0]; i++) {
+        *fields[i] = s;
+        s += strcspn(s, "\t");
+        if (*s == '\t')
+            *s++ = '\0';
+    }
+}
+
+static void mark_stale(struct manifest *m, size_t node)
+{
+    for (;;) {
+        m->stale[node] = true;
+        if (node == 0)
+            break;
+        node = (node - 1) / FANOUT;
+    }
+}
+
+/*
+ * update_hashes: compute the hashes of the stale nodes, children first.
+ */
+static void update_hashes(struct manifest *m)
+{
+    Sha256 ctx;
+
+    for (size_t i = NODES; i-- > 0; ) {
+        if (!m->stale[i])
+            continue;
+        m->stale[i] = false;
+
+        if (i >= FIRST_LEAF) {
+            const struct bucket *b = &m->buckets[i - FIRST_LEAF];
+            if (b->len == 0) {
+                memset(m->nodes[i], 0, SHA256_DIGEST_LENGTH);
+                continue;
+            }
+            sha256_init(&ctx);
+            sha256_update(&ctx, b->text, b->len);
+            sha256_final(&ctx, m->nodes[i]);
+            continue;
+        }
+
+        size_t first = FANOUT * i + 1;
+        bool empty = true;
+        for (size_t c = first; c < first + FANOUT && empty; c++)
+            empty = memcmp(m->nodes[c], zero, SHA256_DIGEST_LENGTH) == 0;
+        if (empty) {
+            memset(m->nodes[i], 0, SHA256_DIGEST_LENGTH);
+            continue;
+        }
+        sha256_init(&ctx);
+        sha256_update(&ctx, m->nodes[first], FANOUT * SHA256_DIGEST_LENGTH);
+        sha256_final(&ctx, m->nodes[i]);
+    }
+}
+
+struct manifest *manifest_new(void)
+{
+    struct manifest *m = calloc(1, sizeof *m);
+
+    m->nodes = calloc(NODES, SHA256_DIGEST_LENGTH);
+    m->stale = calloc(NODES, sizeof (bool));
+    m->buckets = calloc(LEAVES, sizeof (struct bucket));
+    return m;
+}
+
+static bool same_mtime(const struct stat *st, int64_t sec, int64_t nsec)
+{
+    return st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+struct manifest *manifest_open(const char *path, const char *db_path)
+{
+    debug_printf("manifest_open(%s)\n", path);
+
+    const struct manifest_header *h;
+    const uint64_t *offsets;
+    const char *text;
+    struct manifest *m;
+    struct stat st;
+    size_t fixed = sizeof *h + (size_t)NODES * SHA256_DIGEST_LENGTH + (LEAVES + 1) * sizeof (uint64_t);
+    size_t len;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < fixed) {
+        close(fd);
+        return NULL;
+    }
+    len = st.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    /* check the structure, so that nothing after this has to */
+    h = map;
+    offsets = (const uint64_t *)((const char *)map + sizeof *h + (size_t)NODES * SHA256_DIGEST_LENGTH);
+    text = (const char *)map + fixed;
+    bool valid = memcmp(h->magic, MANIFEST_MAGIC, 8) == 0 && h->version == MANIFEST_VERSION
+                 && h->leaves == LEAVES && h->text_len == len - fixed
+                 && offsets[0] == 0 && offsets[LEAVES] == h->text_len;
+    for (size_t i = 0; i < LEAVES && valid; i++)
+        valid = offsets[i] <= offsets[i+1];
+    if (valid && db_path != NULL)
+        valid = stat(db_path, &st) != 0 ? h->db_sec == 0 && h->db_nsec == 0
+                                         : same_mtime(&st, h->db_sec, h->db_nsec);
+    if (!valid) {
+        debug_puts("manifest_open: manifest is out of date");
+        munmap(map, len);
+        return NULL;
+    }
+
+    m = manifest_new();
+    m->map = map;
+    m->map_len = len;
+    m->count = h->count;
+    m->seq = h->seq;
+    memcpy(m->nodes, h + 1, (size_t)NODES * SHA256_DIGEST_LENGTH);
+    for (size_t i = 0; i < LEAVES; i++) {
+        m->buckets[i].text = text + offsets[i];
+        m->buckets[i].len = offsets[i+1] - offsets[i];
+    }
+    return m;
+}
+
+void manifest_free(struct manifest *m)
+{
+    if (m == NULL)
+        return;
+    for (size_t i = 0; i < LEAVES; i++)
+        if (m->buckets[i].owned)
+            free((char *)m->buckets[i].text);
+    if (m->map != NULL)
+        munmap(m->map, m->map_len);
+    free(m->buckets);
+    free(m->stale);
+    free(m->nodes);
+    free(m);
+}
+
+size_t manifest_count(const struct manifest *m)
+{
+    return m->count;
+}
+
+unsigned long manifest_seq(const struct manifest *m)
+{
+    return m->seq;
+}
+
+void manifest_set_seq(struct manifest *m, unsigned long seq)
+{
+    m->seq = seq;
+}
+
+/*
+ * replace_line: replace the line of the package name in its bucket with
+ * line, which is inserted if there is none and removed if line is NULL.
+ */
+static void replace_line(struct manifest *m, const char *name, const char *line)
+{
+    size_t i = bucket_of(name);
+    struct bucket *b = &m->buckets[i];
+    const char *p = b->text, *end = b->text + b->len;
+    size_t len = line != NULL ? strlen(line) : 0;
+    char *text = malloc(b->len + len + 1), *out = text;
+    bool done = line == NULL;
+
+    while (p < end) {
+        const char *eol = line_end(p, end);
+        int cmp = compare_name(p, name);
+
+        if (cmp >= 0 && !done) {
+            memcpy(out, line, len);
+            out += len;
+            done = true;
+        }
+        if (cmp == 0) {
+            m->count--;
+        } else {
+            memcpy(out, p, eol - p);
+            out += eol - p;
+        }
+        p = eol;
+    }
+    if (!done) {
+        memcpy(out, line, len);
+        out += len;
+    }
+    if (line != NULL)
+        m->count++;
+
+    if (b->owned)
+        free((char *)b->text);
+    b->text = text;
+    b->len = out - text;
+    b->owned = true;
+    mark_stale(m, FIRST_LEAF + i);
+}
+
+static const char *field(const char *str)
+{
+    return str != NULL && *str != '\0' ? str : "-";
+}
+
+void manifest_put(struct manifest *m, const char *name, const char *version,
+                  const char *path, const char *sha256)
+{
+    char *line = cs_strvcat(name, "\t", field(version), "\t", field(path), "\t", field(sha256), "\n", NULL);
+    replace_line(m, name, line);
+    free(line);
+}
+
+void manifest_remove(struct manifest *m, const char *name)
+{
+    replace_line(m, name, NULL);
+}
+
+void manifest_root(struct manifest *m, char hex[SHA256_HEX_LENGTH])
+{
+    update_hashes(m);
+    sha256_hex(m->nodes[0], hex);
+}
+
+int manifest_write(struct manifest *m, const char *path, const char *db_path)
+{
+    debug_printf("manifest_write(%s)\n", path);
+
+    struct manifest_header h;
+    uint64_t *offsets = malloc((LEAVES + 1) * sizeof (uint64_t));
+    struct stat st;
+    char *tmp_path;
+    FILE *out;
+    int retval = 0;
+
+    update_hashes(m);
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MANIFEST_MAGIC, 8);
+    h.version = MANIFEST_VERSION;
+    h.leaves = LEAVES;
+    h.count = m->count;
+    h.seq = m->seq;
+    if (db_path != NULL && stat(db_path, &st) == 0) {
+        h.db_sec = st.st_mtim.tv_sec;
+        h.db_nsec = st.st_mtim.tv_nsec;
+    }
+    offsets[0] = 0;
+    for (size_t i = 0; i < LEAVES; i++)
+        offsets[i+1] = offsets[i] + m->buckets[i].len;
+    h.text_len = offsets[LEAVES];
+
+    tmp_path = cs_strcat(path, ".tmp");
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        retval = -1;
+    } else {
+        if (fwrite(&h, sizeof h, 1, out) != 1
+            || fwrite(m->nodes, SHA256_DIGEST_LENGTH, NODES, out) != NODES
+            || fwrite(offsets, sizeof (uint64_t), LEAVES + 1, out) != LEAVES + 1)
+            retval = -1;
+        for (size_t i = 0; i < LEAVES && retval == 0; i++)
+            if (m->buckets[i].len > 0 && fwrite(m->buckets[i].text, 1, m->buckets[i].len, out) != m->buckets[i].len)
+                retval = -1;
+        if (fclose(out) != 0 || retval < 0 || rename(tmp_path, path) != 0) {
+            int saved = errno;
+            unlink(tmp_path);
+            errno = saved;
+            retval = -1;
+        }
+    }
+
+    free(tmp_path);
+    free(offsets);
+    return retval;
+}
+
+/*
+ * diff_bucket: merge the sorted lines of two buckets, reporting the
+ * packages that are only in one or differ.
+ */
+static int diff_bucket(const struct bucket *src, const struct bucket *dst, manifest_callback callback, void *data)
+{
+    const char *s = src->text, *s_end = src->text + src->len;
+    const char *d = dst->text, *d_end = dst->text + dst->len;
+    struct manifest_record sr, dr;
+    char *sbuf = NULL, *dbuf = NULL;
+    int count = 0;
+
+    while (s < s_end || d < d_end) {
+        const char *s_eol = s < s_end ? line_end(s, s_end) : s;
+        const char *d_eol = d < d_end ? line_end(d, d_end) : d;
+        int cmp, ret = 0;
+
+        if (s == s_end)
+            cmp = 1;
+        else if (d == d_end)
+            cmp = -1;
+        else {
+            parse_line(d, d_eol, &dbuf, &dr);
+            cmp = compare_name(s, dr.name);
+        }
+
+        if (cmp < 0) {
+            parse_line(s, s_eol, &sbuf, &sr);
+            ret = callback(&sr, NULL, data);
+            s = s_eol;
+        } else if (cmp > 0) {
+            parse_line(d, d_eol, &dbuf, &dr);
+            ret = callback(NULL, &dr, data);
+            d = d_eol;
+        } else {
+            if (s_eol - s != d_eol - d || memcmp(s, d, s_eol - s) != 0) {
+                parse_line(s, s_eol, &sbuf, &sr);
+                ret = callback(&sr, &dr, data);
+            } else {
+                count--;
+            }
+            s = s_eol;
+            d = d_eol;
+        }
+        count++;
+        if (ret != 0) {
+            count = -1;
+            break;
+        }
+    }
+
+    free(sbuf);
+    free(dbuf);
+    return count;
+}
+
+static int diff_node(struct manifest *src, struct manifest *dst, size_t node,
+                     manifest_callback callback, void *data)
+{
+    int count = 0, n;
+
+    if (memcmp(src->nodes[node], dst->nodes[node], SHA256_DIGEST_LENGTH) == 0)
+        return 0;
+    if (node >= FIRST_LEAF)
+        return diff_bucket(&src->buckets[node - FIRST_LEAF], &dst->buckets[node - FIRST_LEAF], callback, data);
+
+    for (size_t c = FANOUT * node + 1; c <= FANOUT * node + FANOUT; c++) {
+        if ((n = diff_node(src, dst, c, callback, data)) < 0)
+            return -1;
+        count += n;
+    }
+    return count;
+}
+
+int manifest_diff(struct manifest *src, struct manifest *dst, manifest_callback callback, void *data)
+{
+    debug_puts("manifest_diff()");
+
+    update_hashes(src);
+    update_hashes(dst);
+    return diff_node(src, dst, 0, callback, data);
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,119 @@
+/*
+ * manifest.h
+ * Merkle tree over the package records of the database, for comparing two
+ * copies of a repository without reading all of either.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+
+#include "sha256.h"
+
+/*
+ * The manifest (<stem>.manifest in STATE_DIR) puts every package of the
+ * database in one of 4096 buckets, by the first bits of the SHA-256 of its
+ * name. A bucket holds one line per package, sorted by name, with the name,
+ * version, path relative to db_dir and checksum; its hash is the SHA-256 of
+ * these lines. The buckets are the leaves of a tree in which each node has
+ * 16 children and is the hash of their hashes; empty subtrees hash to zero.
+ * Changing a package only rehashes its bucket and the three nodes above it,
+ * and two trees can be compared by descending only into nodes that differ.
+ */
+
+/* A package in the manifest; the strings are owned by the caller of
+ * manifest_diff and only valid during the callback. */
+struct manifest_record {
+    const char *name;
+    const char *version;
+    const char *path;           // relative to db_dir
+    const char *sha256;         // - if unknown
+};
+
+struct manifest;
+
+/*
+ * manifest_new: create an empty manifest.
+ */
+extern struct manifest *manifest_new(void);
+
+/*
+ * manifest_open: map the manifest at path, provided that it was written for
+ * the database at db_path as it is now (by modification time).
+ * Returns NULL if it is missing, damaged or out of date.
+ */
+extern struct manifest *manifest_open(const char *path, const char *db_path);
+
+/*
+ * manifest_free: free the manifest and unmap the file behind it.
+ */
+extern void manifest_free(struct manifest *m);
+
+/*
+ * manifest_count: the number of packages in the manifest.
+ */
+extern size_t manifest_count(const struct manifest *m);
+
+/*
+ * manifest_seq, manifest_set_seq: the sequence number of the last journal
+ * entry that the manifest includes.
+ */
+extern unsigned long manifest_seq(const struct manifest *m);
+extern void manifest_set_seq(struct manifest *m, unsigned long seq);
+
+/*
+ * manifest_put: add the package name, or replace it if it is present.
+ */
+extern void manifest_put(struct manifest *m, const char *name, const char *version,
+                         const char *path, const char *sha256);
+
+/*
+ * manifest_remove: remove the package name, if it is present.
+ */
+extern void manifest_remove(struct manifest *m, const char *name);
+
+/*
+ * manifest_root: the hash of the whole tree, as a hex string.
+ */
+extern void manifest_root(struct manifest *m, char hex[SHA256_HEX_LENGTH]);
+
+/*
+ * manifest_write: write the manifest to path, for the database at db_path
+ * as it is now. Returns 0, or -1 (and sets errno).
+ */
+extern int manifest_write(struct manifest *m, const char *path, const char *db_path);
+
+/*
+ * Called by manifest_diff for each package that differs; src or dst is NULL
+ * if the package is only in the other manifest. A non-zero result stops
+ * the comparison.
+ */
+typedef int (*manifest_callback)(const struct manifest_record *src, const struct manifest_record *dst,
+                                 void *data);
+
+/*
+ * manifest_diff: call callback for every package that is not the same in
+ * src and dst, in no particular order, visiting only the subtrees whose
+ * hashes differ. Returns the number of packages that differ, or -1 if the
+ * callback stopped the comparison.
+ */
+extern int manifest_diff(struct manifest *src, struct manifest *dst, manifest_callback callback, void *data);
+
+#endif // MANIFEST_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,454 @@
+/*
+ * pkgindex.c
+ * Binary index of the package files in the repository, which is mapped
+ * into memory instead of reading the directory.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "pkgindex.h"
+#include "database.h"
+#include "hashmap.h"
+#include "vercmp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/string.h"
+
+#define PKGINDEX_MAGIC   "REPOIDX1"
+#define PKGINDEX_VERSION 1
+
+/* On-disk layout; all offsets are in bytes from the start of the file,
+ * except for strings, which are offsets into the string table. */
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;             // number of records
+    uint32_t ndirs;             // number of directory records
+    int32_t max_depth;
+    int64_t db_sec;             // modification time of the database
+    int64_t db_nsec;
+    uint64_t records;
+    uint64_t dirs;
+    uint64_t strings;
+    uint64_t strings_len;
+};
+
+struct index_record {
+    uint32_t name;
+    uint32_t version;
+    uint32_t arch;
+    uint32_t filename;
+    uint32_t path;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime;
+    uint8_t sha256[32];
+};
+
+struct index_dir {
+    uint32_t path;
+    uint32_t reserved;
+    int64_t sec;                // modification time, -1 if it was too recent
+    int64_t nsec;
+};
+
+struct pkgindex {
+    void *map;
+    size_t len;
+    const struct index_header *header;
+    const struct index_record *records;
+    const char *strings;
+};
+
+/* A package file while the index is being written. */
+struct write_entry {
+    char *name;
+    char *version;
+    char *arch;
+    const char *path;
+    const char *filename;
+    struct stat st;
+};
+
+/* Growing string table, which stores every distinct string once. */
+struct string_table {
+    char *data;
+    size_t len;
+    size_t cap;
+    HashMap *offsets;
+};
+
+static bool same_mtime(const struct stat *st, int64_t sec, int64_t nsec)
+{
+    return st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+/*
+ * pkgindex_valid: check the structure of the mapped index, so that nothing
+ * after this has to, and whether it is still up to date.
+ */
+static bool pkgindex_valid(const struct pkgindex *idx, const char *db_path, int max_depth)
+{
+    const struct index_header *h = idx->header;
+    const struct index_dir *dirs;
+    struct stat st;
+
+    if (idx->len < sizeof *h || memcmp(h->magic, PKGINDEX_MAGIC, 8) != 0
+        || h->version != PKGINDEX_VERSION || h->max_depth != max_depth)
+        return false;
+    if (h->records > idx->len || h->count > (idx->len - h->records) / sizeof (struct index_record)
+        || h->dirs > idx->len || h->ndirs > (idx->len - h->dirs) / sizeof (struct index_dir)
+        || h->strings > idx->len || h->strings_len == 0 || h->strings_len > idx->len - h->strings
+        || h->records % 8 != 0 || h->dirs % 8 != 0)
+        return false;
+    if (idx->strings[h->strings_len - 1] != '\0')
+        return false;
+
+    for (size_t i = 0; i < h->count; i++) {
+        const struct index_record *r = &idx->records[i];
+        if (r->name >= h->strings_len || r->version >= h->strings_len || r->arch >= h->strings_len
+            || r->filename >= h->strings_len || r->path >= h->strings_len)
+            return false;
+    }
+
+    if (db_path == NULL)
+        return true;
+    if (stat(db_path, &st) != 0 ? h->db_sec != 0 : !same_mtime(&st, h->db_sec, h->db_nsec))
+        return false;
+
+    dirs = (const struct index_dir *)((const char *)idx->map + h->dirs);
+    for (size_t i = 0; i < h->ndirs; i++) {
+        if (dirs[i].path >= h->strings_len || stat(idx->strings + dirs[i].path, &st) != 0
+            || !same_mtime(&st, dirs[i].sec, dirs[i].nsec))
+            return false;
+    }
+    return true;
+}
+
+struct pkgindex *pkgindex_open(const char *path, const char *db_path, int max_depth)
+{
+    debug_printf("pkgindex_open(%s)\n", path);
+
+    struct pkgindex *idx;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof (struct index_header)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    idx = malloc(sizeof *idx);
+    idx->map = map;
+    idx->len = st.st_size;
+    idx->header = map;
+    idx->records = (const struct index_record *)((const char *)map + idx->header->records);
+    idx->strings = (const char *)map + idx->header->strings;
+    if (!pkgindex_valid(idx, db_path, max_depth)) {
+        debug_puts("pkgindex_open: index is out of date");
+        pkgindex_close(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+void pkgindex_close(struct pkgindex *idx)
+{
+    if (idx == NULL)
+        return;
+    munmap(idx->map, idx->len);
+    free(idx);
+}
+
+size_t pkgindex_count(const struct pkgindex *idx)
+{
+    return idx->header->count;
+}
+
+void pkgindex_get(const struct pkgindex *idx, size_t i, struct pkgindex_entry *entry)
+{
+    const struct index_record *r = &idx->records[i];
+
+    entry->name = idx->strings + r->name;
+    entry->version = idx->strings + r->version;
+    entry->arch = idx->strings + r->arch;
+    entry->filename = idx->strings + r->filename;
+    entry->path = idx->strings + r->path;
+    entry->size = r->size;
+    entry->mtime = r->mtime;
+    entry->sha256 = r->sha256;
+}
+
+size_t pkgindex_lower_bound(const struct pkgindex *idx, const char *name)
+{
+    size_t lo = 0, hi = idx->header->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(idx->strings + idx->records[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+ssize_t pkgindex_find(const struct pkgindex *idx, const char *name)
+{
+    size_t i = pkgindex_lower_bound(idx, name);
+
+    if (i < idx->header->count && strcmp(idx->strings + idx->records[i].name, name) == 0)
+        return i;
+    return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static uint32_t string_offset(struct string_table *t, const char *str)
+{
+    void *found = hashmap_get(t->offsets, str);
+    size_t len;
+
+    if (found != NULL)
+        return (uint32_t)((uintptr_t)found - 1);
+
+    len = strlen(str) + 1;
+    if (t->len + len > t->cap) {
+        t->cap = (t->len + len) * 2;
+        t->data = realloc(t->data, t->cap);
+    }
+    memcpy(t->data + t->len, str, len);
+    hashmap_put(t->offsets, str, (void *)(uintptr_t)(t->len + 1));
+    t->len += len;
+    return (uint32_t)(t->len - len);
+}
+
+/*
+ * sha256_binary: convert a hexadecimal checksum; all zero if it is malformed.
+ */
+static void sha256_binary(const char *hex, uint8_t digest[32])
+{
+    memset(digest, 0, 32);
+    if (hex == NULL || strlen(hex) != 64)
+        return;
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2*i, "%2x", &byte) != 1) {
+            memset(digest, 0, 32);
+            return;
+        }
+        digest[i] = byte;
+    }
+}
+
+/*
+ * collect_checksum: package_callback mapping file names to checksums.
+ */
+static int collect_checksum(Package *pkg, void *data)
+{
+    if (pkg->filename != NULL && pkg->sha256sum != NULL && !hashmap_contains(data, pkg->filename)) {
+        char *sum = pkg->sha256sum;
+        pkg->sha256sum = NULL;
+        hashmap_put(data, cs_strclone(pkg->filename), sum);
+    }
+    package_free(pkg);
+    return 0;
+}
+
+static void free_checksums(HashMap *sums)
+{
+    hashmap_foreach(sums, e) {
+        free((char *)e->key);
+        free(e->value);
+    }
+    hashmap_free(sums, NULL);
+}
+
+/*
+ * compare_entries: order by name, the newest version first, then file name.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct write_entry *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp == 0)
+        cmp = vercmp(y->version, x->version);
+    if (cmp == 0)
+        cmp = strcmp(x->filename, y->filename);
+    return cmp;
+}
+
+/*
+ * too_recent: whether a file modified at mtime may have changed after the
+ * index was read at since, in the same tick of the clock that stamps files.
+ */
+static bool too_recent(const struct timespec *mtime, const struct timespec *since)
+{
+    return mtime->tv_sec > since->tv_sec
+           || (mtime->tv_sec == since->tv_sec && mtime->tv_nsec >= since->tv_nsec);
+}
+
+/*
+ * dir_record: the directory record for path, which is stored as too recent
+ * if it may have been modified since the directory was read.
+ */
+static int dir_record(struct string_table *t, const char *path, const struct timespec *since, struct index_dir *d)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return -1;
+    d->path = string_offset(t, path);
+    d->reserved = 0;
+    d->sec = st.st_mtim.tv_sec;
+    d->nsec = st.st_mtim.tv_nsec;
+    if (too_recent(&st.st_mtim, since))
+        d->sec = -1;
+    return 0;
+}
+
+int pkgindex_write(const char *path, const char *db_path, int max_depth,
+                   NodeStr *files, NodeStr *dirs, const struct timespec *since)
+{
+    debug_printf("pkgindex_write(%s)\n", path);
+
+    struct index_header h;
+    struct string_table t = { NULL, 0, 0, NULL };
+    struct write_entry *entries;
+    struct index_record *records;
+    struct index_dir *dir_records;
+    struct stat st;
+    HashMap *sums;
+    size_t count = 0, ndirs = list_length(dirs);
+    char *tmp_path;
+    FILE *out;
+    int retval = 0;
+
+    sums = hashmap_new(1024);
+    if (db_read(db_path, collect_checksum, sums) < 0 && errno != ENOENT) {
+        free_checksums(sums);
+        return -1;
+    }
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, PKGINDEX_MAGIC, 8);
+    h.version = PKGINDEX_VERSION;
+    h.max_depth = max_depth;
+    if (stat(db_path, &st) == 0) {
+        h.db_sec = too_recent(&st.st_mtim, since) ? -1 : st.st_mtim.tv_sec;
+        h.db_nsec = st.st_mtim.tv_nsec;
+    }
+
+    entries = malloc((list_length(files) + 1) * sizeof *entries);
+    for (NodeStr *iter = files; iter != NULL; iter = iter->next) {
+        struct write_entry *e = &entries[count];
+        const char *name = strrchr(iter->data, '/');
+
+        e->filename = name != NULL ? name + 1 : iter->data;
+        e->path = iter->data;
+        if (!package_parse_filename(e->filename, &e->name, &e->version, &e->arch))
+            continue;
+        if (stat(e->path, &e->st) != 0) {
+            free(e->name);
+            free(e->version);
+            free(e->arch);
+            continue;
+        }
+        count++;
+    }
+    qsort(entries, count, sizeof *entries, compare_entries);
+
+    /* the empty string comes first, so that offset 0 is always valid */
+    t.offsets = hashmap_new(4 * count + ndirs + 1);
+    string_offset(&t, "");
+
+    records = calloc(count + 1, sizeof *records);
+    for (size_t i = 0; i < count; i++) {
+        struct write_entry *e = &entries[i];
+        records[i].name = string_offset(&t, e->name);
+        records[i].version = string_offset(&t, e->version);
+        records[i].arch = string_offset(&t, e->arch);
+        records[i].filename = string_offset(&t, e->filename);
+        records[i].path = string_offset(&t, e->path);
+        records[i].size = e->st.st_size;
+        records[i].mtime = e->st.st_mtim.tv_sec;
+        sha256_binary(hashmap_get(sums, e->filename), records[i].sha256);
+    }
+
+    dir_records = calloc(ndirs + 1, sizeof *dir_records);
+    ndirs = 0;
+    for (NodeStr *iter = dirs; iter != NULL; iter = iter->next)
+        if (dir_record(&t, iter->data, since, &dir_records[ndirs]) == 0)
+            ndirs++;
+
+    h.count = count;
+    h.ndirs = ndirs;
+    h.records = sizeof h;
+    h.dirs = h.records + count * sizeof *records;
+    h.strings = h.dirs + ndirs * sizeof *dir_records;
+    h.strings_len = t.len;
+
+    tmp_path = cs_strcat(path, ".tmp");
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        retval = -1;
+    } else {
+        if (fwrite(&h, sizeof h, 1, out) != 1
+            || fwrite(records, sizeof *records, count, out) != count
+            || fwrite(dir_records, sizeof *dir_records, ndirs, out) != ndirs
+            || fwrite(t.data, 1, t.len, out) != t.len)
+            retval = -1;
+        if (fclose(out) != 0 || retval < 0 || rename(tmp_path, path) != 0) {
+            retval = -1;
+            unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+
+    // Cleanup:
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].name);
+        free(entries[i].version);
+        free(entries[i].arch);
+    }
+    free(entries);
+    free(records);
+    free(dir_records);
+    hashmap_free(t.offsets, NULL);
+    free(t.data);
+    free_checksums(sums);
+    return retval;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
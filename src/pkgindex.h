@@ -0,0 +1,107 @@
+/*
+ * pkgindex.h
+ * Binary index of the package files in the repository, which is mapped
+ * into memory instead of reading the directory.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PKGINDEX_H
+#define PKGINDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libcassava/list_str.h"
+
+/*
+ * The index file (<stem>.idx in STATE_DIR) consists of a header,
+ * fixed-size records sorted by package name and version, the directories
+ * that were read with their modification times, and a table of strings.
+ * It is valid as long as none of these directories and the database have
+ * been modified since it was written, which takes a stat() of each.
+ * It is kept in a hidden directory, which is not scanned for packages,
+ * as replacing it in db_dir would change the modification time of db_dir.
+ */
+
+/* A package file in the index; the strings point into the mapping. */
+struct pkgindex_entry {
+    const char *name;
+    const char *version;
+    const char *arch;
+    const char *filename;
+    const char *path;           // relative to db_dir
+    uint64_t size;
+    int64_t mtime;
+    const uint8_t *sha256;      // from the database, all zero if unknown
+};
+
+struct pkgindex;
+
+/*
+ * pkgindex_open: map the index at path read-only, provided that it is still
+ * valid for the database at db_path, with max_depth levels of subdirectories.
+ * Returns NULL if the index is missing, damaged or out of date.
+ * If db_path is NULL, the index is not checked for being up to date,
+ * which is meant for an index that was just written.
+ */
+extern struct pkgindex *pkgindex_open(const char *path, const char *db_path, int max_depth);
+
+/*
+ * pkgindex_close: unmap the index.
+ */
+extern void pkgindex_close(struct pkgindex *idx);
+
+/*
+ * pkgindex_count: the number of package files in the index.
+ */
+extern size_t pkgindex_count(const struct pkgindex *idx);
+
+/*
+ * pkgindex_get: fill in entry for the package file at position i.
+ */
+extern void pkgindex_get(const struct pkgindex *idx, size_t i, struct pkgindex_entry *entry);
+
+/*
+ * pkgindex_lower_bound: binary search for the first package file whose name
+ * is not less than name; all names starting with a prefix follow it.
+ * Returns pkgindex_count(idx) if there is none.
+ */
+extern size_t pkgindex_lower_bound(const struct pkgindex *idx, const char *name);
+
+/*
+ * pkgindex_find: binary search for the first package file of name.
+ * Returns its position, or -1 if there is none; the other files of the
+ * package follow it.
+ */
+extern ssize_t pkgindex_find(const struct pkgindex *idx, const char *name);
+
+/*
+ * pkgindex_write: write the index to path, for the package files in files
+ * and the directories in dirs that were read for them (relative to the
+ * current directory), taking the checksums from the database at db_path.
+ * since is the time of CLOCK_REALTIME_COARSE, which stamps the files, at
+ * which the directories were read: whatever was modified at that time or
+ * later cannot be trusted to have been seen, so the index is left to be
+ * rebuilt next time. Returns 0, or -1 (and sets errno).
+ */
+extern int pkgindex_write(const char *path, const char *db_path, int max_depth,
+                          NodeStr *files, NodeStr *dirs, const struct timespec *since);
+
+#endif // PKGINDEX_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,358 @@
+/*
+ * pool.c
+ * A content-addressed package pool shared by several repositories.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "pool.h"
+#include "fsutil.h"
+#include "hashmap.h"
+#include "sha256.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+#include "libcassava/string.h"
+#include "libcassava/system.h"
+
+static int make_dirs(const char *pool_dir)
+{
+    char *objects = cs_strvcat(pool_dir, "/" POOL_OBJECTS, NULL);
+    char *by_name = cs_strvcat(pool_dir, "/" POOL_BY_NAME, NULL);
+    int ret = 0;
+
+    if ((mkdir(pool_dir, 0755) != 0 && errno != EEXIST)
+     || (mkdir(objects, 0755) != 0 && errno != EEXIST)
+     || (mkdir(by_name, 0755) != 0 && errno != EEXIST))
+        ret = -1;
+
+    free(objects);
+    free(by_name);
+    return ret;
+}
+
+/*
+ * add_ref: remember that path is a reflink or copy of object, as such
+ * references are not visible in the link count of object. The device and
+ * inode of path are recorded with it, as a different file may take its
+ * place later on.
+ */
+static int add_ref(const char *object, const char *path)
+{
+    char *refs = cs_strcat(object, ".refs");
+    struct stat st;
+    FILE *out;
+    int ret = -1;
+
+    if (stat(path, &st) != 0) {
+        free(refs);
+        return -1;
+    }
+    out = fopen(refs, "a");
+    if (out != NULL) {
+        fprintf(out, "%llu %llu %s\n", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, path);
+        ret = fclose(out);
+    }
+    free(refs);
+    return ret;
+}
+
+/*
+ * link_object: (re)place path by a hardlink to object, or by a reflink if a
+ * hardlink is not possible, or by a copy as a last resort. If path has the
+ * same contents as object already, a copy would gain nothing, so path is
+ * then left alone and only recorded as a reference.
+ */
+static int link_object(const char *object, const char *path, bool identical)
+{
+    char *tmp = cs_strcat(path, ".pool");
+    bool hardlink = true;
+    int ret;
+
+    unlink(tmp);
+    ret = link(object, tmp);
+    if (ret != 0) {
+        hardlink = false;
+        ret = fs_clone(object, tmp);
+        if (ret != 0 && identical) {
+            unlink(tmp);
+            free(tmp);
+            return add_ref(object, path);
+        }
+        if (ret != 0)
+            ret = fs_copy(object, tmp);
+    }
+    if (ret == 0)
+        ret = rename(tmp, path);
+    if (ret != 0)
+        unlink(tmp);
+    else if (!hardlink)
+        ret = add_ref(object, path);
+
+    free(tmp);
+    return ret;
+}
+
+static int set_by_name(const char *pool_dir, const char *filename, const char *hex)
+{
+    char *link = cs_strvcat(pool_dir, "/" POOL_BY_NAME "/", filename, NULL);
+    char *tmp = cs_strcat(link, ".tmp");
+    char *target = cs_strvcat("../" POOL_OBJECTS "/", hex, NULL);
+    int ret;
+
+    unlink(tmp);
+    ret = symlink(target, tmp);
+    if (ret == 0)
+        ret = rename(tmp, link);
+
+    free(link);
+    free(tmp);
+    free(target);
+    return ret;
+}
+
+int pool_import(const char *pool_dir, const char *dir, const char *filename)
+{
+    debug_printf("pool_import(%s)\n", filename);
+
+    const char *base = strrchr(filename, '/');
+    char hex[SHA256_HEX_LENGTH];
+    struct stat st, ost;
+    char *path, *by_name, *object = NULL;
+    int ret = -1;
+
+    if (make_dirs(pool_dir) != 0)
+        return -1;
+
+    /* the file may be in a subdirectory, but by-name is flat */
+    base = base != NULL ? base + 1 : filename;
+    path = cs_strcat(dir, filename);
+    by_name = cs_strvcat(pool_dir, "/" POOL_BY_NAME "/", base, NULL);
+    if (stat(path, &st) != 0)
+        goto end;
+
+    /* already pooled: nothing to read or write */
+    if (st.st_nlink > 1 && stat(by_name, &ost) == 0
+        && ost.st_ino == st.st_ino && ost.st_dev == st.st_dev) {
+        ret = 0;
+        goto end;
+    }
+
+    if (sha256_file(path, hex) != 0)
+        goto end;
+    object = cs_strvcat(pool_dir, "/" POOL_OBJECTS "/", hex, NULL);
+
+    if (stat(object, &ost) != 0) {
+        /* new object: move the data into the pool by linking, or copy it
+         * if the pool lives on another filesystem */
+        if (link(path, object) == 0)
+            ret = 0;
+        else if (fs_copy(path, object) == 0)
+            ret = link_object(object, path, true);
+    } else if (ost.st_ino != st.st_ino || ost.st_dev != st.st_dev) {
+        /* the same package is pooled already: drop our copy */
+        ret = link_object(object, path, true);
+    } else {
+        ret = 0;
+    }
+
+    if (ret == 0)
+        ret = set_by_name(pool_dir, base, hex);
+
+end:
+    free(path);
+    free(by_name);
+    free(object);
+    return ret;
+}
+
+char *pool_find(const char *pool_dir, const char *pkg_name)
+{
+    debug_printf("pool_find(%s)\n", pkg_name);
+
+    char *by_name = cs_strvcat(pool_dir, "/" POOL_BY_NAME, NULL);
+    char *regex = cs_strvcat("^(", pkg_name, ")", PKG_EXT, NULL);
+    char *result = NULL;
+    time_t newest = 0;
+    NodeStr *head = NULL;
+
+    if (get_filenames_filter_regex(by_name, &head, regex) > 0) {
+        for (NodeStr *iter = head; iter != NULL; iter = iter->next) {
+            struct stat st;
+            char *path = cs_strvcat(by_name, "/", iter->data, NULL);
+            if (stat(path, &st) == 0 && (result == NULL || st.st_mtime > newest)) {
+                result = iter->data;
+                newest = st.st_mtime;
+            }
+            free(path);
+        }
+        result = result != NULL ? cs_strclone(result) : NULL;
+    }
+
+    list_free_all(&head);
+    free(regex);
+    free(by_name);
+    return result;
+}
+
+int pool_link(const char *pool_dir, const char *filename, const char *dir)
+{
+    debug_printf("pool_link(%s)\n", filename);
+
+    char target[PATH_MAX];
+    char *by_name = cs_strvcat(pool_dir, "/" POOL_BY_NAME "/", filename, NULL);
+    char *path = cs_strcat(dir, filename);
+    char *object = NULL;
+    ssize_t len;
+    int ret = -1;
+
+    len = readlink(by_name, target, sizeof target - 1);
+    if (len > 0) {
+        target[len] = '\0';
+        object = cs_strvcat(pool_dir, "/" POOL_BY_NAME "/", target, NULL);
+        ret = link_object(object, path, false);
+    }
+
+    free(by_name);
+    free(path);
+    free(object);
+    return ret;
+}
+
+/*
+ * ref_alive: whether the reference in line (see add_ref) is still the file
+ * that was recorded. Lines with nothing but a path predate the device and
+ * inode, so the contents of the file are compared with the object.
+ */
+static bool ref_alive(const char *object, char *line)
+{
+    unsigned long long dev, ino;
+    char hex[SHA256_HEX_LENGTH];
+    struct stat rst;
+    int offset;
+
+    if (sscanf(line, "%llu %llu %n", &dev, &ino, &offset) == 2)
+        return stat(line + offset, &rst) == 0 && rst.st_dev == dev && rst.st_ino == ino;
+    return sha256_file(line, hex) == 0 && strcmp(hex, cs_basename(object)) == 0;
+}
+
+/*
+ * object_referenced: an object is in use if a repository holds a hardlink
+ * to it, or if one of its recorded reflinks still exists.
+ */
+static bool object_referenced(const char *object, const struct stat *st)
+{
+    char line[PATH_MAX + 64];
+    char *refs;
+    bool used = false;
+    FILE *in;
+
+    if (st->st_nlink > 1)
+        return true;
+
+    refs = cs_strcat(object, ".refs");
+    in = fopen(refs, "r");
+    free(refs);
+    if (in == NULL)
+        return false;
+
+    while (!used && fgets(line, sizeof line, in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        used = ref_alive(object, line);
+    }
+    fclose(in);
+    return used;
+}
+
+static bool is_object_name(const char *name)
+{
+    return strlen(name) == SHA256_HEX_LENGTH - 1 && strspn(name, "0123456789abcdef") == SHA256_HEX_LENGTH - 1;
+}
+
+int pool_unreferenced(const char *pool_dir, NodeStr **head)
+{
+    debug_puts("pool_unreferenced()");
+
+    char *objects = cs_strvcat(pool_dir, "/" POOL_OBJECTS, NULL);
+    char *by_name = cs_strvcat(pool_dir, "/" POOL_BY_NAME, NULL);
+    HashMap *unused = hashmap_new(64);
+    NodeStr *names = NULL, *links = NULL;
+    int count = 0;
+
+    *head = NULL;
+    if (get_filenames(objects, &names) < 0) {
+        count = -1;
+        goto end;
+    }
+
+    for (NodeStr *iter = names; iter != NULL; iter = iter->next) {
+        struct stat st;
+        if (!is_object_name(iter->data))
+            continue;
+
+        char *path = cs_strvcat(objects, "/", iter->data, NULL);
+        if (stat(path, &st) == 0 && !object_referenced(path, &st)) {
+            char *refs = cs_strcat(path, ".refs");
+            if (access(refs, F_OK) == 0)
+                list_push(head, refs);
+            else
+                free(refs);
+            list_push(head, path);
+            hashmap_put(unused, iter->data, NULL);
+            count++;
+        } else {
+            free(path);
+        }
+    }
+
+    /* by-name entries of removed objects, and those that are dangling */
+    if (count > 0 && get_filenames(by_name, &links) > 0) {
+        for (NodeStr *iter = links; iter != NULL; iter = iter->next) {
+            char target[PATH_MAX];
+            char *path = cs_strvcat(by_name, "/", iter->data, NULL);
+            ssize_t len = readlink(path, target, sizeof target - 1);
+            if (len > 0) {
+                target[len] = '\0';
+                if (hashmap_contains(unused, cs_basename(target))) {
+                    list_push(head, path);
+                    continue;
+                }
+            }
+            free(path);
+        }
+        list_free_all(&links);
+    }
+    list_free_all(&names);
+
+end:
+    hashmap_free(unused, NULL);
+    free(objects);
+    free(by_name);
+    return count;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
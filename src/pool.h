@@ -0,0 +1,71 @@
+/*
+ * pool.h
+ * A content-addressed package pool shared by several repositories.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "libcassava/list_str.h"
+
+/*
+ * The pool directory has the following layout:
+ *
+ *   objects/<sha256>        the package data, stored once
+ *   objects/<sha256>.refs   repository files that are reflinks (or copies)
+ *                           of the object, one per line as
+ *                           "<device> <inode> <absolute path>"
+ *   by-name/<filename>      symlink to ../objects/<sha256>
+ *
+ * The files in each db_dir are hardlinks to the objects wherever possible,
+ * so the link count of an object tells whether it is still in use.
+ */
+#define POOL_OBJECTS    "objects"
+#define POOL_BY_NAME    "by-name"
+
+/*
+ * pool_import: put the package file dir/filename into the pool, and replace
+ * it by a link to the pooled object. If an identical object is pooled
+ * already, the file is deduplicated against it.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int pool_import(const char *pool_dir, const char *dir, const char *filename);
+
+/*
+ * pool_find: find the newest package file for pkg_name in the pool.
+ * Returns the file name, or NULL if there is none.
+ * Warning: you must call free() on the result of this function.
+ */
+extern char *pool_find(const char *pool_dir, const char *pkg_name);
+
+/*
+ * pool_link: create dir/filename as a link to the pooled package filename,
+ * which costs no data I/O unless dir is on another filesystem.
+ * Returns 0, or -1 (and sets errno).
+ */
+extern int pool_link(const char *pool_dir, const char *filename, const char *dir);
+
+/*
+ * pool_unreferenced: collect the paths of all objects in the pool that no
+ * repository refers to anymore, together with their refs and by-name entries.
+ * Returns: the number of unreferenced objects, or -1 on error.
+ */
+extern int pool_unreferenced(const char *pool_dir, NodeStr **head);
+
+#endif // POOL_H
+
+/* vim: set cin ts=4 sw=4 et: */
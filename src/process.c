@@ -0,0 +1,250 @@
+/*
+ * process.c
+ * Running programs directly, without a shell, and capturing their output.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "repo.h"
+#include "process.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+
+#define PROCESS_POLL      100     // milliseconds between checks on the programs
+#define PROCESS_CHUNK     4096    // bytes of output read at a time
+
+extern char **environ;
+
+struct running {
+    struct process_job *job;
+    pid_t pid;              // 0 if the slot is free
+    int fd;                 // read end of its output, -1 once closed
+    size_t size;            // allocated size of job->output
+};
+
+/*
+ * start_job: spawn the program of the job with a pipe on its stdout and stderr.
+ */
+static int start_job(struct process_job *job, struct running *run)
+{
+    debug_printf("start_job(%s)\n", job->argv[0]);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    int fds[2], err;
+
+    /* the other programs must not inherit the pipe, or it would never close */
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+
+    /* repo may be ignoring SIGPIPE, which must not be inherited */
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+    err = posix_spawnp(&run->pid, job->argv[0], &actions, &attr, job->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        run->pid = 0;
+        errno = err;
+        return -1;
+    }
+
+    run->job = job;
+    run->fd = fds[0];
+    run->size = 0;
+    fcntl(run->fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * read_output: append what the program has written so far to its output;
+ * the pipe is closed at the end of the output.
+ */
+static void read_output(struct running *run)
+{
+    struct process_job *job = run->job;
+    ssize_t n;
+
+    while (run->fd >= 0) {
+        if (run->size - job->len < PROCESS_CHUNK + 1) {
+            run->size = run->size * 2 + PROCESS_CHUNK + 1;
+            job->output = realloc(job->output, run->size);
+        }
+        n = read(run->fd, job->output + job->len, run->size - job->len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            close(run->fd);
+            run->fd = -1;
+            break;
+        }
+        job->len += n;
+    }
+    if (job->output != NULL)
+        job->output[job->len] = '\0';
+}
+
+/*
+ * reap_job: check whether the program has finished, waiting for it if
+ * block, and collect the rest of its output if it has.
+ * Returns 1 if it has finished and failed, 0 otherwise.
+ */
+static int reap_job(struct running *run, bool block)
+{
+    struct process_job *job = run->job;
+    int status;
+
+    if (waitpid(run->pid, &status, block ? 0 : WNOHANG) != run->pid)
+        return 0;
+    run->pid = 0;
+
+    /* a process it started may hold on to the pipe; take what is there */
+    read_output(run);
+    if (run->fd >= 0) {
+        close(run->fd);
+        run->fd = -1;
+    }
+
+    job->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    debug_printf("reap_job(%s): %d\n", job->argv[0], job->status);
+    return job->status != 0;
+}
+
+int process_all(struct process_job *jobs, size_t count, int max)
+{
+    debug_printf("process_all(%zu, %d)\n", count, max);
+
+    struct running *run;
+    struct pollfd *fds;
+    size_t next = 0;
+    int active = 0, failed = 0, saved = 0;
+
+    /* no more slots than programs, but at least one */
+    if ((size_t)max > count)
+        max = count;
+    if (max < 1)
+        max = 1;
+    run = calloc(max, sizeof (struct running));
+    fds = calloc(max, sizeof (struct pollfd));
+
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].output = NULL;
+        jobs[i].len = 0;
+        jobs[i].status = -1;
+    }
+
+    while (next < count || active > 0) {
+        /* keep max programs busy */
+        for (int slot = 0; slot < max && next < count && saved == 0; slot++) {
+            if (run[slot].pid != 0)
+                continue;
+            if (start_job(&jobs[next], &run[slot]) != 0) {
+                saved = errno;
+                break;
+            }
+            next++;
+            active++;
+        }
+        if (active == 0)
+            break;
+
+        /* a negative fd is ignored by poll */
+        for (int slot = 0; slot < max; slot++) {
+            fds[slot].fd = run[slot].pid != 0 ? run[slot].fd : -1;
+            fds[slot].events = POLLIN;
+        }
+        if (poll(fds, max, PROCESS_POLL) < 0 && errno != EINTR) {
+            saved = errno;
+            break;
+        }
+
+        for (int slot = 0; slot < max; slot++) {
+            if (run[slot].pid == 0)
+                continue;
+            if (run[slot].fd >= 0 && fds[slot].revents != 0) {
+                read_output(&run[slot]);
+                /* once its output is closed, the program is about to exit;
+                 * if it has not yet, the next round of polling gets it */
+                if (run[slot].fd < 0) {
+                    failed += reap_job(&run[slot], false);
+                    if (run[slot].pid == 0)
+                        active--;
+                    continue;
+                }
+            }
+            if (run[slot].fd < 0 || fds[slot].revents == 0) {
+                failed += reap_job(&run[slot], false);
+                if (run[slot].pid == 0)
+                    active--;
+            }
+        }
+    }
+
+    /* if poll failed, the programs still running are left to finish; their
+     * pipes are closed first, so that none of them blocks on a full one */
+    for (int slot = 0; slot < max; slot++) {
+        if (run[slot].pid == 0)
+            continue;
+        read_output(&run[slot]);
+        if (run[slot].fd >= 0) {
+            close(run[slot].fd);
+            run[slot].fd = -1;
+        }
+        failed += reap_job(&run[slot], true);
+    }
+
+    free(fds);
+    free(run);
+    if (saved != 0) {
+        errno = saved;
+        return -1;
+    }
+    return failed;
+}
+
+int process_run(struct process_job *job)
+{
+    if (process_all(job, 1, 1) < 0)
+        return -1;
+    return job->status;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
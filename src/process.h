@@ -0,0 +1,54 @@
+/*
+ * process.h
+ * Running programs directly, without a shell, and capturing their output.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdlib.h>
+
+struct process_job {
+    char **argv;            // the program and its arguments, NULL terminated
+    char *output;           // what it wrote to stdout and stderr, NUL terminated; NULL if not run
+    size_t len;             // length of output
+    int status;             // exit status, 128 + signal if killed, -1 if not run
+};
+
+/*
+ * process_all: run the count programs in jobs, up to max of them at the same
+ * time. Each argv[0] is run with posix_spawn and searched in PATH if it has
+ * no slash; no shell sees the arguments, so they may contain anything.
+ * The output of each program is captured in its job, so that programs that
+ * run at the same time do not mix their output; the output of every job is
+ * set, and must be freed, even when something fails.
+ * Returns the number of programs that did not exit with status 0, or -1
+ * (and sets errno) if a program could not be started; in that case, the
+ * programs that are running are waited for, and no more are started.
+ */
+extern int process_all(struct process_job *jobs, size_t count, int max);
+
+/*
+ * process_run: run a single program like process_all.
+ * Returns its exit status, or -1 (and sets errno) if it could not be started.
+ */
+extern int process_run(struct process_job *job);
+
+#endif // PROCESS_H
+
+/* vim: set cin ts=4 sw=4 et: */
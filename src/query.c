@@ -0,0 +1,492 @@
+/*
+ * query.c
+ * Columnar in-memory index over the fields of a database, for queries.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "query.h"
+#include "database.h"
+#include "vercmp.h"
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+
+enum field {
+    field_name,
+    field_version,
+    field_depends,
+    field_provides,
+    field_csize,
+    field_isize,
+    field_builddate,
+    field_packager,
+    field_count
+};
+
+static const char *field_names[field_count] = {
+    "name", "version", "depends", "provides", "csize", "isize", "builddate", "packager"
+};
+
+enum field_type { type_string, type_version, type_list, type_size, type_date };
+
+static const enum field_type field_types[field_count] = {
+    type_string, type_version, type_list, type_list, type_size, type_size, type_date, type_string
+};
+
+enum op { op_eq, op_ne, op_match, op_lt, op_le, op_gt, op_ge };
+
+struct predicate {
+    enum field field;
+    enum op op;
+    const char *value;
+    long long number;       // value, for sizes and dates
+};
+
+/* A list field: the entries of row i are items[offsets[i]] to items[offsets[i+1]-1]. */
+struct list_column {
+    size_t *offsets;
+    char **items;
+    size_t len;
+    size_t cap;
+};
+
+struct query_index {
+    size_t count;
+    size_t cap;
+    char **name;
+    char **version;
+    char **packager;
+    long long *csize;
+    long long *isize;
+    long long *builddate;
+    struct list_column depends;
+    struct list_column provides;
+};
+
+/*
+ * append_list: take the entries of list and add them as the next row of col.
+ */
+static void append_list(struct list_column *col, size_t row, NodeStr *list)
+{
+    for (NodeStr *iter = list; iter != NULL; iter = iter->next) {
+        if (col->len == col->cap) {
+            col->cap = col->cap > 0 ? 2 * col->cap : 1024;
+            col->items = realloc(col->items, col->cap * sizeof (char *));
+        }
+        col->items[col->len++] = iter->data;
+        iter->data = NULL;
+    }
+    col->offsets[row + 1] = col->len;
+}
+
+static int index_package(Package *pkg, void *data)
+{
+    struct query_index *idx = data;
+    size_t row = idx->count;
+
+    if (idx->count == idx->cap) {
+        idx->cap = idx->cap > 0 ? 2 * idx->cap : 256;
+        idx->name = realloc(idx->name, idx->cap * sizeof (char *));
+        idx->version = realloc(idx->version, idx->cap * sizeof (char *));
+        idx->packager = realloc(idx->packager, idx->cap * sizeof (char *));
+        idx->csize = realloc(idx->csize, idx->cap * sizeof (long long));
+        idx->isize = realloc(idx->isize, idx->cap * sizeof (long long));
+        idx->builddate = realloc(idx->builddate, idx->cap * sizeof (long long));
+        idx->depends.offsets = realloc(idx->depends.offsets, (idx->cap + 1) * sizeof (size_t));
+        idx->provides.offsets = realloc(idx->provides.offsets, (idx->cap + 1) * sizeof (size_t));
+    }
+
+    /* the strings move into the index, so that nothing has to be copied */
+    idx->name[row] = pkg->name != NULL ? pkg->name : calloc(1, 1);
+    idx->version[row] = pkg->version != NULL ? pkg->version : calloc(1, 1);
+    idx->packager[row] = pkg->packager != NULL ? pkg->packager : calloc(1, 1);
+    pkg->name = pkg->version = pkg->packager = NULL;
+    idx->csize[row] = pkg->csize;
+    idx->isize[row] = pkg->isize;
+    idx->builddate[row] = pkg->builddate;
+    append_list(&idx->depends, row, pkg->depends);
+    append_list(&idx->provides, row, pkg->provides);
+    idx->count++;
+
+    package_free(pkg);
+    return 0;
+}
+
+struct query_index *query_load(const char *path)
+{
+    debug_printf("query_load(%s)\n", path);
+
+    struct query_index *idx = calloc(1, sizeof (struct query_index));
+
+    idx->depends.offsets = calloc(1, sizeof (size_t));
+    idx->provides.offsets = calloc(1, sizeof (size_t));
+    if (db_read(path, index_package, idx) < 0) {
+        query_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static void free_list_column(struct list_column *col)
+{
+    for (size_t i = 0; i < col->len; i++)
+        free(col->items[i]);
+    free(col->items);
+    free(col->offsets);
+}
+
+void query_free(struct query_index *idx)
+{
+    if (idx == NULL)
+        return;
+
+    for (size_t i = 0; i < idx->count; i++) {
+        free(idx->name[i]);
+        free(idx->version[i]);
+        free(idx->packager[i]);
+    }
+    free(idx->name);
+    free(idx->version);
+    free(idx->packager);
+    free(idx->csize);
+    free(idx->isize);
+    free(idx->builddate);
+    free_list_column(&idx->depends);
+    free_list_column(&idx->provides);
+    free(idx);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int parse_field(const char *text, size_t len)
+{
+    for (int f = 0; f < field_count; f++)
+        if (strlen(field_names[f]) == len && strncasecmp(text, field_names[f], len) == 0)
+            return f;
+    return -1;
+}
+
+/*
+ * parse_number: read a size with an optional K, M or G suffix (powers of
+ * 1024), or a date as YYYY-MM-DD or seconds since the epoch.
+ */
+static bool parse_number(const char *text, enum field_type type, long long *number)
+{
+    char *end;
+
+    if (type == type_date) {
+        struct tm tm;
+        memset(&tm, 0, sizeof tm);
+        end = strptime(text, "%Y-%m-%d", &tm);
+        if (end != NULL && *end == '\0') {
+            tm.tm_isdst = -1;
+            *number = mktime(&tm);
+            return true;
+        }
+    }
+
+    *number = strtoll(text, &end, 10);
+    if (end == text)
+        return false;
+    if (type == type_size && *end != '\0' && end[1] == '\0') {
+        const char *suffix = strchr("KMGT", toupper((unsigned char)*end));
+        if (suffix == NULL)
+            return false;
+        for (const char *s = "KMGT"; s <= suffix; s++)
+            *number *= 1024;
+        end++;
+    }
+    return *end == '\0';
+}
+
+static bool parse_predicate(const char *text, struct predicate *pred)
+{
+    static const struct { const char *str; enum op op; } ops[] = {
+        { "!=", op_ne }, { "<=", op_le }, { ">=", op_ge },
+        { "=", op_eq }, { "~", op_match }, { "<", op_lt }, { ">", op_gt }
+    };
+    size_t len = strspn(text, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ");
+    int field = parse_field(text, len);
+    enum field_type type;
+
+    if (field < 0) {
+        fprintf(stderr, "Error: unknown field in '%s'; use one of: name, version, depends, "
+                        "provides, csize, isize, builddate, packager\n", text);
+        return false;
+    }
+    pred->field = field;
+    type = field_types[field];
+
+    size_t i;
+    for (i = 0; i < sizeof ops / sizeof ops[0]; i++)
+        if (strncmp(text + len, ops[i].str, strlen(ops[i].str)) == 0)
+            break;
+    if (i == sizeof ops / sizeof ops[0]) {
+        fprintf(stderr, "Error: missing operator in '%s'\n", text);
+        return false;
+    }
+    pred->op = ops[i].op;
+    pred->value = text + len + strlen(ops[i].str);
+
+    if (type == type_list && pred->op != op_eq && pred->op != op_ne && pred->op != op_match) {
+        fprintf(stderr, "Error: %s can only be compared with =, != and ~\n", field_names[field]);
+        return false;
+    }
+    if ((type == type_size || type == type_date) && pred->op != op_match
+        && !parse_number(pred->value, type, &pred->number)) {
+        fprintf(stderr, "Error: invalid %s in '%s'\n", type == type_date ? "date" : "size", text);
+        return false;
+    }
+    return true;
+}
+
+static const char *string_at(const struct query_index *idx, enum field field, size_t row)
+{
+    switch (field) {
+        case field_name:        return idx->name[row];
+        case field_version:     return idx->version[row];
+        case field_packager:    return idx->packager[row];
+        default:                return NULL;
+    }
+}
+
+static long long number_at(const struct query_index *idx, enum field field, size_t row)
+{
+    switch (field) {
+        case field_csize:       return idx->csize[row];
+        case field_isize:       return idx->isize[row];
+        case field_builddate:   return idx->builddate[row];
+        default:                return 0;
+    }
+}
+
+/* list_entry_equals: whether a depends or provides entry such as "foo>=1.2" is value. */
+static bool list_entry_equals(const char *entry, const char *value)
+{
+    size_t len = strcspn(entry, "<>=");
+    return strcmp(entry, value) == 0 || (strlen(value) == len && strncmp(entry, value, len) == 0);
+}
+
+static bool compare_op(enum op op, int cmp)
+{
+    switch (op) {
+        case op_eq: return cmp == 0;
+        case op_ne: return cmp != 0;
+        case op_lt: return cmp < 0;
+        case op_le: return cmp <= 0;
+        case op_gt: return cmp > 0;
+        case op_ge: return cmp >= 0;
+        default:    return false;
+    }
+}
+
+/*
+ * filter: keep only the n rows that match pred, and return how many are left.
+ * Each case only reads the one column it is about.
+ */
+static size_t filter(const struct query_index *idx, const struct predicate *pred, size_t *rows, size_t n)
+{
+    enum field_type type = field_types[pred->field];
+    size_t kept = 0;
+
+    if (type == type_list) {
+        const struct list_column *col = pred->field == field_depends ? &idx->depends : &idx->provides;
+        for (size_t i = 0; i < n; i++) {
+            bool found = false;
+            for (size_t j = col->offsets[rows[i]]; j < col->offsets[rows[i] + 1] && !found; j++)
+                found = pred->op == op_match ? fnmatch(pred->value, col->items[j], 0) == 0
+                                             : list_entry_equals(col->items[j], pred->value);
+            if (found == (pred->op != op_ne))
+                rows[kept++] = rows[i];
+        }
+    } else if (pred->op == op_match) {
+        char buf[32];
+        for (size_t i = 0; i < n; i++) {
+            const char *str = string_at(idx, pred->field, rows[i]);
+            if (str == NULL) {
+                snprintf(buf, sizeof buf, "%lld", number_at(idx, pred->field, rows[i]));
+                str = buf;
+            }
+            if (fnmatch(pred->value, str, 0) == 0)
+                rows[kept++] = rows[i];
+        }
+    } else if (type == type_size || type == type_date) {
+        for (size_t i = 0; i < n; i++) {
+            long long value = number_at(idx, pred->field, rows[i]);
+            if (compare_op(pred->op, (value > pred->number) - (value < pred->number)))
+                rows[kept++] = rows[i];
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            const char *str = string_at(idx, pred->field, rows[i]);
+            int cmp = type == type_version ? vercmp(str, pred->value) : strcmp(str, pred->value);
+            if (compare_op(pred->op, cmp))
+                rows[kept++] = rows[i];
+        }
+    }
+    return kept;
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct sort_key {
+    union {
+        const char *str;
+        long long number;
+    } key;
+    size_t row;
+};
+
+static int compare_number_keys(const void *a, const void *b)
+{
+    const struct sort_key *x = a, *y = b;
+    if (x->key.number != y->key.number)
+        return x->key.number < y->key.number ? -1 : 1;
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+static int compare_string_keys(const void *a, const void *b)
+{
+    const struct sort_key *x = a, *y = b;
+    int cmp = strcmp(x->key.str, y->key.str);
+    return cmp != 0 ? cmp : x->row < y->row ? -1 : x->row > y->row;
+}
+
+static int compare_version_keys(const void *a, const void *b)
+{
+    const struct sort_key *x = a, *y = b;
+    int cmp = vercmp(x->key.str, y->key.str);
+    return cmp != 0 ? cmp : x->row < y->row ? -1 : x->row > y->row;
+}
+
+/*
+ * sort_rows: sort the rows by field; the keys are gathered into one array
+ * first, so that the comparisons do not have to go through the index.
+ */
+static void sort_rows(const struct query_index *idx, enum field field, bool descending, size_t *rows, size_t n)
+{
+    enum field_type type = field_types[field];
+    struct sort_key *keys = malloc(n * sizeof (struct sort_key));
+
+    for (size_t i = 0; i < n; i++) {
+        keys[i].row = rows[i];
+        if (type == type_size || type == type_date)
+            keys[i].key.number = number_at(idx, field, rows[i]);
+        else
+            keys[i].key.str = string_at(idx, field, rows[i]);
+    }
+    qsort(keys, n, sizeof (struct sort_key),
+          type == type_version ? compare_version_keys :
+          type == type_string ? compare_string_keys : compare_number_keys);
+
+    for (size_t i = 0; i < n; i++)
+        rows[i] = keys[descending ? n - 1 - i : i].row;
+    free(keys);
+}
+
+static void print_rows(const struct query_index *idx, const size_t *rows, size_t n,
+                       const bool *shown, FILE *out)
+{
+    int name_width = 0, version_width = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int len = strlen(idx->name[rows[i]]);
+        if (len > name_width)
+            name_width = len;
+        len = strlen(idx->version[rows[i]]);
+        if (len > version_width)
+            version_width = len;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        size_t row = rows[i];
+        fprintf(out, "%-*s %-*s", name_width, idx->name[row], version_width, idx->version[row]);
+        if (shown[field_csize])
+            fprintf(out, " %12lld", idx->csize[row]);
+        if (shown[field_isize])
+            fprintf(out, " %12lld", idx->isize[row]);
+        if (shown[field_builddate]) {
+            char date[32];
+            time_t t = idx->builddate[row];
+            strftime(date, sizeof date, "%Y-%m-%d", localtime(&t));
+            fprintf(out, " %s", date);
+        }
+        if (shown[field_packager])
+            fprintf(out, " %s", idx->packager[row]);
+        fputc('\n', out);
+    }
+}
+
+int query_run(const struct query_index *idx, char **predicates, int count, const char *sort, FILE *out)
+{
+    debug_puts("query_run()");
+
+    struct predicate *preds = malloc((count + 1) * sizeof (struct predicate));
+    bool shown[field_count] = { false };
+    bool descending = false;
+    int sort_field = -1;
+    size_t *rows, n;
+
+    for (int i = 0; i < count; i++) {
+        if (!parse_predicate(predicates[i], &preds[i])) {
+            free(preds);
+            return -1;
+        }
+        shown[preds[i].field] = true;
+    }
+    if (sort != NULL) {
+        if (*sort == '-') {
+            descending = true;
+            sort++;
+        }
+        sort_field = parse_field(sort, strlen(sort));
+        if (sort_field < 0 || field_types[sort_field] == type_list) {
+            fprintf(stderr, "Error: cannot sort by '%s'\n", sort);
+            free(preds);
+            return -1;
+        }
+        shown[sort_field] = true;
+    }
+
+    /* every predicate narrows down the selection of rows */
+    n = idx->count;
+    rows = malloc((n + 1) * sizeof (size_t));
+    for (size_t i = 0; i < n; i++)
+        rows[i] = i;
+    for (int i = 0; i < count && n > 0; i++)
+        n = filter(idx, &preds[i], rows, n);
+
+    if (sort_field >= 0)
+        sort_rows(idx, sort_field, descending, rows, n);
+    print_rows(idx, rows, n, shown, out);
+
+    free(rows);
+    free(preds);
+    return n;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
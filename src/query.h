@@ -0,0 +1,63 @@
+/*
+ * query.h
+ * Columnar in-memory index over the fields of a database, for queries.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+
+/*
+ * The index holds one array per field (name, version, depends, provides,
+ * csize, isize, builddate, packager), so that a predicate only touches the
+ * column it is about. The list fields depends and provides are stored as
+ * one flat array of strings with an offset per package.
+ */
+struct query_index;
+
+/*
+ * query_load: read the database at path into a new index.
+ * Returns NULL (and sets errno) if the database could not be read.
+ */
+extern struct query_index *query_load(const char *path);
+
+/*
+ * query_free: free the index and everything it contains.
+ */
+extern void query_free(struct query_index *idx);
+
+/*
+ * query_run: print the packages in idx that match all predicates to out,
+ * ordered by the field sort (descending if it starts with '-'), or in
+ * database order if sort is NULL.
+ *
+ * A predicate has the form <field><op><value>, where op is one of
+ *   =  !=     equal (for depends and provides: any entry, ignoring versions)
+ *   ~         matches the shell pattern value (see fnmatch)
+ *   < <= > >= compares by version, size or date (e.g. isize>10M, or
+ *             builddate<2012-01-01)
+ *
+ * Returns: the number of matching packages, or -1 if a predicate or the
+ * sort field is invalid (an error message is printed).
+ */
+extern int query_run(const struct query_index *idx, char **predicates, int count,
+                     const char *sort, FILE *out);
+
+#endif // QUERY_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -18,9 +18,13 @@
 
 #include "repo.h"
 #include "actions.h"
+#include "background.h"
 
 #include <argp.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,7 +39,7 @@
 const char *argp_program_version = REPO_VERSION_STRING;
 const char *argp_program_bug_address = "<neembi@googlemail.com>";
 
-static char args_doc[] = "<add|list|remove|update|sync> [PACKAGES ...]";
+static char args_doc[] = "<add|check|ingest|list|log|manifest|query|rdeps|remove|replicate|snapshot|split|update|sync|rollback|clean|gc|serve> [PACKAGES ...]";
 static char doc[] =
     "Manage local pacman repositories.\n"
     "\n"
@@ -45,36 +49,193 @@ static char doc[] =
     "                   finding in the same directory of the database the latest\n"
     "                   file for that package (by file modification date),\n"
     "                   deleting the others, and updating the database.\n"
-    "  list             List all the packages that are currently available.\n"
+    "  list [<prefix>]  List all the packages that are currently available, or\n"
+    "                   only those whose name starts with <prefix>; see --names.\n"
+    "  query [<field><op><value> ...]\n"
+    "                   List the packages in the database that match all the\n"
+    "                   given predicates, e.g. depends=glibc, provides~libfoo.so*\n"
+    "                   or isize>10M; see --sort. The fields are name, version,\n"
+    "                   depends, provides, csize, isize, builddate and packager,\n"
+    "                   and op is one of =, !=, ~ (pattern), <, <=, > and >=.\n"
+    "  rdeps <pkgname>  Print the packages that need to be rebuilt when <pkgname>\n"
+    "                   changes, by depends, provides and sonames, in the order\n"
+    "                   in which to rebuild them.\n"
     "  remove <pkgname> Remove the package with <pkgname> from the database, by\n"
     "                   removing its entry from the database and deleting the files\n"
-    "                   that belong to it.\n"
+    "                   that belong to it. Packages still needed by others are\n"
+    "                   only removed after confirmation.\n"
+    "  ingest <dir>     Move the packages (and their signatures) in <dir>, such as\n"
+    "                   PKGDEST, into the database directory and add them; they\n"
+    "                   are only copied if <dir> is on another filesystem.\n"
+    "  snapshot [<name>]\n"
+    "                   Take a snapshot of the database and its packages as hard\n"
+    "                   links, or go back to it with --restore; list them all\n"
+    "                   without a name.\n"
+    "  split            Write a database <name>-<arch>.db for each architecture\n"
+    "                   of the packages in the directory, in a single scan; the\n"
+    "                   packages for any go into all of them.\n"
     "  update           Same as add, except scan and add changed packages.\n"
-    "  synchronize      Compare packages in the database to AUR for new versions.\n"
+    "  synchronize      Compare packages in the database to AUR for new versions,\n"
+    "                   as listed by the metadata dump given with --metadata,\n"
+    "                   and/or to the official repositories with --official.\n"
+    "  rollback <pkgname>[=<version>]\n"
+    "                   Go back to the previous version of the package, or the\n"
+    "                   given version, from the archive directory (keep_versions\n"
+    "                   in the configuration file).\n"
+    "  clean            Delete files that are not in the database, or that are\n"
+    "                   superseded by the version in the database, and remove\n"
+    "                   packages whose files are missing from the database.\n"
+    "  check            Verify that the file of every package in the database\n"
+    "                   has the size and checksum recorded there, reporting\n"
+    "                   missing, truncated and damaged files. An interrupted\n"
+    "                   check resumes where it stopped.\n"
+    "  gc               Delete the package files in the pool (pool_dir in the\n"
+    "                   configuration file) that no repository refers to anymore.\n"
+    "  serve            Serve the database directory to pacman over HTTP, on the\n"
+    "                   address given with --http.\n"
+    "  log              Print the journal of every package added, removed or\n"
+    "                   replaced, one change per line, after the one given with\n"
+    "                   --since; mirrors can use it to follow the repository.\n"
+    "  manifest         Print the root hash of the Merkle tree over the packages\n"
+    "                   in the database, which is kept up to date on every change.\n"
+    "  replicate <dir>  Make <dir> a mirror of the repository, copying only the\n"
+    "                   packages that differ according to both manifests, and\n"
+    "                   deleting the files that are no longer needed there.\n"
     "\n"
     "NOTE: In all of these cases, <pkgname> is the name of the package, without\n"
     "anything else. For example: pacman, and not pacman-3.5.3-1-i686.pkg.tar.xz";
 
+#define OPT_SINCE       256     // long options without a short one
+#define OPT_SNAPSHOT    257
+#define OPT_RESTORE     258
+#define OPT_BWLIMIT     259
+
 static struct argp_option options[] = {
   // long           key  arg       ?  description
     {"soft",        's', NULL,     0, "Don't delete any files (n/a for: sync)", 0},
     {"noconfirm",   'n', NULL,     0, "Don't confirm file deletion", 0},
     {"verbose",     'v', NULL,     0, "Be loud and verbose", 0},
+    {"files",       'f', NULL,     0, "Also write the files database for pacman -F (for: add, remove, update)", 0},
+    {"jobs",        'j', "N",      0, "Number of threads to use (default: number of processors)", 1},
+    {"background",  'b', NULL,     0, "Run with idle I/O and the lowest CPU priority, so as not to slow down serving", 1},
+    {"bwlimit",     OPT_BWLIMIT, "RATE", 0, "Read package files at no more than RATE bytes per second, "
+                                   "with an optional K, M or G suffix; implies --background", 1},
+    {"max-depth",   'd', "N",      0, "Also search N levels of subdirectories for packages (default: 0)", 1},
     {"config",      'c', "CONFIG", 0, "Alternate configuration file", 1},
+    {"metadata",    'm', "FILE",   0, "AUR metadata dump (packages-meta-v1.json[.gz]) to compare against (for: sync)", 2},
+    {"official",    'o', "DIR",    OPTION_ARG_OPTIONAL, "Compare against the pacman sync databases in DIR, by default "
+                                   PACMAN_SYNC_DIR " (for: sync)", 2},
+    {"sort",        'S', "FIELD",  0, "Sort by FIELD, descending if it starts with - (for: query)", 2},
+    {"names",       'N', NULL,     0, "Print each package name once per line, for scripts (for: list)", 2},
+    {"null",        '0', NULL,     0, "Like --names, but terminate names with NUL (for: list)", 2},
+    {"json",        'J', NULL,     0, "Like --names, but print a JSON array (for: list)", 2},
+    {"http",        'H', "ADDR",   0, "Listen on ADDR, as [host]:port (default: " HTTP_ADDR ") (for: serve)", 2},
+    {"since",       OPT_SINCE, "SEQ", 0, "Only print changes after sequence number SEQ (for: log)", 2},
+    {"snapshot",    OPT_SNAPSHOT, "NAME", 0, "List the packages in snapshot NAME instead (for: list)", 2},
+    {"restore",     OPT_RESTORE, NULL, 0, "Restore the snapshot instead of taking it (for: snapshot)", 2},
+    {"from",        'F', "FILE",   0, "Also read package names from FILE, one per line or separated by NUL; "
+                                   "- (also as a package name) reads stdin (for: add, remove)", 2},
     { 0, 0, NULL, 0, NULL, 0}
 };
 
+/* The positions of the keys in configuration[]. */
+enum config_key {
+    CONFIG_DB_DIR,
+    CONFIG_DB_NAME,
+    CONFIG_POOL_DIR,
+    CONFIG_KEEP_VERSIONS,
+    CONFIG_MAX_DEPTH,
+    CONFIG_HOOK_TIMEOUT,
+    CONFIG_SIGN_KEY,
+    CONFIG_END
+};
+
+/* The first CONFIG_LEN keys are required, the rest is optional. */
 static struct config_map configuration[] = {
-    { "db_dir", NULL },
-    { "db_name", NULL },
-    { NULL, NULL }
+    [CONFIG_DB_DIR]        = { "db_dir", NULL },
+    [CONFIG_DB_NAME]       = { "db_name", NULL },
+    [CONFIG_POOL_DIR]      = { "pool_dir", NULL },
+    [CONFIG_KEEP_VERSIONS] = { "keep_versions", NULL },
+    [CONFIG_MAX_DEPTH]     = { "max_depth", NULL },
+    [CONFIG_HOOK_TIMEOUT]  = { "hook_timeout", NULL },
+    [CONFIG_SIGN_KEY]      = { "sign_key", NULL },
+    [CONFIG_END]           = { NULL, NULL }
 };
 
+/*
+ * add_argument: append a package argument to arguments->argv, which grows
+ * as needed.
+ */
+static void add_argument(struct arguments *arguments, char *arg)
+{
+    if (arguments->argc == arguments->argv_size) {
+        arguments->argv_size = arguments->argv_size > 0 ? 2 * arguments->argv_size : ARG_BUFFER;
+        arguments->argv = realloc(arguments->argv, arguments->argv_size * sizeof (char *));
+    }
+    arguments->argv[arguments->argc++] = arg;
+}
+
+/*
+ * read_arguments: add the package names in the file at path (stdin if it
+ * is -) as arguments. Names are separated by newlines or NUL characters;
+ * the file is kept in memory as from_data, as argv points into it.
+ */
+static void read_arguments(struct arguments *arguments, const char *path)
+{
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    size_t len = 0, size = BUFSIZ;
+    char *data, *name;
+
+    if (in == NULL) {
+        char *errmsg = cs_strvcat("Error: open '", path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        exit(ERR_SYSTEM);
+    }
+
+    data = malloc(size + 1);
+    for (size_t n; (n = fread(data + len, 1, size - len, in)) > 0; ) {
+        len += n;
+        if (len == size)
+            data = realloc(data, (size *= 2) + 1);
+    }
+    if (ferror(in)) {
+        char *errmsg = cs_strvcat("Error: read '", path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+        exit(ERR_SYSTEM);
+    }
+    if (in != stdin)
+        fclose(in);
+    data[len] = '\0';
+    arguments->from_data = data;
+
+    /* the names took stdin, so questions are answered on the terminal */
+    if (in == stdin && !arguments->noconfirm && freopen("/dev/tty", "r", stdin) == NULL) {
+        fprintf(stderr, "Error: package names were read from stdin and there is no terminal "
+                        "to answer questions; use --noconfirm.\n");
+        exit(ERR_DEFAULT);
+    }
+
+    name = data;
+    for (size_t i = 0; i <= len; i++) {
+        if (data[i] != '\n' && data[i] != '\0')
+            continue;
+        data[i] = '\0';
+        if (i > 0 && data[i-1] == '\r')
+            data[i-1] = '\0';
+        if (*name != '\0')
+            add_argument(arguments, name);
+        name = data + i + 1;
+    }
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 #define _argeq(S)  cs_isprefix(arg, S)
 #define _acmd  arguments->command
     struct arguments *arguments = state->input;
+    char *end;
 
     switch(key) {
         case 's': // soft
@@ -86,9 +247,81 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'v':
             arguments->verbose = true;
             break;
+        case 'f':
+            arguments->files = true;
+            break;
+        case 'b':
+            arguments->background = true;
+            break;
+        case OPT_BWLIMIT:
+            errno = 0;
+            arguments->bwlimit = strtoul(arg, &end, 10);
+            if (errno == ERANGE)
+                argp_error(state, "rate too large: %s", arg);
+            if (end != arg && *end != '\0' && end[1] == '\0') {
+                const char *suffix = strchr("KMG", toupper((unsigned char)*end));
+                for (const char *s = "KMG"; suffix != NULL && s <= suffix; s++) {
+                    if (arguments->bwlimit > ULONG_MAX / 1024)
+                        argp_error(state, "rate too large: %s", arg);
+                    arguments->bwlimit *= 1024;
+                }
+                if (suffix != NULL)
+                    end++;
+            }
+            if (!isdigit((unsigned char)*arg) || *end != '\0' || arguments->bwlimit == 0)
+                argp_error(state, "invalid rate: %s", arg);
+            arguments->background = true;
+            break;
+        case 'j':
+            arguments->jobs = atoi(arg);
+            if (arguments->jobs < 1)
+                argp_error(state, "invalid number of jobs: %s", arg);
+            break;
+        case 'd':
+            arguments->max_depth = atoi(arg);
+            if (arguments->max_depth < 0 || !isdigit(*arg))
+                argp_error(state, "invalid depth: %s", arg);
+            break;
         case 'c': // alternative config
             arguments->config = arg;
             break;
+        case 'm':
+            arguments->metadata = arg;
+            break;
+        case 'S':
+            arguments->sort = arg;
+            break;
+        case 'N':
+            arguments->format = format_lines;
+            break;
+        case '0':
+            arguments->format = format_null;
+            break;
+        case 'J':
+            arguments->format = format_json;
+            break;
+        case 'H':
+            arguments->http = arg;
+            break;
+        case 'F':
+            if (arguments->from != NULL)
+                argp_error(state, "package names can only be read from one of --from and -");
+            arguments->from = arg;
+            break;
+        case OPT_SINCE:
+            arguments->since = strtoul(arg, &end, 10);
+            if (!isdigit(*arg) || *end != '\0')
+                argp_error(state, "invalid sequence number: %s", arg);
+            break;
+        case OPT_SNAPSHOT:
+            arguments->snapshot = arg;
+            break;
+        case OPT_RESTORE:
+            arguments->restore = true;
+            break;
+        case 'o':
+            arguments->official = arg != NULL ? arg : PACMAN_SYNC_DIR;
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num == 0) {
                 if (_argeq("add"))
@@ -101,18 +334,57 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
                     _acmd = action_update;
                 else if (_argeq("synchronize"))
                     _acmd = action_sync;
+                else if (_argeq("gc"))
+                    _acmd = action_gc;
+                else if (_argeq("clean"))
+                    _acmd = action_clean;
+                else if (_argeq("check"))
+                    _acmd = action_check;
+                else if (_argeq("rollback"))
+                    _acmd = action_rollback;
+                else if (_argeq("query"))
+                    _acmd = action_query;
+                else if (_argeq("rdeps"))
+                    _acmd = action_rdeps;
+                else if (_argeq("ingest"))
+                    _acmd = action_ingest;
+                else if (_argeq("serve"))
+                    _acmd = action_serve;
+                else if (_argeq("snapshot"))
+                    _acmd = action_snapshot;
+                else if (_argeq("split"))
+                    _acmd = action_split;
+                else if (_argeq("log"))
+                    _acmd = action_log;
+                else if (_argeq("manifest"))
+                    _acmd = action_manifest;
+                else if (_argeq("replicate"))
+                    _acmd = action_replicate;
                 else
                     argp_usage(state);
+            } else if (strcmp(arg, "-") == 0 && (_acmd == action_add || _acmd == action_remove)) {
+                if (arguments->from != NULL)
+                    argp_error(state, "package names can only be read from one of --from and -");
+                arguments->from = arg;
             } else {
-                arguments->argv[state->arg_num-1] = arg;
+                add_argument(arguments, arg);
             }
             break;
         case ARGP_KEY_END:
-            arguments->argc = state->arg_num - 1;
+            if (arguments->from != NULL && state->arg_num >= 1 && _acmd != action_add && _acmd != action_remove)
+                argp_error(state, "--from only applies to add and remove");
             // Make sure that the amount of arguments is correct
             if (  (state->arg_num < 1)
-               || (state->arg_num > 1 && (_acmd == action_update || _acmd == action_sync || _acmd == action_list))
-               || (state->arg_num == 1 && (_acmd == action_add || _acmd == action_remove)))
+               || (state->arg_num > 1 && (_acmd == action_update || _acmd == action_sync || _acmd == action_gc
+                                         || _acmd == action_clean || _acmd == action_serve
+                                         || _acmd == action_log || _acmd == action_manifest
+                                         || _acmd == action_check || _acmd == action_split))
+               || (state->arg_num > 2 && (_acmd == action_list || _acmd == action_ingest
+                                         || _acmd == action_replicate || _acmd == action_snapshot))
+               || (state->arg_num == 1 && (_acmd == action_rollback || _acmd == action_rdeps
+                                          || _acmd == action_ingest || _acmd == action_replicate))
+               || (state->arg_num == 1 && arguments->restore && _acmd == action_snapshot)
+               || (state->arg_num == 1 && arguments->from == NULL && (_acmd == action_add || _acmd == action_remove)))
                 argp_usage(state);
             break;
         default:
@@ -135,6 +407,22 @@ static char *tildestr(char *line)
     return line;
 }
 
+/*
+ * abspath: return path relative to the current directory as an absolute path,
+ * as repo changes into db_dir before doing anything.
+ * Warning: you must call free() on the result of this function.
+ */
+static char *abspath(const char *path)
+{
+    char cwd[PATH_MAX];
+
+    if (path == NULL)
+        return NULL;
+    if (*path == '/' || getcwd(cwd, sizeof cwd) == NULL)
+        return cs_strclone(path);
+    return cs_strvcat(cwd, "/", path, NULL);
+}
+
 static void load_config(struct arguments *arguments, char *default_config)
 {
     int i, ret;
@@ -158,7 +446,7 @@ static void load_config(struct arguments *arguments, char *default_config)
         exit(ERR_DEFAULT);
     }
 
-    arguments->db_dir = configuration[0].value;
+    arguments->db_dir = configuration[CONFIG_DB_DIR].value;
     /* Guarantee that arguments->db_dir ends with a / character */
     len = strlen(arguments->db_dir);
     if (arguments->db_dir[len-1] != '/') {
@@ -167,10 +455,44 @@ static void load_config(struct arguments *arguments, char *default_config)
         ptr[len++] = '/';
         ptr[len] = '\0';
         free(arguments->db_dir);
-        arguments->db_dir = configuration[0].value = ptr;
+        arguments->db_dir = configuration[CONFIG_DB_DIR].value = ptr;
     }
-    arguments->db_name = configuration[1].value;
+    arguments->db_name = configuration[CONFIG_DB_NAME].value;
     arguments->db_path = cs_strcat(arguments->db_dir, arguments->db_name);
+    arguments->pool_dir = configuration[CONFIG_POOL_DIR].value;
+    if (configuration[CONFIG_KEEP_VERSIONS].value != NULL) {
+        char *end;
+        arguments->keep_versions = strtol(configuration[CONFIG_KEEP_VERSIONS].value, &end, 10);
+        if (*end != '\0' || arguments->keep_versions < 0) {
+            fprintf(stderr, "Error: invalid value for key 'keep_versions' in configuration file\n");
+            exit(ERR_DEFAULT);
+        }
+        free(configuration[CONFIG_KEEP_VERSIONS].value);
+    }
+    if (configuration[CONFIG_MAX_DEPTH].value != NULL) {
+        /* the command line takes precedence */
+        char *end;
+        int depth = strtol(configuration[CONFIG_MAX_DEPTH].value, &end, 10);
+        if (*end != '\0' || depth < 0) {
+            fprintf(stderr, "Error: invalid value for key 'max_depth' in configuration file\n");
+            exit(ERR_DEFAULT);
+        }
+        if (arguments->max_depth < 0)
+            arguments->max_depth = depth;
+        free(configuration[CONFIG_MAX_DEPTH].value);
+    }
+    if (arguments->max_depth < 0)
+        arguments->max_depth = 0;
+    if (configuration[CONFIG_HOOK_TIMEOUT].value != NULL) {
+        char *end;
+        arguments->hook_timeout = strtol(configuration[CONFIG_HOOK_TIMEOUT].value, &end, 10);
+        if (*end != '\0' || arguments->hook_timeout < 0) {
+            fprintf(stderr, "Error: invalid value for key 'hook_timeout' in configuration file\n");
+            exit(ERR_DEFAULT);
+        }
+        free(configuration[CONFIG_HOOK_TIMEOUT].value);
+    }
+    arguments->sign_key = configuration[CONFIG_SIGN_KEY].value;
 }
 
 
@@ -187,13 +509,48 @@ int main(int argc, char **argv)
     arguments.soft = false;
     arguments.noconfirm = false;
     arguments.verbose = false;
+    arguments.files = false;
+    arguments.background = false;
+    arguments.bwlimit = 0;
+    arguments.jobs = sysconf(_SC_NPROCESSORS_ONLN);
     arguments.config = default_config;
+    arguments.metadata = NULL;
+    arguments.official = NULL;
+    arguments.sort = NULL;
+    arguments.format = format_columns;
+    arguments.from = NULL;
+    arguments.from_data = NULL;
+    arguments.http = HTTP_ADDR;
+    arguments.since = 0;
+    arguments.snapshot = NULL;
+    arguments.restore = false;
+    arguments.argv = NULL;
+    arguments.argc = 0;
+    arguments.argv_size = 0;
+    arguments.keep_versions = 0;
+    arguments.max_depth = -1;
+    arguments.hook_timeout = HOOK_TIMEOUT;
     arguments.command = action_nop;
 
     // parse the command line arguments and load config file
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.from != NULL) {
+        read_arguments(&arguments, arguments.from);
+        if (arguments.argc == 0) {
+            fprintf(stderr, "Error: no package names given.\n");
+            exit(ERR_DEFAULT);
+        }
+    }
     load_config(&arguments, default_config);
     if (arguments.verbose) printf("Using database: %s\n", arguments.db_path);
+    arguments.metadata = abspath(arguments.metadata);
+    arguments.official = abspath(arguments.official);
+    if (arguments.command == action_ingest || arguments.command == action_replicate)
+        arguments.argv[0] = abspath(arguments.argv[0]);
+
+    // the threads and programs started from here on inherit the priority
+    if (arguments.background && background_start(arguments.bwlimit) != 0)
+        perror("Warning: cannot lower the priority");
 
     // perform the given action by switching on first character
     chdir(arguments.db_dir);
@@ -213,6 +570,47 @@ int main(int argc, char **argv)
         case action_list:
             retval |= repo_list(&arguments);
             break;
+        case action_gc:
+            retval |= repo_gc(&arguments);
+            break;
+        case action_clean:
+            retval |= repo_clean(&arguments);
+            break;
+        case action_rollback:
+            retval |= repo_rollback(&arguments);
+            break;
+        case action_query:
+            retval |= repo_query(&arguments);
+            break;
+        case action_rdeps:
+            retval |= repo_rdeps(&arguments);
+            break;
+        case action_serve:
+            retval |= repo_serve(&arguments);
+            break;
+        case action_log:
+            retval |= repo_log(&arguments);
+            break;
+        case action_split:
+            retval |= repo_split(&arguments);
+            break;
+        case action_snapshot:
+            retval |= repo_snapshot(&arguments);
+            break;
+        case action_check:
+            retval |= repo_check(&arguments);
+            break;
+        case action_manifest:
+            retval |= repo_manifest(&arguments);
+            break;
+        case action_replicate:
+            retval |= repo_replicate(&arguments);
+            free(arguments.argv[0]);
+            break;
+        case action_ingest:
+            retval |= repo_ingest(&arguments);
+            free(arguments.argv[0]);
+            break;
         default:
             // the default case should never occur
             fprintf(stderr, "Error (main.c): The impossible just happened! Please file a bug report.\n");
@@ -224,6 +622,12 @@ int main(int argc, char **argv)
     free(arguments.db_name);
     free(arguments.db_dir);
     free(arguments.db_path);
+    free(arguments.pool_dir);
+    free(arguments.sign_key);
+    free(arguments.metadata);
+    free(arguments.official);
+    free(arguments.argv);
+    free(arguments.from_data);
 
     return retval;
 }
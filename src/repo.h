@@ -34,13 +34,23 @@
 #define ERR_SYSTEM    4
 #define ERR_UNDEF     8
 
-#define ARG_BUFFER      1024
+#define ARG_BUFFER      64      // initial length of Arguments.argv
 #define CONFIG_PATH     "~/.repo.conf"
 #define CONFIG_FAIL     0
 #define CONFIG_LEN      2
 
 #define SYSTEM_REPO_REMOVE "/usr/bin/repo-remove"
 #define SYSTEM_REPO_ADD    "/usr/bin/repo-add"
+#define SYSTEM_GPG         "/usr/bin/gpg"
+#define PACMAN_SYNC_DIR    "/var/lib/pacman/sync"
+#define HTTP_ADDR          "localhost:8080"
+#define STATE_DIR          ".repo"         // hidden directory in db_dir for the files of repo itself
+#define STAGE_DIR          STATE_DIR "/stage"  // where the next database is prepared
+#define SNAPSHOT_DIR       STATE_DIR "/snapshots"  // hardlink farms of earlier states
+#define HOOKS_DIR          STATE_DIR "/hooks"  // programs run after every transaction
+#define HOOK_TIMEOUT       300     // seconds a hook may run, unless configured otherwise
+#define BACKGROUND_NICE    19      // CPU priority with --background
+#define BATCH_MAX          65536   // longest argument list given to one run of a tool, far below ARG_MAX
 
 /* use PKG_EXT only! */
 #define PKG_STRICT_EXT  "-[0-9][a-z0-9._]*-[0-9]+-(any|i686|x86_64).pkg.tar.(gz|bz2|xz)$"
@@ -55,20 +65,60 @@ typedef enum action_command {
     action_update,          // automatically scan and add changed packages (by mod. date)
     action_sync,            // print out a list of outdated (according to AUR) packages
     action_list,            // list packages that are currently registered in the db
+    action_gc,              // delete unreferenced objects from the package pool
+    action_clean,           // remove orphaned files and missing database entries
+    action_rollback,        // go back to an archived version of one or more packages
+    action_query,           // select packages in the database by their fields
+    action_rdeps,           // print the packages depending on one or more packages
+    action_ingest,          // move packages from a build directory in and add them
+    action_serve,           // serve the database directory over HTTP
+    action_log,             // print the journal of changes to the database
+    action_manifest,        // print the root hash of the manifest of the database
+    action_replicate,       // copy what differs to a mirror directory
+    action_check,           // check the package files against the database
+    action_split,           // write a database for each architecture
+    action_snapshot,        // take or restore a snapshot of the repository
     action_nop              // no operation
 } Action;
 
+typedef enum list_format {
+    format_columns,         // file names in columns, for humans
+    format_lines,           // one package name per line
+    format_null,            // package names terminated by NUL
+    format_json             // JSON array of package names
+} ListFormat;
+
 typedef struct arguments {
     bool soft;              // don't delete files
     bool noconfirm;         // don't ask before doing something
     bool verbose;           // be loud and verbose
+    bool files;             // also maintain the files database
+    bool background;        // run with idle CPU and I/O priority
+    unsigned long bwlimit;  // background: bytes per second to read at most, 0 for no limit
+    int jobs;               // number of worker threads
     char *config;           // configuration file where next two values are stored
     char *db_name;          // config::database name
     char *db_dir;           // config::path to db location (with packages)
     char *db_path;          // db_name and db_path together
+    char *pool_dir;         // config::package pool shared between repositories (optional)
+    int keep_versions;      // config::number of older versions to archive (optional)
+    int max_depth;          // config::levels of subdirectories to search for packages (optional)
+    int hook_timeout;       // config::seconds a hook may run, 0 for no limit (optional)
+    char *sign_key;         // config::GPG key to sign the databases with (optional)
+    char *metadata;         // sync: local AUR metadata dump to compare against
+    char *official;         // sync: directory with the pacman sync databases
+    char *sort;             // query: field to sort the result by
+    ListFormat format;      // list: how to print the packages
+    char *http;             // serve: address to listen on
+    unsigned long since;    // log: last sequence number already seen
+    char *snapshot;         // list: snapshot to list instead of the database
+    bool restore;           // snapshot: restore the snapshot instead of taking it
     Action command;         // command to execute (one of: sync, update, add, remove, list)
-    char *argv[ARG_BUFFER]; // holds pointers to package arguments
+    char *from;             // add, remove: file with more package names, - for stdin
+    char *from_data;        // contents of from, which argv points into
+    char **argv;            // holds pointers to package arguments
     int argc;
+    int argv_size;          // allocated length of argv
 } Arguments;
 
 #endif // REPO_H
@@ -0,0 +1,307 @@
+/*
+ * scan.c
+ * Parallel recursive search for package files below the database directory.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "scan.h"
+#include "history.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/list_str.h"
+#include "libcassava/string.h"
+
+/* A directory that still has to be read. */
+struct scan_task {
+    char *path;             // relative to the root, "" for the root itself
+    int depth;
+};
+
+/*
+ * Every worker has its own deque of tasks: the owner takes the directory it
+ * found last from the back (depth first, so the deque stays short), while
+ * idle workers steal from the front, where the biggest subtrees are.
+ */
+struct scan_deque {
+    struct scan_task *tasks;
+    size_t head, tail, cap;
+    pthread_mutex_t lock;
+};
+
+struct scanner {
+    const char *root;
+    const struct scan_options *opt;
+    regex_t regex;
+    struct stat exclude;
+    bool has_exclude;
+    struct scan_deque *deques;
+    int workers;
+    size_t queued;          // tasks waiting in one of the deques
+    size_t pending;         // tasks queued or being read
+    int error;              // errno of a failure to read the root
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct scan_worker {
+    struct scanner *s;
+    int id;
+    NodeStr *found;
+    NodeStr *dirs;
+    int count;
+};
+
+static void deque_push(struct scan_deque *d, struct scan_task task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap && d->head > 0) {
+        memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof *d->tasks);
+        d->tail -= d->head;
+        d->head = 0;
+    }
+    if (d->tail == d->cap) {
+        d->cap = d->cap > 0 ? 2 * d->cap : 16;
+        d->tasks = realloc(d->tasks, d->cap * sizeof *d->tasks);
+    }
+    d->tasks[d->tail++] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static bool deque_take(struct scan_deque *d, struct scan_task *task, bool steal)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *task = steal ? d->tasks[d->head++] : d->tasks[--d->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static void schedule(struct scanner *s, int id, char *path, int depth)
+{
+    struct scan_task task = { path, depth };
+
+    deque_push(&s->deques[id], task);
+    pthread_mutex_lock(&s->lock);
+    s->queued++;
+    s->pending++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * take_task: get the next directory to read, from our own deque or else from
+ * another worker. Returns false once all directories have been read.
+ */
+static bool take_task(struct scanner *s, int id, struct scan_task *task)
+{
+    for (;;) {
+        bool found = deque_take(&s->deques[id], task, false);
+        for (int i = 1; !found && i < s->workers; i++)
+            found = deque_take(&s->deques[(id + i) % s->workers], task, true);
+
+        pthread_mutex_lock(&s->lock);
+        if (found) {
+            s->queued--;
+            pthread_mutex_unlock(&s->lock);
+            return true;
+        }
+        while (s->queued == 0 && s->pending > 0)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->pending == 0) {
+            pthread_mutex_unlock(&s->lock);
+            return false;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void finish_task(struct scanner *s)
+{
+    pthread_mutex_lock(&s->lock);
+    if (--s->pending == 0)
+        pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static char *join(const char *dir, const char *name)
+{
+    return *dir == '\0' ? cs_strclone(name) : cs_strvcat(dir, "/", name, NULL);
+}
+
+static void read_dir(struct scan_worker *w, const struct scan_task *task)
+{
+    struct scanner *s = w->s;
+    const struct scan_options *opt = s->opt;
+    char *path = join(s->root, task->path);
+    struct dirent *entry;
+    DIR *dirp;
+
+    dirp = opendir(path);
+    if (dirp == NULL) {
+        int error = errno;
+        debug_printf("scan: cannot read '%s'\n", path);
+        if (task->depth == 0) {
+            pthread_mutex_lock(&s->lock);
+            s->error = error;
+            pthread_mutex_unlock(&s->lock);
+        }
+        free(path);
+        return;
+    }
+
+    if (opt->dirs != NULL)
+        list_push(&w->dirs, cs_strclone(*task->path != '\0' ? task->path : "."));
+
+    while ((entry = readdir(dirp)) != NULL) {
+        const char *name = entry->d_name;
+        unsigned char type = entry->d_type;
+        struct stat st;
+        bool have_stat = false;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dirp), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            have_stat = true;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            if (task->depth >= opt->max_depth || *name == '.')
+                continue;
+            if (task->depth == 0 && strcmp(name, HISTORY_DIR) == 0)
+                continue;
+            if (s->has_exclude) {
+                if (!have_stat && fstatat(dirfd(dirp), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                if (st.st_dev == s->exclude.st_dev && st.st_ino == s->exclude.st_ino)
+                    continue;
+            }
+            schedule(s, w->id, join(task->path, name), task->depth + 1);
+        } else if (regexec(&s->regex, name, 0, NULL, 0) == 0) {
+            if (opt->newer != 0 && (fstatat(dirfd(dirp), name, &st, 0) != 0 || st.st_mtime <= opt->newer))
+                continue;
+            list_push(&w->found, join(task->path, name));
+            w->count++;
+        }
+    }
+
+    closedir(dirp);
+    free(path);
+}
+
+static void *scan_worker(void *data)
+{
+    struct scan_worker *w = data;
+    struct scan_task task;
+
+    while (take_task(w->s, w->id, &task)) {
+        read_dir(w, &task);
+        free(task.path);
+        finish_task(w->s);
+    }
+    return NULL;
+}
+
+int scan_packages(const char *dir, const char *regex, const struct scan_options *opt, NodeStr **head)
+{
+    debug_printf("scan_packages(%s)\n", dir);
+
+    struct scanner s;
+    struct scan_worker *workers;
+    pthread_t *threads;
+    int started, count = 0;
+
+    *head = NULL;
+    if (opt->dirs != NULL)
+        *opt->dirs = NULL;
+    memset(&s, 0, sizeof s);
+    s.root = dir;
+    s.opt = opt;
+    s.workers = opt->max_depth > 0 && opt->jobs > 1 ? opt->jobs : 1;
+    if (regcomp(&s.regex, regex, REG_EXTENDED | REG_NOSUB) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    s.has_exclude = opt->exclude != NULL && stat(opt->exclude, &s.exclude) == 0;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    s.deques = calloc(s.workers, sizeof *s.deques);
+    workers = calloc(s.workers, sizeof *workers);
+    threads = malloc(s.workers * sizeof *threads);
+    for (int i = 0; i < s.workers; i++) {
+        pthread_mutex_init(&s.deques[i].lock, NULL);
+        workers[i].s = &s;
+        workers[i].id = i;
+    }
+
+    /* the calling thread is worker 0 and starts with the root */
+    schedule(&s, 0, cs_strclone(""), 0);
+    for (started = 1; started < s.workers; started++)
+        if (pthread_create(&threads[started], NULL, scan_worker, &workers[started]) != 0)
+            break;
+    scan_worker(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    /* merge the results of all workers */
+    for (int i = 0; i < s.workers; i++) {
+        while (workers[i].found != NULL)
+            list_push(head, list_pop(&workers[i].found));
+        while (workers[i].dirs != NULL)
+            list_push(opt->dirs, list_pop(&workers[i].dirs));
+        count += workers[i].count;
+        free(s.deques[i].tasks);
+        pthread_mutex_destroy(&s.deques[i].lock);
+    }
+
+    if (s.error != 0) {
+        list_free_all(head);
+        if (opt->dirs != NULL)
+            list_free_all(opt->dirs);
+        errno = s.error;
+        count = -1;
+    }
+
+    free(threads);
+    free(workers);
+    free(s.deques);
+    regfree(&s.regex);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    return count;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,48 @@
+/*
+ * scan.h
+ * Parallel recursive search for package files below the database directory.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <time.h>
+
+#include "libcassava/list_str.h"
+
+struct scan_options {
+    int max_depth;          // levels of subdirectories to descend into, 0 for none
+    time_t newer;           // only return files modified after this time, if not 0
+    const char *exclude;    // directory not to descend into, such as the pool (optional)
+    int jobs;               // number of threads reading directories
+    NodeStr **dirs;         // receives the directories that were read, "." for dir (optional)
+};
+
+/*
+ * scan_packages: find the files in dir and its subdirectories whose names
+ * match regex (such as ".*" PKG_EXT). Subdirectories are read by several
+ * threads, which take work from each other when they run out. Hidden
+ * directories, symlinks to directories and the archive directory are skipped.
+ *
+ * The paths in head are relative to dir, in no particular order.
+ * Returns: the number of files found, or -1 on error (errno is set).
+ */
+extern int scan_packages(const char *dir, const char *regex, const struct scan_options *opt, NodeStr **head);
+
+#endif // SCAN_H
+
+/* vim: set cin ts=4 sw=4 et: */
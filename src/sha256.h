@@ -0,0 +1,53 @@
+/*
+ * sha256.h
+ * The SHA-256 message digest, as used for package checksums.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_HEX_LENGTH    (2*SHA256_DIGEST_LENGTH + 1)
+
+typedef struct sha256 {
+    uint32_t state[8];
+    uint64_t length;        // number of bytes hashed so far
+    unsigned char block[64];
+    size_t fill;            // number of bytes in block
+} Sha256;
+
+extern void sha256_init(Sha256 *ctx);
+extern void sha256_update(Sha256 *ctx, const void *data, size_t len);
+extern void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+/*
+ * sha256_hex: write the digest as a NUL-terminated lowercase hex string.
+ */
+extern void sha256_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char hex[SHA256_HEX_LENGTH]);
+
+/*
+ * sha256_file: compute the hex digest of the file at path.
+ * Returns 0, or -1 (and sets errno) if the file could not be read.
+ */
+extern int sha256_file(const char *path, char hex[SHA256_HEX_LENGTH]);
+
+#endif // SHA256_H
+
+/* vim: set cin ts=4 sw=4 et: */
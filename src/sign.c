@@ -0,0 +1,113 @@
+/*
+ * sign.c
+ * Signing databases and verifying package signatures with gpg.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "sign.h"
+#include "process.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+int sign_file(const char *path, const char *sig, const char *key)
+{
+    debug_printf("sign_file(%s)\n", path);
+
+    char *tmp = cs_strcat(sig, ".tmp");
+    char *argv[] = { SYSTEM_GPG, "--detach-sign", "--use-agent", "--no-armor", "--output", tmp,
+                     "--local-user", (char *)key, (char *)path, NULL };
+    struct process_job job = { argv, NULL, 0, -1 };
+    int status, ret = -1;
+
+    /* without a key, gpg uses its default one */
+    if (key == NULL) {
+        argv[6] = (char *)path;
+        argv[7] = NULL;
+    }
+
+    unlink(tmp);
+    status = process_run(&job);
+    if (status == 0) {
+        ret = rename(tmp, sig);
+    } else if (status > 0) {
+        fputs(job.output != NULL ? job.output : "", stderr);
+        errno = 0;      // gpg has reported what went wrong
+    }
+    if (ret != 0)
+        unlink(tmp);
+    free(job.output);
+    free(tmp);
+    return ret;
+}
+
+int sign_verify(char **paths, size_t count, int jobs, bool verbose)
+{
+    debug_printf("sign_verify(%zu)\n", count);
+
+    struct process_job *runs = calloc(count, sizeof (struct process_job));
+    char **sigs = calloc(count, sizeof (char *));
+    size_t n = 0;
+    int bad, saved;
+
+    for (size_t i = 0; i < count; i++) {
+        char *sig = cs_strcat(paths[i], ".sig");
+        if (access(sig, F_OK) != 0) {
+            free(sig);
+            continue;
+        }
+        sigs[n] = sig;
+        runs[n].argv = malloc(6 * sizeof (char *));
+        runs[n].argv[0] = SYSTEM_GPG;
+        runs[n].argv[1] = "--batch";
+        runs[n].argv[2] = "--verify";
+        runs[n].argv[3] = sig;
+        runs[n].argv[4] = paths[i];
+        runs[n].argv[5] = NULL;
+        n++;
+    }
+
+    bad = process_all(runs, n, jobs);
+    saved = errno;
+    for (size_t i = 0; i < n && bad >= 0; i++) {
+        if (runs[i].status != 0) {
+            fprintf(stderr, "Bad signature: %s\n", sigs[i]);
+            fputs(runs[i].output != NULL ? runs[i].output : "", stderr);
+        } else if (verbose) {
+            printf("Good signature: %s\n", sigs[i]);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(runs[i].output);
+        free(runs[i].argv);
+        free(sigs[i]);
+    }
+    free(sigs);
+    free(runs);
+    errno = saved;
+    return bad;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,47 @@
+/*
+ * sign.h
+ * Signing databases and verifying package signatures with gpg.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SIGN_H
+#define SIGN_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * sign_file: write a detached binary signature of the file at path to sig,
+ * made by key (the default key of gpg if NULL), with a single run of gpg.
+ * The signature is written under a temporary name and renamed, so sig is
+ * never partial. Returns 0, or -1 if gpg failed; errno is 0 if gpg ran and
+ * reported the problem itself.
+ */
+extern int sign_file(const char *path, const char *sig, const char *key);
+
+/*
+ * sign_verify: check the detached signature <path>.sig of each of the count
+ * files in paths, with up to jobs runs of gpg at the same time. Files
+ * without a signature are skipped; bad signatures are reported, with what gpg
+ * said about them.
+ * Returns the number of files whose signature is bad, or -1 (and sets errno)
+ * if gpg could not be run.
+ */
+extern int sign_verify(char **paths, size_t count, int jobs, bool verbose);
+
+#endif // SIGN_H
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,283 @@
+/*
+ * split.c
+ * Separate databases for each architecture, written from one scan of a
+ * directory with packages of several architectures.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "split.h"
+#include "database.h"
+#include "fsutil.h"
+#include "hashmap.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/list.h"
+#include "libcassava/string.h"
+
+/* A package file, with its desc entry once it has been read. */
+struct split_package {
+    const char *path;
+    char *name;
+    char *version;
+    char *arch;
+    struct timespec mtime;
+    char *desc;
+    bool needed;            // the newest of its name in some database
+};
+
+/* One database to write, for one architecture. */
+struct split_db {
+    const char *arch;
+    char *path;             // <stem>-<arch>.db<ext>
+    char *link;             // <stem>-<arch>.db, NULL if that is path
+    struct split_package **pkgs;
+    size_t count;
+    int result;
+};
+
+struct split_pool {
+    struct split_package **pkgs;
+    size_t count;
+    size_t next;            // next package to hand out to a worker
+    bool verbose;
+    pthread_mutex_t lock;
+};
+
+static bool newer(const struct split_package *a, const struct split_package *b)
+{
+    return a->mtime.tv_sec != b->mtime.tv_sec ? a->mtime.tv_sec > b->mtime.tv_sec
+                                              : a->mtime.tv_nsec > b->mtime.tv_nsec;
+}
+
+static int compare_packages(const void *a, const void *b)
+{
+    const struct split_package *x = *(struct split_package * const *)a;
+    const struct split_package *y = *(struct split_package * const *)b;
+    return strcmp(x->name, y->name);
+}
+
+static void *read_worker(void *data)
+{
+    struct split_pool *pool = data;
+
+    for (;;) {
+        struct split_package *pkg = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && pkg == NULL) {
+            if (pool->pkgs[pool->next]->needed)
+                pkg = pool->pkgs[pool->next];
+            pool->next++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (pkg == NULL)
+            break;
+
+        if (pool->verbose)
+            printf("Reading: %s\n", pkg->path);
+        pkg->desc = package_read_desc(pkg->path);
+        if (pkg->desc == NULL)
+            fprintf(stderr, "Warning: cannot read package '%s'; it is left out.\n", pkg->path);
+    }
+    return NULL;
+}
+
+static void *write_worker(void *data)
+{
+    struct split_db *db = data;
+    char **dirs = malloc((db->count + 1) * sizeof (char *));
+    char **descs = malloc((db->count + 1) * sizeof (char *));
+    char *old = cs_strcat(db->path, ".old");
+    size_t len = 0;
+
+    for (size_t i = 0; i < db->count; i++) {
+        if (db->pkgs[i]->desc == NULL)
+            continue;
+        dirs[len] = cs_strvcat(db->pkgs[i]->name, "-", db->pkgs[i]->version, NULL);
+        descs[len++] = db->pkgs[i]->desc;
+    }
+    db->result = db_write(db->path, old, dirs, descs, len);
+    if (db->result == 0 && db->link != NULL)
+        db->result = fs_symlink(db->path, db->link);
+    if (db->result != 0) {
+        char *errmsg = cs_strvcat("Error: write database '", db->path, "'", NULL);
+        perror(errmsg);
+        free(errmsg);
+    }
+    db->count = len;
+
+    for (size_t i = 0; i < len; i++)
+        free(dirs[i]);
+    free(dirs);
+    free(descs);
+    free(old);
+    return NULL;
+}
+
+int split_databases(const char *stem, const char *ext, NodeStr *files, int jobs, bool verbose)
+{
+    debug_printf("split_databases(%s)\n", stem);
+
+    struct split_pool pool;
+    struct split_package *pkgs;
+    struct split_db *dbs = NULL;
+    HashMap *newest = hashmap_new(1024), *best;
+    size_t count = 0, ndbs = 0;
+    pthread_t *threads;
+    bool *running;
+    int started = 0, retval = 0;
+
+    /* classify the files by the architecture in their names, keeping only
+     * the newest one of every name and architecture */
+    pkgs = calloc(list_length(files) + 1, sizeof *pkgs);
+    for (NodeStr *iter = files; iter != NULL; iter = iter->next) {
+        struct split_package *pkg = &pkgs[count];
+        const char *filename = strrchr(iter->data, '/') != NULL ? strrchr(iter->data, '/') + 1 : iter->data;
+        struct stat st;
+
+        if (!package_parse_filename(filename, &pkg->name, &pkg->version, &pkg->arch))
+            continue;
+        if (stat(iter->data, &st) != 0) {
+            free(pkg->name);
+            free(pkg->version);
+            free(pkg->arch);
+            continue;
+        }
+        pkg->path = iter->data;
+        pkg->mtime = st.st_mtim;
+        count++;
+
+        if (strcmp(pkg->arch, "any") != 0) {
+            bool known = false;
+            for (size_t i = 0; i < ndbs && !known; i++)
+                known = strcmp(dbs[i].arch, pkg->arch) == 0;
+            if (!known) {
+                dbs = realloc(dbs, (ndbs + 1) * sizeof *dbs);
+                memset(&dbs[ndbs], 0, sizeof *dbs);
+                dbs[ndbs++].arch = pkg->arch;
+            }
+        }
+    }
+
+    struct split_package **sorted = malloc((count + 1) * sizeof *sorted);
+    for (size_t i = 0; i < count; i++) {
+        char *key = cs_strvcat(pkgs[i].name, " ", pkgs[i].arch, NULL);
+        struct split_package *prev = hashmap_get(newest, key);
+        if (prev == NULL || newer(&pkgs[i], prev))
+            hashmap_put(newest, key, &pkgs[i]);
+        if (prev != NULL)
+            free(key);      // otherwise the map keeps it
+        sorted[i] = &pkgs[i];
+    }
+    qsort(sorted, count, sizeof *sorted, compare_packages);
+
+    /* every database takes the newest file of its own architecture or any */
+    for (size_t d = 0; d < ndbs; d++) {
+        struct split_db *db = &dbs[d];
+        best = hashmap_new(1024);
+        db->pkgs = malloc((count + 1) * sizeof *db->pkgs);
+        db->path = cs_strvcat(stem, "-", db->arch, ".db", ext, NULL);
+        db->link = *ext != '\0' ? cs_strvcat(stem, "-", db->arch, ".db", NULL) : NULL;
+
+        for (size_t i = 0; i < count; i++) {
+            struct split_package *pkg = sorted[i], *prev;
+            if (strcmp(pkg->arch, db->arch) != 0 && strcmp(pkg->arch, "any") != 0)
+                continue;
+            char *key = cs_strvcat(pkg->name, " ", pkg->arch, NULL);
+            bool newest_of_arch = hashmap_get(newest, key) == pkg;
+            free(key);
+            if (!newest_of_arch)
+                continue;
+            prev = hashmap_get(best, pkg->name);
+            if (prev == NULL || newer(pkg, prev))
+                hashmap_put(best, pkg->name, pkg);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (hashmap_get(best, sorted[i]->name) == sorted[i]) {
+                sorted[i]->needed = true;
+                db->pkgs[db->count++] = sorted[i];
+            }
+        }
+        hashmap_free(best, NULL);
+    }
+
+    /* read each package once, however many databases it goes into */
+    memset(&pool, 0, sizeof pool);
+    pool.pkgs = sorted;
+    pool.count = count;
+    pool.verbose = verbose;
+    pthread_mutex_init(&pool.lock, NULL);
+    if (jobs < 1)
+        jobs = 1;
+    threads = malloc(((size_t)jobs > ndbs ? (size_t)jobs : ndbs) * sizeof (pthread_t));
+    for (int i = 0; i < jobs && ndbs > 0; i++)
+        if (pthread_create(&threads[started], NULL, read_worker, &pool) == 0)
+            started++;
+    if (started == 0)
+        read_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    /* and write the databases side by side, as compressing them takes time */
+    running = calloc(ndbs + 1, sizeof (bool));
+    for (size_t d = 0; d < ndbs; d++) {
+        running[d] = pthread_create(&threads[d], NULL, write_worker, &dbs[d]) == 0;
+        if (!running[d])
+            write_worker(&dbs[d]);
+    }
+    for (size_t d = 0; d < ndbs; d++)
+        if (running[d])
+            pthread_join(threads[d], NULL);
+    free(running);
+    free(threads);
+
+    for (size_t d = 0; d < ndbs; d++) {
+        if (dbs[d].result != 0)
+            retval = -1;
+        else
+            printf("Wrote %s with %zu packages.\n", dbs[d].path, dbs[d].count);
+        free(dbs[d].path);
+        free(dbs[d].link);
+        free(dbs[d].pkgs);
+    }
+    if (retval == 0)
+        retval = ndbs;
+
+    hashmap_foreach(newest, e)
+        free((char *)e->key);
+    hashmap_free(newest, NULL);
+    for (size_t i = 0; i < count; i++) {
+        free(pkgs[i].name);
+        free(pkgs[i].version);
+        free(pkgs[i].arch);
+        free(pkgs[i].desc);
+    }
+    free(sorted);
+    free(pkgs);
+    free(dbs);
+    return retval;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
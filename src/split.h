@@ -0,0 +1,42 @@
+/*
+ * split.h
+ * Separate databases for each architecture, written from one scan of a
+ * directory with packages of several architectures.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <stdbool.h>
+
+#include "libcassava/list_str.h"
+
+/*
+ * split_databases: sort the package files in files by the architecture in
+ * their names and write a database <stem>-<arch>.db<ext> for each
+ * architecture found, with the newest file (by modification time) of every
+ * package of that architecture or any. Every package that goes into any
+ * database is read exactly once, by one of jobs threads, and the databases
+ * are then written concurrently from these entries. The previous databases
+ * are kept as <stem>-<arch>.db<ext>.old, and <stem>-<arch>.db points at the
+ * new one. Returns the number of databases written, or -1 on error.
+ */
+extern int split_databases(const char *stem, const char *ext, NodeStr *files, int jobs, bool verbose);
+
+#endif // SPLIT_H
+
+/* vim: set cin ts=4 sw=4 et: */
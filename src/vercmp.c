@@ -0,0 +1,150 @@
+/*
+ * vercmp.c
+ * Comparison of package versions, following the rules of pacman's vercmp.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "vercmp.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcassava/string.h"
+
+/*
+ * segcmp: compare two version strings segment by segment, where segments
+ * are runs of digits or of letters; numeric segments are newer than alpha
+ * segments, and a longer separator run is newer too.
+ */
+static int segcmp(const char *one, const char *two)
+{
+    const char *end1 = one, *end2 = two;
+    size_t len1, len2;
+    int isnum, rc;
+
+    if (strcmp(one, two) == 0)
+        return 0;
+
+    while (*one != '\0' && *two != '\0') {
+        while (*one != '\0' && !isalnum((unsigned char)*one)) one++;
+        while (*two != '\0' && !isalnum((unsigned char)*two)) two++;
+        if (*one == '\0' || *two == '\0')
+            break;
+
+        /* compare the length of the separators between the segments */
+        if (one - end1 != two - end2)
+            return one - end1 < two - end2 ? -1 : 1;
+
+        end1 = one;
+        end2 = two;
+        isnum = isdigit((unsigned char)*one);
+        if (isnum) {
+            while (isdigit((unsigned char)*end1)) end1++;
+            while (isdigit((unsigned char)*end2)) end2++;
+        } else {
+            while (isalpha((unsigned char)*end1)) end1++;
+            while (isalpha((unsigned char)*end2)) end2++;
+        }
+
+        /* segments of different type: numeric is newer */
+        if (two == end2)
+            return isnum ? 1 : -1;
+
+        if (isnum) {
+            while (*one == '0' && one < end1 - 1) one++;
+            while (*two == '0' && two < end2 - 1) two++;
+            if (end1 - one != end2 - two)
+                return end1 - one > end2 - two ? 1 : -1;
+        }
+
+        len1 = end1 - one;
+        len2 = end2 - two;
+        rc = memcmp(one, two, len1 < len2 ? len1 : len2);
+        if (rc == 0 && len1 != len2)
+            rc = len1 < len2 ? -1 : 1;
+        if (rc != 0)
+            return rc < 0 ? -1 : 1;
+
+        one = end1;
+        two = end2;
+    }
+
+    if (*one == '\0' && *two == '\0')
+        return 0;
+
+    /* "1.0" is newer than "1.0a", but older than "1.0.1" */
+    if ((*one == '\0' && !isalpha((unsigned char)*two)) || isalpha((unsigned char)*one))
+        return -1;
+    return 1;
+}
+
+/*
+ * split: split evr (which is modified) into epoch, version and release.
+ */
+static void split(char *evr, const char **epoch, const char **version, const char **release)
+{
+    char *s = evr, *se;
+
+    while (isdigit((unsigned char)*s))
+        s++;
+    se = strrchr(s, '-');
+
+    if (*s == ':') {
+        *s++ = '\0';
+        *epoch = *evr == '\0' ? "0" : evr;
+        *version = s;
+    } else {
+        *epoch = "0";
+        *version = evr;
+    }
+
+    if (se != NULL) {
+        *se++ = '\0';
+        *release = se;
+    } else {
+        *release = NULL;
+    }
+}
+
+int vercmp(const char *a, const char *b)
+{
+    const char *epoch1, *version1, *release1;
+    const char *epoch2, *version2, *release2;
+    char *full1, *full2;
+    int ret;
+
+    if (strcmp(a, b) == 0)
+        return 0;
+
+    full1 = cs_strclone(a);
+    full2 = cs_strclone(b);
+    split(full1, &epoch1, &version1, &release1);
+    split(full2, &epoch2, &version2, &release2);
+
+    ret = segcmp(epoch1, epoch2);
+    if (ret == 0) {
+        ret = segcmp(version1, version2);
+        if (ret == 0 && release1 != NULL && release2 != NULL)
+            ret = segcmp(release1, release2);
+    }
+
+    free(full1);
+    free(full2);
+    return ret;
+}
+
+/* vim: set cin ts=4 sw=4 et: */
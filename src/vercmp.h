@@ -0,0 +1,31 @@
+/*
+ * vercmp.h
+ * Comparison of package versions, following the rules of pacman's vercmp.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef VERCMP_H
+#define VERCMP_H
+
+/*
+ * vercmp: compare two full package versions of the form [epoch:]pkgver[-pkgrel].
+ * Returns -1, 0 or 1 if a is older than, the same as, or newer than b.
+ */
+extern int vercmp(const char *a, const char *b);
+
+#endif // VERCMP_H
+
+/* vim: set cin ts=4 sw=4 et: */
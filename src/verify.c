@@ -0,0 +1,293 @@
+/*
+ * verify.c
+ * Parallel verification of package files against the sizes and checksums
+ * recorded in the database.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "repo.h"
+#include "verify.h"
+#include "archive.h"
+#include "background.h"
+#include "sha256.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libcassava/debug.h"
+#include "libcassava/string.h"
+
+#define QUEUE_LEN   1024    // files in flight; a slot is reused once all files before it are done
+#define READ_SIZE   (256*1024)
+
+struct verify_slot {
+    char *path;
+    char *sha256;
+    off_t size;
+    bool done;
+};
+
+struct verifier {
+    struct verify_slot slots[QUEUE_LEN];
+    unsigned long added;        // files given to verifier_add
+    unsigned long taken;        // files handed to a thread
+    unsigned long done;         // every file before this one is verified
+    bool finishing;
+    verify_callback callback;
+    void *data;
+    pthread_t *threads;
+    int started;
+    pthread_mutex_t lock;
+    pthread_mutex_t report;     // one callback at a time
+    pthread_cond_t work;        // a file was added, or there will be no more
+    pthread_cond_t space;       // done has advanced
+};
+
+/*
+ * walk_archive: read the archive at path to its end, which fails if it has
+ * been cut off; for when neither size nor checksum are known.
+ */
+static VerifyResult walk_archive(const char *path, int *err)
+{
+    struct archive *ar = archive_open(path);
+    struct tar_entry *entry;
+    int ret;
+
+    if (ar == NULL) {
+        *err = errno;
+        return verify_unreadable;
+    }
+    while ((ret = archive_next(ar, &entry)) == 1)
+        ;
+    if (archive_close(ar) != 0 || ret < 0)
+        return verify_truncated;
+    return verify_ok;
+}
+
+static VerifyResult verify_file(const char *path, off_t size, const char *sha256, int *err)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_HEX_LENGTH];
+    VerifyResult result = verify_ok;
+    struct stat st;
+    Sha256 ctx;
+    char *buf;
+    ssize_t n;
+    bool drop;
+    int fd;
+
+    *err = 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *err = errno;
+        return errno == ENOENT ? verify_missing : verify_unreadable;
+    }
+    if (fstat(fd, &st) != 0) {
+        *err = errno;
+        close(fd);
+        return verify_unreadable;
+    }
+    if (size >= 0 && st.st_size != size) {
+        close(fd);
+        return st.st_size < size ? verify_truncated : verify_size;
+    }
+    if (sha256 == NULL) {
+        close(fd);
+        return size < 0 ? walk_archive(path, err) : verify_ok;
+    }
+
+    /* read once from start to end: ask for a larger readahead; in the
+     * background, the pages of files that were not cached before are
+     * dropped again, so that a check of the whole repository does not push
+     * the packages being served out of the page cache */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    drop = background_open(fd);
+    buf = malloc(READ_SIZE);
+    sha256_init(&ctx);
+    while ((n = read(fd, buf, READ_SIZE)) > 0) {
+        background_read(n);
+        sha256_update(&ctx, buf, n);
+    }
+    if (n < 0) {
+        *err = errno;
+        result = verify_unreadable;
+    } else {
+        sha256_final(&ctx, digest);
+        sha256_hex(digest, hex);
+        if (strcasecmp(hex, sha256) != 0)
+            result = verify_checksum;
+    }
+    background_done(fd, drop);
+    free(buf);
+    close(fd);
+    return result;
+}
+
+/*
+ * verify_slot: verify the file added as number n, report it, and move done
+ * past every file that is finished now.
+ */
+static void verify_slot(struct verifier *v, unsigned long n)
+{
+    struct verify_slot *slot = &v->slots[n % QUEUE_LEN];
+    VerifyResult result;
+    int err;
+
+    result = verify_file(slot->path, slot->size, slot->sha256, &err);
+    pthread_mutex_lock(&v->report);
+    v->callback(n, slot->path, result, err, v->data);
+    pthread_mutex_unlock(&v->report);
+
+    pthread_mutex_lock(&v->lock);
+    free(slot->path);
+    free(slot->sha256);
+    slot->path = slot->sha256 = NULL;
+    slot->done = true;
+    while (v->done < v->taken && v->slots[v->done % QUEUE_LEN].done) {
+        v->slots[v->done % QUEUE_LEN].done = false;
+        v->done++;
+    }
+    pthread_cond_broadcast(&v->space);
+    pthread_mutex_unlock(&v->lock);
+}
+
+static void *verify_worker(void *data)
+{
+    struct verifier *v = data;
+    unsigned long n;
+
+    for (;;) {
+        pthread_mutex_lock(&v->lock);
+        while (v->taken == v->added && !v->finishing)
+            pthread_cond_wait(&v->work, &v->lock);
+        if (v->taken == v->added) {
+            pthread_mutex_unlock(&v->lock);
+            break;
+        }
+        n = v->taken++;
+        pthread_mutex_unlock(&v->lock);
+
+        verify_slot(v, n);
+    }
+    return NULL;
+}
+
+struct verifier *verifier_start(int jobs, verify_callback callback, void *data)
+{
+    debug_printf("verifier_start(%d)\n", jobs);
+
+    struct verifier *v = calloc(1, sizeof *v);
+
+    v->callback = callback;
+    v->data = data;
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_mutex_init(&v->report, NULL);
+    pthread_cond_init(&v->work, NULL);
+    pthread_cond_init(&v->space, NULL);
+
+    if (jobs < 1)
+        jobs = 1;
+    v->threads = malloc(jobs * sizeof (pthread_t));
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&v->threads[v->started], NULL, verify_worker, v) == 0)
+            v->started++;
+    return v;
+}
+
+void verifier_add(struct verifier *v, const char *path, off_t size, const char *sha256)
+{
+    struct verify_slot *slot;
+
+    pthread_mutex_lock(&v->lock);
+    while (v->added - v->done >= QUEUE_LEN)
+        pthread_cond_wait(&v->space, &v->lock);
+    slot = &v->slots[v->added % QUEUE_LEN];
+    slot->path = cs_strclone(path);
+    slot->sha256 = sha256 != NULL ? cs_strclone(sha256) : NULL;
+    slot->size = size;
+    v->added++;
+    pthread_cond_signal(&v->work);
+
+    /* no threads could be started: do it here */
+    if (v->started == 0) {
+        unsigned long n = v->taken++;
+        pthread_mutex_unlock(&v->lock);
+        verify_slot(v, n);
+        return;
+    }
+    pthread_mutex_unlock(&v->lock);
+}
+
+unsigned long verifier_done(struct verifier *v)
+{
+    unsigned long done;
+
+    pthread_mutex_lock(&v->lock);
+    done = v->done;
+    pthread_mutex_unlock(&v->lock);
+    return done;
+}
+
+unsigned long verifier_finish(struct verifier *v, bool cancel)
+{
+    unsigned long done;
+
+    pthread_mutex_lock(&v->lock);
+    if (cancel) {
+        for (unsigned long n = v->taken; n < v->added; n++) {
+            free(v->slots[n % QUEUE_LEN].path);
+            free(v->slots[n % QUEUE_LEN].sha256);
+        }
+        v->added = v->taken;
+    }
+    v->finishing = true;
+    pthread_cond_broadcast(&v->work);
+    pthread_mutex_unlock(&v->lock);
+
+    for (int i = 0; i < v->started; i++)
+        pthread_join(v->threads[i], NULL);
+    done = v->done;
+
+    free(v->threads);
+    pthread_mutex_destroy(&v->lock);
+    pthread_mutex_destroy(&v->report);
+    pthread_cond_destroy(&v->work);
+    pthread_cond_destroy(&v->space);
+    free(v);
+    return done;
+}
+
+const char *verify_result_string(VerifyResult result)
+{
+    switch (result) {
+        case verify_ok:         return "ok";
+        case verify_missing:    return "missing";
+        case verify_truncated:  return "truncated";
+        case verify_size:       return "size mismatch";
+        case verify_checksum:   return "checksum mismatch";
+        case verify_unreadable: return "unreadable";
+    }
+    return "unknown";
+}
+
+/* vim: set cin ts=4 sw=4 et: */
@@ -0,0 +1,80 @@
+/*
+ * verify.h
+ * Parallel verification of package files against the sizes and checksums
+ * recorded in the database.
+ *
+ * Copyright (c) 2011-2012 Ben Morgan <neembi@googlemail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* What was found out about a package file. */
+typedef enum verify_result {
+    verify_ok,
+    verify_missing,         // the file does not exist
+    verify_truncated,       // shorter than recorded, or the archive ends early
+    verify_size,            // longer than recorded
+    verify_checksum,        // the SHA-256 checksum differs
+    verify_unreadable       // some other error, see errno
+} VerifyResult;
+
+/*
+ * Called for every file that was verified, one call at a time, from the
+ * thread that verified it; n is the position in which it was added.
+ */
+typedef void (*verify_callback)(unsigned long n, const char *path, VerifyResult result, int err, void *data);
+
+struct verifier;
+
+/*
+ * verifier_start: start jobs threads that verify the files given to
+ * verifier_add, reporting each result to callback.
+ */
+extern struct verifier *verifier_start(int jobs, verify_callback callback, void *data);
+
+/*
+ * verifier_add: queue the file at path to be verified against size and the
+ * hex SHA-256 checksum sha256; size may be negative and sha256 NULL if they
+ * are unknown, in which case the archive is read to its end instead.
+ * Waits while too many files are queued, so that the files can be streamed
+ * from the database without holding all of them in memory.
+ */
+extern void verifier_add(struct verifier *v, const char *path, off_t size, const char *sha256);
+
+/*
+ * verifier_done: the number of files added, counting from the first one,
+ * that have all been verified; a check can resume from there.
+ */
+extern unsigned long verifier_done(struct verifier *v);
+
+/*
+ * verifier_finish: wait for the queued files to be verified, or only for
+ * those that are being verified right now if cancel is true, then stop the
+ * threads and free v. Returns verifier_done at that point.
+ */
+extern unsigned long verifier_finish(struct verifier *v, bool cancel);
+
+/*
+ * verify_result_string: a short description of result, as printed.
+ */
+extern const char *verify_result_string(VerifyResult result);
+
+#endif // VERIFY_H
+
+/* vim: set cin ts=4 sw=4 et: */